@@ -39,6 +39,7 @@ namespace nvmm{
 typedef int64_t EpochCounter;
 
 typedef std::function<void(pid_t)> EpochManagerCallback;
+typedef std::function<void(EpochCounter)> EpochAdvanceCallback;
 
 class EpochManager
 {
@@ -71,12 +72,16 @@ public:
      * \details
      * This check is inherently racy as the active region may end by the time
      * the function returns.
-     * On the other hand, we have no way to tell if a thread is running inside
-     * a critical region as we don't maintain per-thread state.
      */
     bool exists_active_critical();
 
-    /** Return the last reported epoch by this epoch manager */
+    /**
+     * \brief Return the last reported epoch by this epoch manager
+     *
+     * \details
+     * Inside a critical region, the epoch the region joined; it does not
+     * change until the region ends.
+     */
     EpochCounter reported_epoch();
 
     /** Return the frontier epoch */
@@ -84,6 +89,19 @@ public:
 
     void register_failure_callback(EpochManagerCallback cb);
 
+    /**
+     * \brief Call cb with the new reported epoch whenever the heartbeat
+     * moves the reported epoch of this process
+     *
+     * \details
+     * Returns a handle for unregister_advance_callback. The callbacks run on
+     * the heartbeat thread and should not block.
+     */
+    int register_advance_callback(EpochAdvanceCallback cb);
+
+    /** Remove a callback; once it returns, the callback is no longer running */
+    void unregister_advance_callback(int handle);
+
     /** Set debug logging level */
     void set_debug_level(int level);
 
@@ -108,6 +126,10 @@ public:
 
     EpochCounter reported_epoch();
 
+    // Calls fn(arg) on this thread when its innermost EpochOp ends, before it
+    // leaves the critical region, so work buffered inside the op is
+    // published within the epoch of the op. Each call runs once.
+    static void AtExit(void (*fn)(void *), void *arg);
 
     EpochOp(const EpochOp&)            = delete;
     EpochOp& operator=(const EpochOp&) = delete;
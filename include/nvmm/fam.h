@@ -39,8 +39,15 @@ void fam_persist(const void *addr, size_t len);
 
 void* fam_memset_persist(void *pmemdest, int c, size_t len);
 
+// same as fam_memset_persist, but with non-temporal stores that do not pull
+// the destination into the cache
+void* fam_memset_nt_persist(void *pmemdest, int c, size_t len);
+
 void *fam_memcpy(void *dest, const void *src, size_t n);
 
+// copies and persists; large copies use non-temporal stores
+void *fam_memcpy_persist(void *pmemdest, const void *src, size_t len);
+
 int fam_memcmp(const void *s1, const void *s2, size_t n);
 
 int64_t fam_read_64(const void *addr);
@@ -26,6 +26,8 @@
 #ifndef _NVMM_HEAP_H_
 #define _NVMM_HEAP_H_
 
+#include <vector>
+
 #include "nvmm/epoch_manager.h"
 #include "nvmm/error_code.h"
 #include "nvmm/global_ptr.h"
@@ -33,7 +35,51 @@
 namespace nvmm {
 
 #define NVMM_NO_BG_THREAD 0x0001
+#define NVMM_THREAD_CACHE 0x0002
+#define NVMM_EAGER_MERGE 0x0004
 #define NVMM_FAST_ALLOC 0x0010
+#define NVMM_SLAB_ALLOC 0x0020
+#define NVMM_LAZY_ZERO 0x0040
+
+// Allocator statistics, filled in by Heap::GetStats. All sizes are in bytes.
+struct LevelStats {
+    size_t chunk_size;
+    uint64_t free_chunks; // on the freelists, including chunks not zeroed yet
+    uint64_t used_chunks; // allocated chunks (slabs included); exact only
+};
+
+struct ShelfStats {
+    ShelfIndex shelf_idx;
+    bool huge;             // holds a single huge object and no levels
+    size_t size;           // the size the shelf can grow to
+    uint64_t grow_level;   // the level of the largest chunk grown so far
+    size_t grown_size;     // bytes the shelf has grown to
+    size_t free_bytes;     // in free chunks
+    size_t used_bytes;     // in allocated chunks, see HeapStats::exact
+    uint64_t delayed_free_chunks; // waiting for their epoch to pass
+    size_t delayed_free_bytes;    // exact only
+    size_t largest_free_chunk;
+    double fragmentation; // 1 - largest_free_chunk / free_bytes
+    std::vector<LevelStats> levels; // levels 0 to grow_level
+};
+
+struct HeapStats {
+    // Without exact, the free chunk counts come from counters kept by the
+    // freelists, so used_bytes is grown_size - free_bytes and counts the
+    // chunks held by thread caches; exact walks the freelists, the delayed
+    // free lists and the header entries (the results are only exact if
+    // nobody allocates or frees meanwhile).
+    bool exact;
+    size_t size;
+    size_t grown_size;
+    size_t free_bytes;
+    size_t used_bytes;
+    uint64_t delayed_free_chunks;
+    size_t delayed_free_bytes;
+    size_t largest_free_chunk;
+    double fragmentation;
+    std::vector<ShelfStats> shelves;
+};
 
 class Heap {
   public:
@@ -51,9 +97,44 @@ class Heap {
     virtual GlobalPtr Alloc(size_t size) = 0;
     virtual void Free(GlobalPtr global_ptr) = 0;
 
+    // Allocates up to count objects of the same size into ptrs and returns
+    // the number of objects allocated
+    virtual size_t AllocBatch(size_t size, size_t count, GlobalPtr *ptrs) {
+        size_t i;
+        for (i = 0; i < count; i++) {
+            ptrs[i] = Alloc(size);
+            if (!ptrs[i].IsValid())
+                break;
+        }
+        return i;
+    };
+    virtual void FreeBatch(GlobalPtr *ptrs, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            Free(ptrs[i]);
+    };
+    // Sized free: size must be what the object was allocated (or last
+    // grown by Realloc) with. Heaps that can use it skip looking the size
+    // up in the heap metadata.
+    virtual void Free(GlobalPtr global_ptr, size_t size) { Free(global_ptr); };
+
     virtual GlobalPtr Alloc(EpochOp &op, size_t size) { return (GlobalPtr)0; };
     virtual void Free(EpochOp &op, GlobalPtr global_ptr){};
     virtual void Free(EpochOp &op, Offset offset){};
+    virtual void Free(EpochOp &op, GlobalPtr global_ptr, size_t size) {
+        Free(op, global_ptr);
+    };
+    virtual void FreeBatch(EpochOp &op, GlobalPtr *ptrs, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            Free(op, ptrs[i]);
+    };
+
+    // Resizes an object to size bytes, in place if it can; otherwise moves
+    // it to a new object and frees the old one. Returns the object, or an
+    // invalid pointer (leaving the old object alone) if there is no room.
+    // Realloc of an invalid pointer is Alloc.
+    virtual GlobalPtr Realloc(GlobalPtr global_ptr, size_t size) {
+        return (GlobalPtr)0;
+    };
 
     // Functions for Offset based free and alloc function
     virtual Offset AllocOffset(size_t size) { return 0; };
@@ -69,8 +150,16 @@ class Heap {
     virtual void OfflineRecover(){};
     virtual void OnlineRecover(){};
     virtual void Stats(){};
+    // Fills in stats for every shelf of the heap; exact trades time for
+    // precision (see HeapStats)
+    virtual ErrorCode GetStats(HeapStats *stats, bool exact = false) {
+        return NOT_YET_IMPLEMENTED;
+    };
     virtual size_t Size() { return 0; };
     virtual void OfflineFree(){};
+    // Chunks waiting on the delayed free lists of the heap (an estimate
+    // while others free)
+    virtual uint64_t DelayedFreeBacklog() { return 0; };
     virtual void delayed_free_fn(){};
 };
 
@@ -40,6 +40,7 @@
 #include "nvmm/fam.h"
 #include "nvmm/heap.h"
 
+#include "common/scheduler.h"
 #include "shelf_mgmt/pool.h"
 
 #include "shelf_usage/ownership.h"
@@ -53,7 +54,7 @@ namespace nvmm {
 DistHeap::DistHeap(PoolId pool_id)
     : pool_id_{pool_id}, pool_{pool_id}, is_open_{false},
       ownership_{NULL}, freelists_{NULL},
-      cleaner_running_{false}, cleaner_stop_{false}
+      cleaner_task_{-1}
 {
     int rc = pthread_rwlock_init(&rwlock_, NULL);
     assert(rc == 0);
@@ -294,7 +295,7 @@ ErrorCode DistHeap::Open()
 
     is_open_ = true;
 
-    // start the cleaner thread
+    // start the cleaner
     int rc = StartWorker();
     if (rc != 0)
     {
@@ -312,7 +313,7 @@ ErrorCode DistHeap::Close()
     assert(IsOpen() == true);
     ErrorCode ret = NO_ERROR;
 
-    // stop the cleaner thread
+    // stop the cleaner
     int rc = StopWorker();
     if (rc != 0)
     {
@@ -599,104 +600,80 @@ void *DistHeap::GlobalToLocal(GlobalPtr global_ptr)
 
 int DistHeap::StartWorker()
 {
-    // start the cleaner thread
+    // the cleaner runs on the background threads of the process
     std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-    if (cleaner_running_ == true)
+    if (cleaner_task_ >= 0)
     {
-        LOG(trace) << " cleaner thread is already running...";
+        LOG(trace) << " cleaner is already started...";
         return 0;
     }
-    cleaner_stop_ = false;
-    cleaner_running_ = true;
-    cleaner_thread_ = std::thread(&DistHeap::BackgroundWorker, this);
+    cleaner_task_ = Scheduler::GetInstance()->AddTask(
+        [this] { return CleanerRound(); }, kWorkerSleepMicroSeconds);
     return 0;
 }    
 
 int DistHeap::StopWorker()
 {
-    // signal the cleaner to stop
+    int task;
     {
         std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-        if (cleaner_running_ == false)
+        if (cleaner_task_ < 0)
         {
-            LOG(trace) << " cleaner thread is not running...";
+            LOG(trace) << " cleaner is not running...";
             return 0;
         }
-        cleaner_stop_ = true;
-    }
-        
-    // join the cleaner thread
-    if(cleaner_thread_.joinable())
-    {
-        cleaner_thread_.join();
-    }
-
-    {
-        std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-        cleaner_stop_ = false;
-        cleaner_running_ = false;
+        task = cleaner_task_;
+        cleaner_task_ = -1;
     }
+    // waits for a round in progress
+    Scheduler::GetInstance()->RemoveTask(task);
     return 0;
 }    
 
-void DistHeap::BackgroundWorker()
+uint64_t DistHeap::CleanerRound()
 {
     TRACE();  
     assert(IsOpen() == true);
 
-    while(1)
-    {
-        LOG(trace) << "cleaner: sleep";
-        usleep(kWorkerSleepMicroSeconds);
-        LOG(trace) << "cleaner: wakeup";
+    LOG(trace) << "cleaner: wakeup";
 
-        // check if we are shutting down...
-        {
-            std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-            if (cleaner_stop_ == true)
-            {
-                LOG(trace) << "cleaner: exiting...";
-                goto out;
-            }
-        }
-
-        // check ownership and do recovery if inconsistency is found
-        LOG(trace) << "cleaner: consistency checking";
-        for (size_t i=0; i<ownership_->Count(); i++)
+    // check ownership and do recovery if inconsistency is found
+    LOG(trace) << "cleaner: consistency checking";
+    for (size_t i=0; i<ownership_->Count(); i++)
+    {
+        ownership_->CheckAndRevokeItem(i,
+                                       [this](ShelfIndex shelf_idx)
+                                       {
+                                           return RecoverShelfHeap(shelf_idx);
+                                       }
+                                       );
+    }
+    
+    // clean up freelists
+    // TODO: holding readlock may prevent someone from owning a new heap
+    ReadLock();
+    for (auto& it : map_)
+    {
+        ShelfIndex shelf_idx = it.first;            
+        GlobalPtr ptr;
+        // free one pointer from one heap per iteration
+        ErrorCode ret = freelists_->GetPointer(shelf_idx, ptr);
+        if (ret == NO_ERROR)
         {
-            ownership_->CheckAndRevokeItem(i,
-                                           [this](ShelfIndex shelf_idx)
-                                           {
-                                               return RecoverShelfHeap(shelf_idx);
-                                           }
-                                           );
+            LOG(trace) << "cleaner: free ptr " << ptr;            
+            Free(ptr);
+            continue;
         }
-        
-        // clean up freelists
-        // TODO: holding readlock may prevent someone from owning a new heap
-        ReadLock();
-        for (auto& it : map_)
+        else
         {
-            ShelfIndex shelf_idx = it.first;            
-            GlobalPtr ptr;
-            // free one pointer from one heap per iteration
-            ErrorCode ret = freelists_->GetPointer(shelf_idx, ptr);
-            if (ret == NO_ERROR)
-            {
-                LOG(trace) << "cleaner: free ptr " << ptr;            
-                Free(ptr);
-                continue;
-            }
-            else
-            {
-                LOG(trace) << "cleaner: freelist is empty";
-                continue;
-            }
+            LOG(trace) << "cleaner: freelist is empty";
+            continue;
         }
-        ReadUnlock();
     }
- out:    
-    pthread_exit(NULL);    
+    ReadUnlock();
+
+    LOG(trace) << "cleaner: sleep";
+    return kWorkerSleepMicroSeconds;
 }
     
 bool DistHeap::AcquireShelfHeap(ShelfIndex &shelf_idx, bool newonly)
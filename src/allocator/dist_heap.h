@@ -93,7 +93,8 @@ class DistHeap : public Heap {
     // start/stop the background cleaner
     int StartWorker();
     int StopWorker();
-    void BackgroundWorker();
+    // one round of the cleaner; returns how long to sleep
+    uint64_t CleanerRound();
 
     // helper functions to own/release a single-shelf heap
     // newonly == false: try to find an existing heap first before creating a
@@ -134,11 +135,9 @@ class DistHeap : public Heap {
     std::map<ShelfIndex, ShelfHeap *>
         map_; // for heaps that we own: ShelfIndex => ShelfHeap
 
-    // for the background cleaner thread
-    std::thread cleaner_thread_;
+    // for the background cleaner, a task of the Scheduler
     std::mutex cleaner_mutex_;
-    bool cleaner_running_;
-    bool cleaner_stop_;
+    int cleaner_task_; // -1 while not started
 
     // TODO: gather freespace stats
     // size_t capacity_[ShelfIdMap::kMaxShelfCount];
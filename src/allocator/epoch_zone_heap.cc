@@ -26,8 +26,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "nvmm/error_code.h"
 #include "nvmm/fam.h"
@@ -38,15 +44,21 @@
 #include "nvmm/shelf_id.h"
 
 #include "shelf_mgmt/pool.h"
+#include "shelf_mgmt/shelf_manager.h"
 
 #include "shelf_usage/shelf_region.h"
+#include "shelf_usage/zone_entry.h"
 #include "shelf_usage/zone_shelf_heap.h"
 
 #include "nvmm/epoch_manager.h"
 
 #include "allocator/epoch_zone_heap.h"
+#include "allocator/thread_cache.h"
 
 #include "common/common.h"
+#include "common/config.h"
+#include "common/numa.h"
+#include "common/scheduler.h"
 
 namespace nvmm {
 
@@ -109,6 +121,92 @@ inline uint64_t next_power_of_two(uint64_t n) {
 // So we create header's in case of LFS as the multiple of 8GB (Book size).
 // Header extention in case of a Resize also will be multiple of 8GB(Book size).
 //
+// Identifies an open heap instance to the per-thread caches and hints
+static std::atomic<uint64_t> next_cache_owner{1};
+
+// The shelf this thread last allocated from, in the heap opened as owner
+struct AllocHint {
+    uint64_t owner;
+    int shelf_num;
+};
+static thread_local AllocHint alloc_hint = {0, 0};
+
+// The delayed frees of this thread that are not on global_list_ yet, all from
+// one EpochOp of the heap opened as owner. Each shelf gets a chain of chunks
+// linked through their header entries, newest first, as the single pushes
+// would leave them. It is published when it fills, when the epoch or the heap
+// changes and when the EpochOp ends (see EpochZoneHeap::FlushDelayedFrees).
+struct DelayedFreeBuffer {
+    static uint64_t const kMaxChunks = 64;
+
+    EpochZoneHeap *heap;
+    uint64_t owner;
+    EpochCounter epoch;
+    bool hooked; // flush registered with EpochOp::AtExit
+    uint64_t cnt;
+    int shelf_cnt;
+    int shelf_nums[kMaxChunks]; // shelves with a non-empty chain
+    struct Chain {
+        uint64_t first_idx;
+        uint64_t last_idx;
+        uint64_t cnt;
+    } chains[ShelfId::kMaxShelfCount];
+};
+static thread_local DelayedFreeBuffer delayed_free_buffer;
+
+// GlobalHeader::shelf_node holds 0 for kNumaNone, so that zeroed headers have
+// no placement, 1 for kNumaInterleave and node + 2 for a node
+inline uint64_t encode_numa_node(int node) {
+    if (node == kNumaNone)
+        return 0;
+    if (node == kNumaInterleave)
+        return 1;
+    return (uint64_t)node + 2;
+}
+
+inline int decode_numa_node(uint64_t value) {
+    if (value == 0)
+        return kNumaNone;
+    if (value == 1)
+        return kNumaInterleave;
+    return (int)(value - 2);
+}
+
+// Places the data shelves of a new heap as Config::NumaPolicy says
+static bool numa_placement(int *shelf_node) {
+    std::string const &policy = config.NumaPolicy;
+    uint64_t online = numa_online_nodes();
+    std::vector<int> nodes;
+    if (policy.empty() || policy == "none") {
+        nodes.push_back(kNumaNone);
+    } else if (policy == "interleave") {
+        nodes.push_back(kNumaInterleave);
+    } else if (policy == "per_node") {
+        for (int node = 0; node < kMaxNumaNodes; node++) {
+            if (online & (1UL << node))
+                nodes.push_back(node);
+        }
+    } else if (policy == "explicit") {
+        for (auto node : config.NumaNodes) {
+            if (node >= (uint64_t)kMaxNumaNodes || !(online & (1UL << node))) {
+                LOG(error) << "Zone: NUMA node " << node << " is not online";
+                return false;
+            }
+            nodes.push_back((int)node);
+        }
+        if (nodes.empty()) {
+            LOG(error) << "Zone: explicit NUMA policy without numa_nodes";
+            return false;
+        }
+    } else {
+        LOG(error) << "Zone: invalid numa_policy " << policy;
+        return false;
+    }
+    for (int i = 0; i < ShelfId::kMaxShelfCount; i++)
+        shelf_node[i] = nodes[i % nodes.size()];
+    return true;
+}
+
 inline size_t header_size_round_up() {
 #ifdef LFSWORKAROUND
     return round_up(LFS_BOOK_SIZE, getpagesize());
@@ -121,7 +219,13 @@ EpochZoneHeap::EpochZoneHeap(PoolId pool_id)
     : gh_{NULL}, pool_id_{pool_id}, pool_{pool_id}, rmb_size_{0}, rmb_{NULL},
       region_{NULL}, mapped_addr_{NULL}, header_{NULL}, is_open_{false},
       is_invalid_{false}, no_bgthread_{false}, fast_alloc_{0},
-      cleaner_start_{false}, cleaner_stop_{false}, cleaner_running_{false} {}
+      freelist_stripes_{1}, compact_header_{false}, slab_class_cnt_{0}, slab_classes_{0},
+      grow_watermark_{0}, eager_merge_{false}, merge_slice_us_{0},
+      lazy_zero_{false}, huge_threshold_{0}, huge_gen_{0}, shelf_node_{0},
+      numa_{false},
+      free_cnt_{kMinFreeCnt}, backlog_{0},
+      cleaner_task_{-1}, cleaner_sleep_us_{0}, advance_cb_{-1},
+      thread_cache_{false}, cache_owner_{0} {}
 
 EpochZoneHeap::~EpochZoneHeap() {
     if (IsOpen() == true) {
@@ -154,6 +258,11 @@ ErrorCode EpochZoneHeap::Create(size_t shelf_size, size_t min_alloc_size,
           return HEAP_CREATE_FAILED;
         }
 
+        // where the data shelves go is fixed for the lifetime of the heap
+        if (!numa_placement(shelf_node_)) {
+            return HEAP_CREATE_FAILED;
+        }
+
         // create an empty pool
         ret = pool_.Create(shelf_size, mode);
         if (ret != NO_ERROR) {
@@ -167,6 +276,38 @@ ErrorCode EpochZoneHeap::Create(size_t shelf_size, size_t min_alloc_size,
         }
         ShelfIndex shelf_idx;
 
+        // the stripe count is fixed for the lifetime of the heap
+        freelist_stripes_ = config.FreelistStripes;
+        if (freelist_stripes_ == 0 || freelist_stripes_ > 64) {
+            LOG(error) << "Zone: invalid freelist_stripes " << freelist_stripes_;
+            (void)pool_.Close(false);
+            return HEAP_CREATE_FAILED;
+        }
+        // and the header format
+        compact_header_ = config.CompactZoneHeader;
+
+        // so are the slab size classes
+        slab_class_cnt_ = 0;
+        if (flags & NVMM_SLAB_ALLOC) {
+            std::vector<uint64_t> &classes = config.SlabSizeClasses;
+            if (classes.size() > MAX_SLAB_CLASSES) {
+                LOG(error) << "Zone: too many slab size classes " << classes.size();
+                (void)pool_.Close(false);
+                return HEAP_CREATE_FAILED;
+            }
+            for (size_t i = 0; i < classes.size(); i++) {
+                if (classes[i] % 16 != 0 || classes[i] < min_alloc_size ||
+                    classes[i] > SLAB_SIZE / 8 || is_power_of_two(classes[i]) ||
+                    (i > 0 && classes[i] <= classes[i - 1])) {
+                    LOG(error) << "Zone: invalid slab size class " << classes[i];
+                    (void)pool_.Close(false);
+                    return HEAP_CREATE_FAILED;
+                }
+                slab_classes_[i] = classes[i];
+            }
+            slab_class_cnt_ = classes.size();
+        }
+
         shelf_idx = kHeaderIdx;
         header_size_ =
             get_header_size_from_size(shelf_size, min_alloc_size, shelf_idx);
@@ -234,7 +375,10 @@ ErrorCode EpochZoneHeap::Create(size_t shelf_size, size_t min_alloc_size,
                                  ShelfHeap shelf_heap(shelf->GetPath());
                                  return shelf_heap.Create(
                                      shelf_size, header_[0], header_size_,
-                                     min_obj_size_, fast_alloc_);
+                                     min_obj_size_, fast_alloc_,
+                                     freelist_stripes_, slab_classes_,
+                                     slab_class_cnt_, config.ZoneInitialSize,
+                                     compact_header_, shelf_node_[0]);
                              },
                              false, mode);
         if (ret != NO_ERROR) {
@@ -259,8 +403,17 @@ ErrorCode EpochZoneHeap::Create(size_t shelf_size, size_t min_alloc_size,
         fam_atomic_u64_write(&gh_->sz[0].headersize, header_size_ + reserved);
         fam_atomic_u64_write(&gh_->sz[0].headeroffset, 0);
         fam_atomic_u64_write(&gh_->sz[0].shelfsize, shelf_size);
+        fam_atomic_u64_write(&gh_->huge_size[kZoneIdx], kZoneShelf);
         fam_atomic_u64_write(&gh_->total_shelfs, 1);
         fam_atomic_u64_write(&gh_->fast_alloc, fast_alloc_);
+        fam_atomic_u64_write(&gh_->freelist_stripes, freelist_stripes_);
+        fam_atomic_u64_write(&gh_->compact_header, compact_header_);
+        for (uint64_t i = 0; i < slab_class_cnt_; i++)
+            fam_atomic_u64_write(&gh_->slab_classes[i], slab_classes_[i]);
+        fam_atomic_u64_write(&gh_->slab_class_cnt, slab_class_cnt_);
+        for (int i = 0; i < ShelfId::kMaxShelfCount; i++)
+            fam_atomic_u64_write(&gh_->shelf_node[i],
+                                 encode_numa_node(shelf_node_[i]));
 
         // unmap and close the region
         ret = region_->Unmap(mapped_addr_[shelf_num], header_size_ + reserved);
@@ -390,6 +543,18 @@ ErrorCode EpochZoneHeap::Resize(size_t size) {
     ShelfIndex shelf_idx = (ShelfIndex)(shelf_num + 1);
     shelf_id_for_create_ = (int)shelf_idx;
 
+    // Claim the shelf index from the huge objects, which take them from the
+    // top down; a previous unfinished resize may have claimed it already
+    uint64_t owner = fam_atomic_u64_compare_and_store(
+        &gh_->huge_size[shelf_idx], 0, kZoneShelf);
+    if (owner != 0 && owner != kZoneShelf) {
+        LOG(error) << "Zone: shelf " << (int)shelf_idx
+                   << " holds a huge object, cannot resize";
+        fam_atomic_u64_write(&gh_->op_in_progress, 0);
+        region_->Unmap(mapped_addr_[shelf_num], new_header_size);
+        return HEAP_RESIZE_FAILED;
+    }
+
     // Check if previous unfinished resize has a shelf created.
     // If yes remove the shelf
     if (pool_.CheckShelf(shelf_idx) == true) {
@@ -410,7 +575,11 @@ ErrorCode EpochZoneHeap::Resize(size_t size) {
                              return shelf_heap.Create(
                                  shelf_size_for_create_,
                                  header_[shelf_id_for_create_ - 1],
-                                 header_size_, min_obj_size_, fast_alloc_);
+                                 header_size_, min_obj_size_, fast_alloc_,
+                                 freelist_stripes_, slab_classes_,
+                                 slab_class_cnt_, config.ZoneInitialSize,
+                                 compact_header_,
+                                 shelf_node_[shelf_id_for_create_ - 1]);
                          },
                          false, perm);
     if (ret != NO_ERROR) {
@@ -587,6 +756,13 @@ ErrorCode EpochZoneHeap::Destroy() {
             return HEAP_DESTROY_FAILED;
         }
 
+        // the shelves of the huge objects go first
+        for (int idx = total_data_shelfs + 1; idx < Pool::kMaxShelfCount;
+             idx++) {
+            if (pool_.CheckShelf((ShelfIndex)idx) == true)
+                (void)pool_.RemoveShelf((ShelfIndex)idx);
+        }
+
         // Unmap and close the region
         (void)region_->Unmap(
               gh_, round_up(sizeof(struct GlobalHeader), kCacheLineSize));
@@ -693,6 +869,23 @@ ErrorCode EpochZoneHeap::Open(int flags) {
     }
 
     fast_alloc_ = fam_atomic_u64_read(&gh_->fast_alloc);
+    freelist_stripes_ = fam_atomic_u64_read(&gh_->freelist_stripes);
+    compact_header_ = fam_atomic_u64_read(&gh_->compact_header) != 0;
+    slab_class_cnt_ = fam_atomic_u64_read(&gh_->slab_class_cnt);
+    for (uint64_t i = 0; i < slab_class_cnt_; i++)
+        slab_classes_[i] = fam_atomic_u64_read(&gh_->slab_classes[i]);
+    grow_watermark_ = config.GrowWatermark;
+    eager_merge_ = (flags & NVMM_EAGER_MERGE) != 0;
+    merge_slice_us_ = config.MergeSliceMicroSeconds;
+    // nobody would zero the chunks without the background worker
+    lazy_zero_ = (flags & NVMM_LAZY_ZERO) && !(flags & NVMM_NO_BG_THREAD);
+    huge_threshold_ = config.HugeAllocThreshold;
+    numa_ = false;
+    for (int i = 0; i < ShelfId::kMaxShelfCount; i++) {
+        shelf_node_[i] = decode_numa_node(fam_atomic_u64_read(&gh_->shelf_node[i]));
+        if (shelf_node_[i] >= 0)
+            numa_ = true;
+    }
 
     int total_data_shelfs = get_total_data_shelfs();
 
@@ -745,6 +938,10 @@ ErrorCode EpochZoneHeap::Open(int flags) {
     min_obj_size_ = rmb_[0]->MinAllocSize();
     is_open_ = true;
 
+    cache_owner_ = next_cache_owner.fetch_add(1);
+    if (flags & NVMM_THREAD_CACHE)
+        thread_cache_ = true;
+
     // If No Background thread flag specified, return without spawning threads
     if(flags & NVMM_NO_BG_THREAD){ 
        no_bgthread_ = true;
@@ -764,10 +961,6 @@ ErrorCode EpochZoneHeap::Open(int flags) {
         } while (shelf_num > 0);
         return HEAP_OPEN_FAILED;
     }
-
-    // wait for the cleaner to be running
-    std::unique_lock<std::mutex> mutex(cleaner_mutex_);
-    running_cv_.wait(mutex, [this] { return cleaner_running_ == true; });
     no_bgthread_ = false;
     return ret;
 }
@@ -785,6 +978,18 @@ ErrorCode EpochZoneHeap::Close() {
             return HEAP_CLOSE_FAILED;
         }
     }
+    // give the cached chunks back before the shelves go away
+    FlushThreadCaches(true);
+    if (delayed_free_buffer.cnt != 0 && delayed_free_buffer.owner == cache_owner_)
+        FlushDelayedFrees();
+    thread_cache_ = false;
+
+    // drop the maps of the huge shelves
+    for (int idx = total_mapped_shelfs_ + 1; idx < Pool::kMaxShelfCount; idx++) {
+        if (IsHugeShelf((ShelfIndex)idx))
+            ShelfManager::UnmapShelf(ShelfId(pool_id_, (ShelfIndex)idx));
+    }
+
     // close the rmb
     for (int shelf_num = (int)(total_mapped_shelfs_ - 1); shelf_num >= 0;
          shelf_num--) {
@@ -837,30 +1042,144 @@ size_t EpochZoneHeap::Size() {
 }
 
 GlobalPtr EpochZoneHeap::Alloc(size_t size) {
+    /*
+    1. Start at the shelf this thread allocated from last and skip the
+       shelves whose occupancy summary says they cannot serve the size, so
+       an allocation does not run the miss path of every full shelf in front
+       of the one with space. With NUMA placement, go through the shelves on
+       the node of this thread (or on no node in particular) first and
+       through the remote ones after.
+    2. Only if that fails, go through the shelves skipped in 1 in case their
+       summary is stale, then through the shelves added by other processes.
+    */
     ASSERT_IS_OPEN();
-    GlobalPtr ptr;
+    if (huge_threshold_ && size > huge_threshold_)
+        return AllocHuge(size);
     Offset offset = 0;
-    int shelf_num = -1;
-    // int total_shelf = get_total_data_shelfs();
+    ThreadCache *cache = GetThreadCache();
     int total_shelf = total_mapped_shelfs_;
-    do {
-        shelf_num = (shelf_num + 1);
+    int hint = alloc_hint.owner == cache_owner_ ? alloc_hint.shelf_num : 0;
+    if (hint >= total_shelf)
+        hint = 0;
+
+    // 1
+    uint64_t skipped[(ShelfId::kMaxShelfCount + 63) / 64] = {0};
+    int local = numa_ ? numa_current_node() : kNumaNone;
+    for (int round = 0; round < (numa_ ? 2 : 1); round++) {
+        for (int i = 0; i < total_shelf; i++) {
+            int shelf_num = (hint + i) % total_shelf;
+            int node = shelf_node_[shelf_num];
+            if (numa_ && (round == 0) == (node >= 0 && node != local))
+                continue;
+            offset = 0;
+            if (cache != NULL)
+                offset = cache->Alloc(shelf_num, size);
+            if (offset == 0 && rmb_[shelf_num]->MustSplit(size))
+                offset = AllocRecycled(shelf_num, size);
+            if (offset == 0) {
+                if (rmb_[shelf_num]->MayAlloc(size))
+                    offset = rmb_[shelf_num]->Alloc(size);
+                else
+                    skipped[shelf_num / 64] |= 1UL << (shelf_num % 64);
+            }
+            if (rmb_[shelf_num]->IsValidOffset(offset)) {
+                alloc_hint.owner = cache_owner_;
+                alloc_hint.shelf_num = shelf_num;
+                return GlobalPtr(
+                    ShelfId(pool_id_, (ShelfIndex)(shelf_num + 1)), offset);
+            }
+        }
+    }
 
+    // 2
+    // the worker may have delayed frees to return or levels to merge
+    KickWorker();
+    for (int shelf_num = 0;; shelf_num++) {
         if (shelf_num == total_mapped_shelfs_) {
-            total_shelf = get_total_data_shelfs();
-            if (total_shelf > total_mapped_shelfs_) {
+            if (get_total_data_shelfs() > total_mapped_shelfs_)
                 OpenNewShelfs();
-            } else
+            else
                 break;
         }
+        if (shelf_num < total_shelf &&
+            !(skipped[shelf_num / 64] & (1UL << (shelf_num % 64))))
+            continue;
         offset = rmb_[shelf_num]->Alloc(size);
-    } while (rmb_[shelf_num]->IsValidOffset(offset) == false &&
-             shelf_num < total_mapped_shelfs_);
-    if (offset == 0)
+        if (rmb_[shelf_num]->IsValidOffset(offset)) {
+            alloc_hint.owner = cache_owner_;
+            alloc_hint.shelf_num = shelf_num;
+            return GlobalPtr(
+                ShelfId(pool_id_, (ShelfIndex)(shelf_num + 1)), offset);
+        }
+    }
+    return 0;
+}
+
+Offset EpochZoneHeap::AllocRecycled(int shelf_num, size_t size) {
+    /*
+    The chunks on the delayed free list of the current epoch are due, and
+    until the worker gets to them they are still allocated at their level.
+    Rather than split a larger chunk or grow, take one of the right level
+    off the list as it is; the few of other levels popped on the way go
+    back to the zone as the worker would have done.
+    */
+    EpochManager *em = EpochManager::GetInstance();
+    ZoneEntryStack &list =
+        global_list_[shelf_num][em->reported_epoch() % kListCnt];
+    if (fam_atomic_u64_read(&list.head) == 0)
         return 0;
-    else
-        return GlobalPtr(ShelfId(pool_id_, (ShelfIndex)(shelf_num + 1)),
-                         offset);
+
+    ShelfHeap *shelf = rmb_[shelf_num];
+    uint64_t level = shelf->SizeToLevel(size);
+    EpochOp op(em);
+    ZoneEntryStack &due =
+        global_list_[shelf_num][op.reported_epoch() % kListCnt];
+    for (uint64_t i = 0; i < kRecycleScanCnt; i++) {
+        uint64_t idx = due.pop(bitmap_start_[shelf_num]);
+        if (idx == 0)
+            break;
+        Offset offset = idx * min_obj_size_;
+        if (!shelf->IsSlabSlot(offset) &&
+            bitmap_start_[shelf_num].load(idx + 1).level() == level) {
+            // alloc hands out zeroed chunks
+            fam_memset_persist(shelf->OffsetToPtr(offset), 0,
+                               min_obj_size_ << level);
+            LOG(trace) << "recycled block [" << offset << "]";
+            return offset;
+        }
+        shelf->Free(offset);
+    }
+    return 0;
+}
+
+size_t EpochZoneHeap::AllocBatch(size_t size, size_t count, GlobalPtr *ptrs) {
+    ASSERT_IS_OPEN();
+    size_t total = 0;
+    if (huge_threshold_ && size > huge_threshold_) {
+        for (; total < count; total++) {
+            ptrs[total] = AllocHuge(size);
+            if (!ptrs[total].IsValid())
+                break;
+        }
+        return total;
+    }
+    std::vector<Offset> offsets(count);
+    for (int shelf_num = 0; total < count; shelf_num++) {
+        if (shelf_num == total_mapped_shelfs_) {
+            if (get_total_data_shelfs() > total_mapped_shelfs_)
+                OpenNewShelfs();
+            else
+                break;
+        }
+        size_t cnt = rmb_[shelf_num]->AllocBatch(size, count - total,
+                                                 offsets.data());
+        for (size_t i = 0; i < cnt; i++) {
+            ptrs[total + i] = GlobalPtr(
+                ShelfId(pool_id_, (ShelfIndex)(shelf_num + 1)), offsets[i]);
+        }
+        total += cnt;
+    }
+    return total;
 }
 
 // The offset returned by AllocOffset has Offset + ((shelf_idx-1) <<
@@ -887,6 +1206,11 @@ void EpochZoneHeap::Free(GlobalPtr global_ptr) {
     ShelfId shelf_id = global_ptr.GetShelfId();
     ShelfIndex shelf_idx = shelf_id.GetShelfIndex();
 
+    if (IsHugeShelf(shelf_idx)) {
+        FreeHuge(shelf_idx);
+        return;
+    }
+
     // The shelf is not yet open
     if (shelf_idx > total_mapped_shelfs_) {
         ErrorCode ret = OpenNewShelfs();
@@ -897,7 +1221,124 @@ void EpochZoneHeap::Free(GlobalPtr global_ptr) {
         }
     }
 
-    rmb_[shelf_idx - 1]->Free(offset);
+    ThreadCache *cache = GetThreadCache();
+    if (cache != NULL)
+        cache->Free(shelf_idx - 1, offset);
+    else
+        rmb_[shelf_idx - 1]->Free(offset);
+}
+
+void EpochZoneHeap::Free(GlobalPtr global_ptr, size_t size) {
+    ASSERT_IS_OPEN();
+    Offset offset = global_ptr.GetOffset();
+    ShelfIndex shelf_idx = global_ptr.GetShelfId().GetShelfIndex();
+
+    if (IsHugeShelf(shelf_idx)) {
+        FreeHuge(shelf_idx);
+        return;
+    }
+
+    // The shelf is not yet open
+    if (shelf_idx > total_mapped_shelfs_) {
+        ErrorCode ret = OpenNewShelfs();
+        if (ret != NO_ERROR) {
+            LOG(trace) << "mapping new shelf failed: " << ret;
+            return;
+        }
+    }
+
+    ThreadCache *cache = GetThreadCache();
+    if (cache != NULL)
+        cache->Free(shelf_idx - 1, offset, size);
+    else
+        rmb_[shelf_idx - 1]->Free(offset, size);
+}
+
+GlobalPtr EpochZoneHeap::Realloc(GlobalPtr global_ptr, size_t size) {
+    ASSERT_IS_OPEN();
+    if (!global_ptr.IsValid())
+        return Alloc(size);
+    Offset offset = global_ptr.GetOffset();
+    ShelfIndex shelf_idx = global_ptr.GetShelfId().GetShelfIndex();
+
+    size_t old_size;
+    if (IsHugeShelf(shelf_idx)) {
+        old_size = fam_atomic_u64_read(&gh_->huge_size[shelf_idx]);
+        if (size <= old_size)
+            return global_ptr;
+    } else {
+        if (shelf_idx > total_mapped_shelfs_ && OpenNewShelfs() != NO_ERROR)
+            return 0;
+        ShelfHeap *shelf = rmb_[shelf_idx - 1];
+        old_size = shelf->BlockSize(offset);
+        if (size <= old_size)
+            return global_ptr;
+        // a huge object gets its own shelf anyway
+        if (!(huge_threshold_ && size > huge_threshold_) &&
+            shelf->GrowInPlace(offset, size))
+            return global_ptr;
+    }
+
+    // move it
+    GlobalPtr new_ptr = Alloc(size);
+    if (!new_ptr.IsValid())
+        return 0;
+    fam_memcpy_persist(GlobalToLocal(new_ptr), GlobalToLocal(global_ptr),
+                       std::min(old_size, size));
+    Free(global_ptr);
+    return new_ptr;
+}
+
+// Splits ptrs into one list of offsets per shelf and the huge objects,
+// skipping invalid ones
+void EpochZoneHeap::group_by_shelf(GlobalPtr *ptrs, size_t count,
+                                   std::vector<std::vector<Offset>> &groups,
+                                   std::vector<ShelfIndex> &huge) {
+    for (size_t i = 0; i < count; i++) {
+        Offset offset = ptrs[i].GetOffset();
+        ShelfIndex shelf_idx = ptrs[i].GetShelfId().GetShelfIndex();
+        if (!ptrs[i].IsValid() || shelf_idx == 0)
+            continue;
+        if (IsHugeShelf(shelf_idx)) {
+            huge.push_back(shelf_idx);
+            continue;
+        }
+        if (shelf_idx > total_mapped_shelfs_) {
+            ErrorCode ret = OpenNewShelfs();
+            if (ret != NO_ERROR) {
+                LOG(trace) << "mapping new shelf failed: " << ret;
+                continue;
+            }
+        }
+        int shelf_num = shelf_idx - 1;
+        if (rmb_[shelf_num]->IsValidOffset(offset) == false)
+            continue;
+        if (groups.size() <= (size_t)shelf_num)
+            groups.resize((size_t)shelf_num + 1);
+        groups[shelf_num].push_back(offset);
+    }
+}
+
+void EpochZoneHeap::FreeBatch(GlobalPtr *ptrs, size_t count) {
+    ASSERT_IS_OPEN();
+    std::vector<std::vector<Offset>> groups;
+    std::vector<ShelfIndex> huge;
+    group_by_shelf(ptrs, count, groups, huge);
+    for (auto shelf_idx : huge)
+        FreeHuge(shelf_idx);
+
+    ThreadCache *cache = GetThreadCache();
+    for (size_t shelf_num = 0; shelf_num < groups.size(); shelf_num++) {
+        std::vector<Offset> &offsets = groups[shelf_num];
+        if (offsets.empty())
+            continue;
+        if (cache != NULL) {
+            for (auto offset : offsets)
+                cache->Free((int)shelf_num, offset);
+        } else {
+            rmb_[shelf_num]->FreeBatch(offsets.data(), offsets.size());
+        }
+    }
 }
 
 //
@@ -913,6 +1354,11 @@ void EpochZoneHeap::Free(Offset offset) {
     // Get only the offset from shelfIndex + offset
     offset = get_offset_from_shelfIndexoffset(offset);
 
+    if (IsHugeShelf((ShelfIndex)(shelf_num + 1))) {
+        FreeHuge((ShelfIndex)(shelf_num + 1));
+        return;
+    }
+
     if (shelf_num >= total_mapped_shelfs_) {
         ErrorCode ret = OpenNewShelfs();
         // TODO: Free does not return any value, So we will need to throw
@@ -922,7 +1368,11 @@ void EpochZoneHeap::Free(Offset offset) {
             return;
         }
     }
-    rmb_[shelf_num]->Free(offset);
+    ThreadCache *cache = GetThreadCache();
+    if (cache != NULL)
+        cache->Free(shelf_num, offset);
+    else
+        rmb_[shelf_num]->Free(offset);
 }
 
 GlobalPtr EpochZoneHeap::Alloc(EpochOp &op, size_t size) {
@@ -939,6 +1389,11 @@ void EpochZoneHeap::Free(EpochOp &op, Offset offset) {
     // Get only the offset from shelfIndex + offset
     offset = get_offset_from_shelfIndexoffset(offset);
 
+    if (IsHugeShelf((ShelfIndex)(shelf_num + 1))) {
+        DelayFreeHuge(op, (ShelfIndex)(shelf_num + 1));
+        return;
+    }
+
     if ((shelf_num + 1) > total_mapped_shelfs_) {
         ErrorCode ret = OpenNewShelfs();
         // TODO: Free does not return any value, So we will need to throw
@@ -953,11 +1408,8 @@ void EpochZoneHeap::Free(EpochOp &op, Offset offset) {
         return;
     }
 
-    {
-        EpochCounter e = op.reported_epoch();
-        global_list_[shelf_num][(e + 3) % kListCnt].push(
-            bitmap_start_[shelf_num], offset / min_obj_size_);
-    }
+    uint64_t idx = offset / min_obj_size_;
+    DelayFree(op, shelf_num, idx, bitmap_start_[shelf_num].load(idx + 1));
 }
 
 void EpochZoneHeap::Free(EpochOp &op, GlobalPtr global_ptr) {
@@ -966,6 +1418,11 @@ void EpochZoneHeap::Free(EpochOp &op, GlobalPtr global_ptr) {
     ShelfId shelf_id = global_ptr.GetShelfId();
     ShelfIndex shelf_idx = shelf_id.GetShelfIndex();
 
+    if (IsHugeShelf(shelf_idx)) {
+        DelayFreeHuge(op, shelf_idx);
+        return;
+    }
+
     if (shelf_idx > total_mapped_shelfs_) {
         ErrorCode ret = OpenNewShelfs();
         // TODO: Free does not return any value, So we will need to throw
@@ -978,12 +1435,111 @@ void EpochZoneHeap::Free(EpochOp &op, GlobalPtr global_ptr) {
     if (rmb_[shelf_idx - 1]->IsValidOffset(offset) == false)
         return;
 
-    {
-        EpochCounter e = op.reported_epoch();
-        LOG(trace) << "delay freeing block [" << offset << "] at epoch "
-                   << e + 3;
-        global_list_[shelf_idx - 1][(e + 3) % kListCnt].push(
-            bitmap_start_[shelf_idx - 1], offset / min_obj_size_);
+    uint64_t idx = offset / min_obj_size_;
+    DelayFree(op, shelf_idx - 1, idx, bitmap_start_[shelf_idx - 1].load(idx + 1));
+}
+
+void EpochZoneHeap::Free(EpochOp &op, GlobalPtr global_ptr, size_t size) {
+    ASSERT_IS_OPEN();
+    Offset offset = global_ptr.GetOffset();
+    ShelfIndex shelf_idx = global_ptr.GetShelfId().GetShelfIndex();
+
+    // slab slots are linked through the entries of their slab, not their own
+    if (IsHugeShelf(shelf_idx) || shelf_idx > total_mapped_shelfs_ ||
+        rmb_[shelf_idx - 1]->IsSlabSize(size)) {
+        Free(op, global_ptr);
+        return;
+    }
+    ShelfHeap *shelf = rmb_[shelf_idx - 1];
+    if (shelf->IsValidOffset(offset) == false)
+        return;
+
+    // the chunk is still allocated at its level until the delayed free, so
+    // we know its header entry without reading it
+    uint64_t level = shelf->SizeToLevel(size);
+    assert(shelf->BlockSize(offset) == (min_obj_size_ << level));
+    DelayFree(op, shelf_idx - 1, offset / min_obj_size_, zone_entry(true, level));
+}
+
+void EpochZoneHeap::DelayFree(EpochOp &op, int shelf_num, uint64_t idx,
+                              zone_entry entry) {
+    DelayedFreeBuffer &buf = delayed_free_buffer;
+    EpochCounter e = op.reported_epoch();
+    // a chain goes on the list of the epoch its chunks were freed in
+    if (buf.cnt != 0 && (buf.owner != cache_owner_ || buf.epoch != e))
+        buf.heap->FlushDelayedFrees();
+    if (buf.cnt == 0) {
+        buf.heap = this;
+        buf.owner = cache_owner_;
+        buf.epoch = e;
+    }
+    if (!buf.hooked) {
+        EpochOp::AtExit(
+            [](void *arg) {
+                DelayedFreeBuffer *buf = (DelayedFreeBuffer *)arg;
+                buf->hooked = false;
+                if (buf->cnt != 0)
+                    buf->heap->FlushDelayedFrees();
+            },
+            &buf);
+        buf.hooked = true;
+    }
+
+    LOG(trace) << "delay freeing block [" << idx * min_obj_size_
+               << "] at epoch " << e + 3;
+    DelayedFreeBuffer::Chain &chain = buf.chains[shelf_num];
+    if (chain.cnt == 0) {
+        buf.shelf_nums[buf.shelf_cnt++] = shelf_num;
+        chain.last_idx = idx;
+    } else {
+        // the chunk stays allocated, only the next field of its entry changes
+        entry.link_next(chain.first_idx + 1);
+        bitmap_start_[shelf_num].store(idx + 1, entry);
+    }
+    chain.first_idx = idx;
+    chain.cnt++;
+    if (++buf.cnt == DelayedFreeBuffer::kMaxChunks)
+        FlushDelayedFrees();
+}
+
+void EpochZoneHeap::FlushDelayedFrees() {
+    DelayedFreeBuffer &buf = delayed_free_buffer;
+    assert(buf.owner == cache_owner_);
+    for (int i = 0; i < buf.shelf_cnt; i++) {
+        int shelf_num = buf.shelf_nums[i];
+        DelayedFreeBuffer::Chain &chain = buf.chains[shelf_num];
+        global_list_[shelf_num][(buf.epoch + 3) % kListCnt].push_linked(
+            bitmap_start_[shelf_num], chain.first_idx, chain.last_idx,
+            chain.cnt);
+        chain.cnt = 0;
+    }
+    AddBacklog(buf.cnt);
+    buf.shelf_cnt = 0;
+    buf.cnt = 0;
+}
+
+void EpochZoneHeap::FreeBatch(EpochOp &op, GlobalPtr *ptrs, size_t count) {
+    ASSERT_IS_OPEN();
+    std::vector<std::vector<Offset>> groups;
+    std::vector<ShelfIndex> huge;
+    group_by_shelf(ptrs, count, groups, huge);
+    for (auto shelf_idx : huge)
+        DelayFreeHuge(op, shelf_idx);
+
+    EpochCounter e = op.reported_epoch();
+    LOG(trace) << "delay freeing " << count << " blocks at epoch " << e + 3;
+    std::vector<uint64_t> idxes;
+    for (size_t shelf_num = 0; shelf_num < groups.size(); shelf_num++) {
+        std::vector<Offset> &offsets = groups[shelf_num];
+        if (offsets.empty())
+            continue;
+        idxes.resize(offsets.size());
+        for (size_t i = 0; i < offsets.size(); i++)
+            idxes[i] = offsets[i] / min_obj_size_;
+        // the chunks stay allocated while they sit on the delayed free list,
+        // linking them only touches the next field of their header entries
+        global_list_[shelf_num][(e + 3) % kListCnt].push_chain(
+            bitmap_start_[shelf_num], idxes.data(), idxes.size());
     }
 }
 
@@ -1033,8 +1589,12 @@ ErrorCode EpochZoneHeap::OpenShelf(int shelf_num) {
         LOG(error) << "Zone: rmb open failed " << (uint64_t)pool_id_;
         return HEAP_OPEN_FAILED;
     }
-    bitmap_start_[shelf_num] = (void *)((char *)header_[shelf_num] +
-                                        rmb_[shelf_num]->get_bitmap_offset());
+    bitmap_start_[shelf_num] = ZoneEntryArray(
+        (char *)header_[shelf_num] + rmb_[shelf_num]->get_bitmap_offset(),
+        rmb_[shelf_num]->HasCompactHeader());
+    rmb_[shelf_num]->SetEagerMerge(eager_merge_);
+    rmb_[shelf_num]->SetLazyZero(lazy_zero_);
+    rmb_[shelf_num]->Bind(shelf_node_[shelf_num]);
 
     // Validation to check if shelf size and shelf size in gh_ is same
     if (rmb_[shelf_num]->Size() != shelfsize) {
@@ -1104,6 +1664,14 @@ ErrorCode EpochZoneHeap::Map(Offset offset, size_t size, void *addr_hint,
     int shelf_num = get_shelfnum_from_shelfIndexoffset(offset);
     offset = get_offset_from_shelfIndexoffset(offset);
 
+    if (IsHugeShelf((ShelfIndex)(shelf_num + 1))) {
+        // huge shelves are mapped whole, once per process
+        char *base = (char *)MapHuge((ShelfIndex)(shelf_num + 1));
+        if (base == NULL)
+            return MAP_POINTER_FAILED;
+        *mapped_addr = base + offset;
+        return NO_ERROR;
+    }
     if (rmb_[shelf_num]->IsValidOffset(offset) == true) {
         ret = rmb_[shelf_num]->Map(offset, size, addr_hint, prot, mapped_addr);
     }
@@ -1116,6 +1684,9 @@ ErrorCode EpochZoneHeap::Unmap(Offset offset, void *mapped_addr, size_t size) {
     int shelf_num = get_shelfnum_from_shelfIndexoffset(offset);
     offset = get_offset_from_shelfIndexoffset(offset);
 
+    // the map of a huge shelf stays until the object is freed
+    if (IsHugeShelf((ShelfIndex)(shelf_num + 1)))
+        return NO_ERROR;
     if (rmb_[shelf_num]->IsValidOffset(offset) == true) {
         ret = rmb_[shelf_num]->Unmap(offset, mapped_addr, size);
     }
@@ -1129,6 +1700,10 @@ void *EpochZoneHeap::OffsetToLocal(Offset offset) {
     // Offset offset = global_ptr.GetOffset();
     int shelf_num = get_shelfnum_from_shelfIndexoffset(offset);
     offset = get_offset_from_shelfIndexoffset(offset);
+    if (IsHugeShelf((ShelfIndex)(shelf_num + 1))) {
+        char *base = (char *)MapHuge((ShelfIndex)(shelf_num + 1));
+        return base == NULL ? NULL : base + offset;
+    }
     local_ptr = rmb_[shelf_num]->OffsetToPtr(offset);
     return local_ptr;
 }
@@ -1184,7 +1759,9 @@ size_t EpochZoneHeap::get_header_size_from_size(size_t size,
     size_t total_size = 0;
     if (shelf_idx == 0)
         gh_size = round_up(sizeof(struct GlobalHeader), kCacheLineSize);
-    total_size = ShelfHeap::get_header_size(size, min_alloc_size) +
+    total_size = ShelfHeap::get_header_size(size, min_alloc_size,
+                                            freelist_stripes_,
+                                            compact_header_) +
                  round_up(kListCnt * sizeof(ZoneEntryStack), kCacheLineSize) +
                  gh_size;
     total_size = round_up(total_size, header_size_round_up());
@@ -1218,6 +1795,10 @@ void *EpochZoneHeap::GlobalToLocal(GlobalPtr global_ptr) {
     ShelfId shelf_id = global_ptr.GetShelfId();
     ShelfIndex shelf_idx = shelf_id.GetShelfIndex();
     int shelf_num = shelf_idx - 1;
+    if (IsHugeShelf(shelf_idx)) {
+        char *base = (char *)MapHuge(shelf_idx);
+        return base == NULL ? NULL : base + offset;
+    }
     local_ptr = rmb_[shelf_num]->OffsetToPtr(offset);
     return local_ptr;
 }
@@ -1234,12 +1815,13 @@ void EpochZoneHeap::delayed_free_fn() {
                  shelf_num++) {
                 rmb_[shelf_num]->MarkInvalid();
             }
+            StopWorker();
             Close();
             return;
         }
         uint64_t i = 0;
         EpochManager *em = EpochManager::GetInstance();
-        for (; i < kFreeCnt; i++) {
+        for (; i < free_cnt_; i++) {
 
             {
                 EpochOp op(em);
@@ -1260,132 +1842,255 @@ void EpochZoneHeap::delayed_free_fn() {
                  shelf_num++) {
                 rmb_[shelf_num]->MarkInvalid();
             }
+            StopWorker();
             Close();
             return;
         }
         LOG(trace) << " in total " << i << " blocks have been freed";
     }
+    FreeDueHuge(false);
 }
 
 int EpochZoneHeap::StartWorker() {
-    // start the cleaner thread
+    // the cleaner runs on the background threads of the process
     std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-    if (cleaner_start_ == true) {
-        LOG(trace) << " cleaner thread is already started...";
+    if (cleaner_task_ >= 0) {
+        LOG(trace) << " cleaner is already started...";
         return 0;
     }
-    cleaner_start_ = true;
-    cleaner_stop_ = false;
-    cleaner_running_ = false;
-    cleaner_thread_ = std::thread(&EpochZoneHeap::BackgroundWorker, this);
+    cleaner_sleep_us_ = kWorkerMinSleepMicroSeconds;
+    cleaner_task_ = Scheduler::GetInstance()->AddTask(
+        [this] { return CleanerRound(); }, cleaner_sleep_us_);
+    // chunks become due as the epoch moves
+    advance_cb_ = EpochManager::GetInstance()->register_advance_callback(
+        [this](EpochCounter) {
+            if (backlog_.load(std::memory_order_relaxed) != 0)
+                KickWorker();
+        });
     return 0;
 }
 
 int EpochZoneHeap::StopWorker() {
-    // signal the cleaner to stop
+    int task;
     {
         std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-        if (cleaner_running_ == false || cleaner_start_ == false) {
-            LOG(trace) << " cleaner thread is not running...";
+        if (cleaner_task_ < 0) {
+            LOG(trace) << " cleaner is not running...";
             return 0;
         }
-        cleaner_stop_ = true;
+        task = cleaner_task_;
+        cleaner_task_ = -1;
     }
-
-    // join the cleaner thread
-    if (cleaner_thread_.joinable()) {
-        cleaner_thread_.join();
-    }
-
-    {
-        std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-        cleaner_start_ = false;
-        cleaner_stop_ = false;
-        cleaner_running_ = false;
+    if (advance_cb_ >= 0) {
+        EpochManager::GetInstance()->unregister_advance_callback(advance_cb_);
+        advance_cb_ = -1;
     }
+    // waits for a round in progress, unless this is the cleaner itself
+    Scheduler::GetInstance()->RemoveTask(task);
     return 0;
 }
 
-void EpochZoneHeap::BackgroundWorker() {
+uint64_t EpochZoneHeap::CleanerRound() {
+    /*
+    Runs when it is kicked (the epoch moved while chunks wait on the delayed
+    free lists, or an allocation ran short) or its sleep is over. Rounds
+    that leave work behind double the batch size and come back right away;
+    idle rounds halve the batch and double the sleep, so an idle heap comes
+    up about once a second.
+    */
     TRACE();
     ASSERT_IS_OPEN();
     Offset offset;
+    uint64_t &sleep_us = cleaner_sleep_us_;
 
-    while (1) {
-
-        // check if we are shutting down...
-        {
-            std::lock_guard<std::mutex> mutex(cleaner_mutex_);
-            if (cleaner_running_ == false) {
-                cleaner_running_ = true;
-                LOG(trace) << "cleaner: running...";
-                running_cv_.notify_all();
-            }
-            if (cleaner_stop_ == true) {
-                LOG(trace) << "cleaner: exiting...";
-                return;
+    LOG(trace) << "cleaner: wakeup";
+    // more work left than one round could do
+    bool behind = false;
+    // do work
+    for (int shelf_num = 0; shelf_num < total_mapped_shelfs_; shelf_num++) {
+        if (fam_atomic_u64_read(&gh_->destroy_in_progress)) {
+            is_invalid_ = true;
+            for (int shelf_num = 0; shelf_num < total_mapped_shelfs_;
+                 shelf_num++) {
+                rmb_[shelf_num]->MarkInvalid();
             }
+            StopWorker();
+            Close();
+            LOG(trace) << "cleaner: exiting...";
+            return Scheduler::kIdle;
         }
-        LOG(trace) << "cleaner: sleep";
-        usleep(kWorkerSleepMicroSeconds);
-        LOG(trace) << "cleaner: wakeup";
-        // do work
-        for (int shelf_num = 0; shelf_num < total_mapped_shelfs_; shelf_num++) {
-            if (fam_atomic_u64_read(&gh_->destroy_in_progress)) {
-                is_invalid_ = true;
-                for (int shelf_num = 0; shelf_num < total_mapped_shelfs_;
-                     shelf_num++) {
-                    rmb_[shelf_num]->MarkInvalid();
-                }
-                Close();
-                LOG(trace) << "cleaner: exiting...";
-                return;
-            }
-            uint64_t i = 0;
-            EpochManager *em = EpochManager::GetInstance();
-            if (fast_alloc_) {
-                for (; i < kFreeCnt; i++) {
-
-                    {
-                        EpochOp op(em);
-                        EpochCounter e = op.reported_epoch();
-                        offset = global_list_[shelf_num][e % kListCnt].pop(
-                                     bitmap_start_[shelf_num]) *
-                                 min_obj_size_;
-                    }
-                    if (offset == 0)
-                        break;
-                    // TODO: a crash here will leak memory
-                    LOG(trace) << " freeing block [" << offset << "]";
-                    rmb_[shelf_num]->Free(offset);
-                }
-            } else {
-                EpochOp op(em);
-                EpochCounter e = op.reported_epoch();
-                for (; i < kFreeCnt; i++) {
+        uint64_t i = 0;
+        EpochManager *em = EpochManager::GetInstance();
+        if (fast_alloc_) {
+            for (; i < free_cnt_; i++) {
+
+                {
+                    EpochOp op(em);
+                    EpochCounter e = op.reported_epoch();
                     offset = global_list_[shelf_num][e % kListCnt].pop(
                                  bitmap_start_[shelf_num]) *
                              min_obj_size_;
-                    if (offset == 0)
-                        break;
-                    // TODO: a crash here will leak memory
-                    LOG(trace) << " freeing block [" << offset << "]";
-                    rmb_[shelf_num]->Free(offset);
                 }
+                if (offset == 0)
+                    break;
+                // TODO: a crash here will leak memory
+                LOG(trace) << " freeing block [" << offset << "]";
+                rmb_[shelf_num]->Free(offset);
             }
-            if (fam_atomic_u64_read(&gh_->destroy_in_progress)) {
-                is_invalid_ = true;
-                for (int shelf_num = 0; shelf_num < total_mapped_shelfs_;
-                     shelf_num++) {
-                    rmb_[shelf_num]->MarkInvalid();
-                }
-                Close();
-                LOG(trace) << "cleaner: exiting...";
-                return;
+        } else {
+            EpochOp op(em);
+            EpochCounter e = op.reported_epoch();
+            for (; i < free_cnt_; i++) {
+                offset = global_list_[shelf_num][e % kListCnt].pop(
+                             bitmap_start_[shelf_num]) *
+                         min_obj_size_;
+                if (offset == 0)
+                    break;
+                // TODO: a crash here will leak memory
+                LOG(trace) << " freeing block [" << offset << "]";
+                rmb_[shelf_num]->Free(offset);
             }
-            LOG(trace) << " in total " << i << " blocks have been freed";
+        }
+        if (i == free_cnt_)
+            behind = true;
+        if (fam_atomic_u64_read(&gh_->destroy_in_progress)) {
+            is_invalid_ = true;
+            for (int shelf_num = 0; shelf_num < total_mapped_shelfs_;
+                 shelf_num++) {
+                rmb_[shelf_num]->MarkInvalid();
+            }
+            StopWorker();
+            Close();
+            LOG(trace) << "cleaner: exiting...";
+            return Scheduler::kIdle;
+        }
+        LOG(trace) << " in total " << i << " blocks have been freed";
+
+        // grow before an allocation has to wait for it
+        if (grow_watermark_ && rmb_[shelf_num]->GrowAhead(grow_watermark_))
+            LOG(trace) << "cleaner: grew shelf " << shelf_num;
+
+        if (merge_slice_us_)
+            MergeStep(shelf_num);
+
+        if (lazy_zero_ &&
+            rmb_[shelf_num]->ZeroStep(kZeroBytesPerRound) == kZeroBytesPerRound)
+            behind = true;
+    }
+    uint64_t backlog = DelayedFreeBacklog() + FreeDueHuge(false);
+    backlog_.store(backlog, std::memory_order_relaxed);
+
+    if (behind) {
+        free_cnt_ = std::min(free_cnt_ * 2, kMaxFreeCnt);
+        sleep_us = 0;
+    } else {
+        free_cnt_ = std::max(free_cnt_ / 2, kMinFreeCnt);
+        sleep_us = std::min(std::max(sleep_us * 2, kWorkerMinSleepMicroSeconds),
+                            kWorkerMaxSleepMicroSeconds);
+    }
+    LOG(trace) << "cleaner: backlog " << backlog << ", next batch "
+               << free_cnt_ << ", sleep " << sleep_us << " us";
+    return sleep_us;
+}
+
+void EpochZoneHeap::KickWorker() {
+    int task = cleaner_task_.load(std::memory_order_relaxed);
+    if (task >= 0)
+        Scheduler::GetInstance()->Wake(task);
+}
+
+void EpochZoneHeap::AddBacklog(uint64_t count) {
+    // only the first chunk has to be seen, the worker counts the rest
+    if (backlog_.load(std::memory_order_relaxed) == 0)
+        backlog_.store(count, std::memory_order_relaxed);
+}
+
+uint64_t EpochZoneHeap::DelayedFreeBacklog() {
+    ASSERT_IS_OPEN();
+    uint64_t backlog = 0;
+    for (int shelf_num = 0; shelf_num < total_mapped_shelfs_; shelf_num++) {
+        for (int e = 0; e < kListCnt; e++) {
+            int64_t cnt = global_list_[shelf_num][e].size();
+            if (cnt > 0)
+                backlog += (uint64_t)cnt;
         }
     }
+    return backlog;
+}
+
+// std::min takes references, so this needs a definition
+uint64_t const EpochZoneHeap::kMergeSliceChunks;
+
+void EpochZoneHeap::MergeStep(int shelf_num) {
+    /*
+    Runs when allocations have failed at some level since the last round:
+    merges the levels below the lowest such level bottom-up, so the chunks of
+    one level can feed the merge of the next. A level is only worth it if it
+    has enough free chunks to make up one chunk of the missed level (or a
+    full slice). Each slice takes a bounded number of chunks
+    off a level and puts them back merged, so an allocation waits at most
+    for one slice, and the whole step stops once its time budget is used up.
+    */
+    uint64_t missed = rmb_[shelf_num]->TakeMissedLevels();
+    if (missed == 0)
+        return;
+    uint64_t top = __builtin_ctzl(missed);
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(merge_slice_us_);
+    uint64_t merged = 0;
+    for (uint64_t level = 0; level < top; level++) {
+        uint64_t need = std::min(1UL << (top - level), kMergeSliceChunks);
+        if (rmb_[shelf_num]->FreeChunks(level, need) < need)
+            continue;
+        while (std::chrono::steady_clock::now() < deadline) {
+            uint64_t cnt = rmb_[shelf_num]->MergeSlice(level, kMergeSliceChunks);
+            merged += cnt;
+            if (cnt == 0)
+                break;
+            std::this_thread::yield();
+        }
+        // the next failed allocation brings us back for the rest
+        if (std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    LOG(trace) << "cleaner: merged " << merged << " chunk pairs on shelf "
+               << shelf_num;
+}
+
+ThreadCache *EpochZoneHeap::GetThreadCache() {
+    if (thread_cache_ == false)
+        return NULL;
+    ThreadCache *cache = ThreadCache::Lookup(cache_owner_);
+    if (cache == NULL) {
+        std::shared_ptr<ThreadCache> new_cache =
+            std::make_shared<ThreadCache>(cache_owner_, rmb_, min_obj_size_);
+        {
+            std::lock_guard<std::mutex> lock(caches_mutex_);
+            // drop the caches of threads that have exited
+            caches_.erase(
+                std::remove_if(caches_.begin(), caches_.end(),
+                               [](const std::shared_ptr<ThreadCache> &c) {
+                                   return c->IsDetached();
+                               }),
+                caches_.end());
+            caches_.push_back(new_cache);
+        }
+        ThreadCache::Register(new_cache);
+        cache = new_cache.get();
+    }
+    return cache;
+}
+
+void EpochZoneHeap::FlushThreadCaches(bool detach) {
+    std::lock_guard<std::mutex> lock(caches_mutex_);
+    for (auto &cache : caches_) {
+        if (detach)
+            cache->Detach();
+        else
+            cache->Flush();
+    }
+    if (detach)
+        caches_.clear();
 }
 
 // TODO: Currently do the below function for only heap 0.
@@ -1402,18 +2107,68 @@ void EpochZoneHeap::Merge() {
 void EpochZoneHeap::OfflineRecover() {
     ASSERT_IS_OPEN();
     OpenNewShelfs();
+    // cached chunks look leaked to the garbage collection
+    FlushThreadCaches(false);
     fam_atomic_u64_write(&gh_->op_in_progress, 0);
+    RecoverHuge();
     // TODO: Handle errors from OfflineRecover
-    for (int shelf_num = 0; shelf_num < total_mapped_shelfs_; shelf_num++)
-        rmb_[shelf_num]->OfflineRecover();
+    RecoverShelfs("offline", [](ShelfHeap *shelf, uint64_t threads) {
+        shelf->OfflineRecover(threads);
+    });
 }
 
 void EpochZoneHeap::OnlineRecover() {
     ASSERT_IS_OPEN();
     OpenNewShelfs();
     // TODO: Handle errors from OnlineRecover
-    for (int shelf_num = 0; shelf_num < (int)total_mapped_shelfs_; shelf_num++)
-        rmb_[shelf_num]->OnlineRecover();
+    RecoverShelfs("online", [](ShelfHeap *shelf, uint64_t threads) {
+        shelf->OnlineRecover();
+    });
+}
+
+void EpochZoneHeap::RecoverShelfs(
+    const char *what,
+    const std::function<void(ShelfHeap *, uint64_t)> &recover) {
+    /*
+    The shelves recover independently, so a pool of workers takes them one at
+    a time. The threads left over once every worker has a shelf go to the
+    zones themselves, which split their headers into ranges.
+    */
+    uint64_t threads = config.RecoveryThreads;
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1U);
+    uint64_t shelf_cnt = (uint64_t)total_mapped_shelfs_;
+    uint64_t worker_cnt = std::min(threads, shelf_cnt);
+    uint64_t zone_threads = std::max(threads / std::max(worker_cnt, 1UL), 1UL);
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> next_shelf{0}, done{0};
+    auto worker = [&]() {
+        for (;;) {
+            uint64_t shelf_num = next_shelf.fetch_add(1);
+            if (shelf_num >= shelf_cnt)
+                return;
+            auto shelf_start = std::chrono::steady_clock::now();
+            recover(rmb_[shelf_num], zone_threads);
+            auto shelf_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - shelf_start);
+            LOG(info) << what << " recovery: shelf " << shelf_num << " done in "
+                      << shelf_ms.count() << " ms (" << done.fetch_add(1) + 1
+                      << "/" << shelf_cnt << ")";
+        }
+    };
+    std::vector<std::thread> workers;
+    for (uint64_t i = 1; i < worker_cnt; i++)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (auto &w : workers)
+        w.join();
+
+    auto total_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    LOG(info) << what << " recovery: " << shelf_cnt << " shelves in "
+              << total_ms.count() << " ms (" << worker_cnt << " workers, "
+              << zone_threads << " threads per zone)";
 }
 
 void EpochZoneHeap::Stats() {
@@ -1424,6 +2179,222 @@ void EpochZoneHeap::Stats() {
         rmb_[shelf_num]->Stats();
 }
 
+ErrorCode EpochZoneHeap::GetStats(HeapStats *stats, bool exact) {
+    ASSERT_IS_OPEN();
+    if (stats == NULL)
+        return INVALID_ARGUMENTS;
+    OpenNewShelfs();
+    stats->shelves.clear();
+
+    for (int shelf_num = 0; shelf_num < total_mapped_shelfs_; shelf_num++) {
+        ShelfStats ss;
+        ss.shelf_idx = (ShelfIndex)(shelf_num + 1);
+        rmb_[shelf_num]->GetStats(&ss, exact);
+
+        // the chunks on the delayed free lists are still allocated
+        ss.delayed_free_chunks = 0;
+        ss.delayed_free_bytes = 0;
+        uint64_t units = ss.grown_size / min_obj_size_;
+        for (int e = 0; e < kListCnt; e++) {
+            ZoneEntryStack &list = global_list_[shelf_num][e];
+            int64_t cnt = list.size();
+            if (!exact) {
+                ss.delayed_free_chunks += cnt > 0 ? (uint64_t)cnt : 0;
+                continue;
+            }
+            uint64_t idx = fam_atomic_u64_read(&list.head);
+            for (uint64_t i = 0; idx != 0 && i < units; i++) {
+                ss.delayed_free_chunks++;
+                ss.delayed_free_bytes +=
+                    rmb_[shelf_num]->BlockSize((idx - 1) * min_obj_size_);
+                idx = bitmap_start_[shelf_num].load(idx).next();
+            }
+        }
+        stats->shelves.push_back(ss);
+    }
+
+    for (int idx = Pool::kMaxShelfCount - 1; idx > total_mapped_shelfs_; idx--) {
+        uint64_t size = fam_atomic_u64_read(&gh_->huge_size[idx]);
+        if (size == 0 || size == kZoneShelf)
+            continue;
+        ShelfStats ss = ShelfStats();
+        ss.shelf_idx = (ShelfIndex)idx;
+        ss.huge = true;
+        ss.size = ss.grown_size = ss.used_bytes = size;
+        if (fam_atomic_u64_read(&gh_->huge_free_epoch[idx]) != 0) {
+            ss.delayed_free_chunks = 1;
+            ss.delayed_free_bytes = size;
+        }
+        stats->shelves.push_back(ss);
+    }
+
+    stats->exact = exact;
+    stats->size = stats->grown_size = 0;
+    stats->free_bytes = stats->used_bytes = 0;
+    stats->delayed_free_chunks = stats->delayed_free_bytes = 0;
+    stats->largest_free_chunk = 0;
+    for (auto &ss : stats->shelves) {
+        stats->size += ss.size;
+        stats->grown_size += ss.grown_size;
+        stats->free_bytes += ss.free_bytes;
+        stats->used_bytes += ss.used_bytes;
+        stats->delayed_free_chunks += ss.delayed_free_chunks;
+        stats->delayed_free_bytes += ss.delayed_free_bytes;
+        stats->largest_free_chunk =
+            std::max(stats->largest_free_chunk, ss.largest_free_chunk);
+    }
+    stats->fragmentation =
+        stats->free_bytes ? 1.0 - (double)stats->largest_free_chunk /
+                                      (double)stats->free_bytes
+                          : 0.0;
+    return NO_ERROR;
+}
+
+/***************************************************************************/
+/*                                                                         */
+/* Huge objects                                                            */
+/*                                                                         */
+/***************************************************************************/
+
+bool EpochZoneHeap::IsHugeShelf(ShelfIndex shelf_idx) {
+    // the zone shelves come first, so they take no FAM read
+    if (shelf_idx <= total_mapped_shelfs_ || shelf_idx >= Pool::kMaxShelfCount)
+        return false;
+    uint64_t size = fam_atomic_u64_read(&gh_->huge_size[shelf_idx]);
+    return size != 0 && size != kZoneShelf;
+}
+
+GlobalPtr EpochZoneHeap::AllocHuge(size_t size) {
+    /*
+    A huge object gets a shelf of its own, sized to the object rounded up to
+    the page, instead of a power-of-two chunk that would waste up to half of
+    it (or a Resize). Huge shelves take the shelf indexes from the top down,
+    Resize from the bottom up, and both claim an index in gh_->huge_size
+    before they touch its shelf.
+    */
+    size = round_up(size, getpagesize());
+    mode_t perm;
+    if (region_->GetPermission(&perm) != NO_ERROR)
+        return 0;
+
+    for (int idx = Pool::kMaxShelfCount - 1; idx > get_total_data_shelfs();
+         idx--) {
+        if (fam_atomic_u64_compare_and_store(&gh_->huge_size[idx], 0, size) != 0)
+            continue;
+        ShelfIndex shelf_idx = (ShelfIndex)idx;
+        // a crash may have left the shelf of an earlier object behind
+        if (pool_.CheckShelf(shelf_idx) == true)
+            (void)pool_.RemoveShelf(shelf_idx);
+        ErrorCode ret = pool_.AddShelf(shelf_idx,
+                                       [size](ShelfFile *shelf, size_t) {
+                                           ShelfRegion region(shelf->GetPath());
+                                           return region.Create(size);
+                                       },
+                                       false, perm);
+        if (ret != NO_ERROR) {
+            LOG(error) << "Zone: creating huge shelf " << idx << " failed";
+            fam_atomic_u64_write(&gh_->huge_size[idx], 0);
+            return 0;
+        }
+        LOG(trace) << "huge object of " << size << " bytes in shelf " << idx;
+        return GlobalPtr(ShelfId(pool_id_, shelf_idx), 0);
+    }
+    LOG(error) << "Zone: no shelf left for a huge object of " << size
+               << " bytes";
+    return 0;
+}
+
+void EpochZoneHeap::FreeHuge(ShelfIndex shelf_idx) {
+    // others drop their maps when they see the generation change
+    fam_atomic_64_fetch_add(&(int64_t &)gh_->huge_gen[shelf_idx], 1);
+    ShelfManager::UnmapShelf(ShelfId(pool_id_, shelf_idx));
+    ErrorCode ret = pool_.RemoveShelf(shelf_idx);
+    if (ret != NO_ERROR)
+        LOG(error) << "Zone: removing huge shelf " << (int)shelf_idx
+                   << " failed: " << ret;
+    fam_atomic_u64_write(&gh_->huge_free_epoch[shelf_idx], 0);
+    fam_atomic_u64_write(&gh_->huge_size[shelf_idx], 0);
+}
+
+void EpochZoneHeap::DelayFreeHuge(EpochOp &op, ShelfIndex shelf_idx) {
+    // same delay as the delayed free lists; the epoch is kept in FAM, so the
+    // background worker of any process can do the free
+    EpochCounter e = op.reported_epoch();
+    LOG(trace) << "delay freeing huge shelf " << (int)shelf_idx << " at epoch "
+               << e + 3;
+    fam_atomic_u64_write(&gh_->huge_free_epoch[shelf_idx], (uint64_t)(e + 3));
+    AddBacklog(1);
+}
+
+uint64_t EpochZoneHeap::FreeDueHuge(bool all) {
+    uint64_t pending = 0;
+    EpochCounter e = 0;
+    if (!all) {
+        EpochManager *em = EpochManager::GetInstance();
+        EpochOp op(em);
+        e = op.reported_epoch();
+    }
+    for (int idx = Pool::kMaxShelfCount - 1; idx > total_mapped_shelfs_; idx--) {
+        uint64_t due = fam_atomic_u64_read(&gh_->huge_free_epoch[idx]);
+        if (due == 0)
+            continue;
+        if (!all && (EpochCounter)due > e) {
+            pending++;
+            continue;
+        }
+        // only one process gets to free it
+        if (fam_atomic_u64_compare_and_store(&gh_->huge_free_epoch[idx], due,
+                                             0) != due)
+            continue;
+        FreeHuge((ShelfIndex)idx);
+    }
+    return pending;
+}
+
+void *EpochZoneHeap::MapHuge(ShelfIndex shelf_idx) {
+    ShelfId shelf_id(pool_id_, shelf_idx);
+    uint64_t gen = fam_atomic_u64_read(&gh_->huge_gen[shelf_idx]);
+    {
+        // the shelf we mapped may have been freed and the index reused since
+        std::lock_guard<std::mutex> lock(huge_mutex_);
+        if (huge_gen_[shelf_idx] != gen) {
+            ShelfManager::UnmapShelf(shelf_id);
+            huge_gen_[shelf_idx] = gen;
+        }
+    }
+    void *addr = ShelfManager::FindBase(shelf_id);
+    if (addr == NULL) {
+        std::string path;
+        if (pool_.GetShelfPath(shelf_idx, path) != NO_ERROR)
+            return NULL;
+        addr = ShelfManager::FindBase(path, shelf_id);
+    }
+    return addr;
+}
+
+void EpochZoneHeap::RecoverHuge() {
+    /*
+    A crash can leave an index claimed without a shelf (during AllocHuge or
+    FreeHuge), or a shelf without a claim (FreeHuge after the claim was
+    dropped); either way the object is gone.
+    */
+    for (int idx = Pool::kMaxShelfCount - 1; idx > total_mapped_shelfs_; idx--) {
+        ShelfIndex shelf_idx = (ShelfIndex)idx;
+        uint64_t size = fam_atomic_u64_read(&gh_->huge_size[idx]);
+        bool exists = pool_.CheckShelf(shelf_idx);
+        if (size == kZoneShelf)
+            continue; // a Resize that did not finish
+        if (size != 0 && !exists) {
+            LOG(info) << "huge recovery: dropping the claim on shelf " << idx;
+            fam_atomic_u64_write(&gh_->huge_free_epoch[idx], 0);
+            fam_atomic_u64_write(&gh_->huge_size[idx], 0);
+        } else if (size == 0 && exists) {
+            LOG(info) << "huge recovery: removing shelf " << idx;
+            (void)pool_.RemoveShelf(shelf_idx);
+        }
+    }
+}
+
 /* 
  * Offlinefree will free delayed free items from all the epoch queues.
  * It parses queues from all the shelfs.
@@ -1435,6 +2406,7 @@ void EpochZoneHeap::Stats() {
 void EpochZoneHeap::OfflineFree() {
     ASSERT_IS_OPEN();
     OpenNewShelfs();    
+    FreeDueHuge(true);
     for (int shelf_num = 0; shelf_num < (int)total_mapped_shelfs_; shelf_num++) {
          for(int e = 0; e < kListCnt; e++) {
              while (1) {
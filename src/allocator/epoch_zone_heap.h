@@ -26,17 +26,21 @@
 #ifndef _NVMM_EPOCH_ZONE_HEAP_H_
 #define _NVMM_EPOCH_ZONE_HEAP_H_
 
-#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <stddef.h>
 #include <stdint.h>
 #include <thread>
+#include <vector>
 
 #include "nvmm/error_code.h"
 #include "nvmm/global_ptr.h"
 #include "nvmm/heap.h"
 #include "nvmm/shelf_id.h"
 
+#include "common/common.h"
 #include "shelf_mgmt/pool.h"
 #include "shelf_usage/zone_entry_stack.h"
 
@@ -44,6 +48,7 @@ namespace nvmm {
 
 class ShelfHeap;
 class ShelfRegion;
+class ThreadCache;
 
 struct shelf_size {
     uint64_t headersize;
@@ -60,9 +65,24 @@ struct GlobalHeader {
     uint64_t op_in_progress;
     uint64_t destroy_in_progress;
     uint64_t fast_alloc;
+    uint64_t freelist_stripes; // freelist heads per level, same for all shelves
+    uint64_t compact_header;   // shelves are created with compact headers
+    uint64_t slab_class_cnt;   // slab size classes, same for all shelves
+    uint64_t slab_classes[MAX_SLAB_CLASSES];
     uint64_t total_shelfs;
     uint64_t total_size;
     shelf_size sz[ShelfId::kMaxShelfCount];
+    // Shelves that hold a single huge object (see AllocHuge), by shelf index:
+    // the page-rounded object size, kZoneShelf for the shelves of the zone,
+    // or 0 if the index is unused
+    uint64_t huge_size[ShelfId::kMaxShelfCount];
+    // the epoch a huge object freed in an EpochOp can go at, or 0
+    uint64_t huge_free_epoch[ShelfId::kMaxShelfCount];
+    // bumped whenever a huge shelf goes away, so that others drop their maps
+    uint64_t huge_gen[ShelfId::kMaxShelfCount];
+    // NUMA placement of the data shelves, by shelf number, fixed at creation
+    // for all of them (see encode_numa_node)
+    uint64_t shelf_node[ShelfId::kMaxShelfCount];
 };
 
 // zone heap with delayed free
@@ -92,16 +112,23 @@ class EpochZoneHeap : public Heap {
 
     GlobalPtr Alloc(size_t size);
     void Free(GlobalPtr global_ptr);
+    void Free(GlobalPtr global_ptr, size_t size);
+    size_t AllocBatch(size_t size, size_t count, GlobalPtr *ptrs);
+    void FreeBatch(GlobalPtr *ptrs, size_t count);
     ErrorCode Map(Offset offset, size_t size, void *addr_hint, int prot,
                   void **mapped_addr);
     ErrorCode Unmap(Offset offset, void *mapped_addr, size_t size);
 
+    GlobalPtr Realloc(GlobalPtr global_ptr, size_t size);
+
     GlobalPtr Alloc(EpochOp &op, size_t size);
     Offset AllocOffset(size_t size);
 
     void Free(EpochOp &op, GlobalPtr global_ptr);
     void Free(EpochOp &op, Offset offset);
+    void Free(EpochOp &op, GlobalPtr global_ptr, size_t size);
     void Free(Offset offset);
+    void FreeBatch(EpochOp &op, GlobalPtr *ptrs, size_t count);
 
     void *OffsetToLocal(Offset offset);
     void *GlobalToLocal(GlobalPtr global_ptr);
@@ -113,6 +140,8 @@ class EpochZoneHeap : public Heap {
     void OnlineRecover();
     void OfflineRecover();
     void Stats();
+    ErrorCode GetStats(HeapStats *stats, bool exact = false);
+    uint64_t DelayedFreeBacklog();
     void delayed_free_fn();
 
   private:
@@ -120,9 +149,22 @@ class EpochZoneHeap : public Heap {
     static int const kZoneIdx = 1;   // zone
 
     static int const kListCnt = 5; // 5 global freelists for delayed free
-    static uint64_t const kWorkerSleepMicroSeconds = 50000;
-    uint64_t kFreeCnt =
-        1000; // free up to 1000 chunks everytime the background worker wakes up
+    // the background worker sleeps between these, for longer the less it
+    // finds to do, unless it is woken up (see KickWorker)
+    static uint64_t const kWorkerMinSleepMicroSeconds = 1000;
+    static uint64_t const kWorkerMaxSleepMicroSeconds = 1000000;
+    // bounds on the chunks freed per shelf and round of the worker
+    static uint64_t const kMinFreeCnt = 1000;
+    static uint64_t const kMaxFreeCnt = 64 * 1024;
+    // due chunks AllocRecycled looks at for one of the right level
+    static uint64_t const kRecycleScanCnt = 8;
+    static uint64_t const kMergeSliceChunks = 4096; // chunks per merge slice
+    static size_t const kZeroBytesPerRound = 64UL << 20; // see Zone::zero_step
+    static uint64_t const kZoneShelf = ~0UL; // see GlobalHeader::huge_size
+    uint64_t free_cnt_; // chunks the worker frees per shelf and round
+    // chunks on the delayed free lists as the worker last counted them, plus
+    // a guess at what was added since; 0 only if nothing is waiting
+    std::atomic<uint64_t> backlog_;
     int total_mapped_shelfs_;
 
     GlobalHeader *gh_;
@@ -137,11 +179,24 @@ class EpochZoneHeap : public Heap {
                           // memory chunks fron zone heap
     void *mapped_addr_[ShelfId::kMaxShelfCount];
     void *header_[ShelfId::kMaxShelfCount];
-    void *bitmap_start_[ShelfId::kMaxShelfCount];
+    ZoneEntryArray bitmap_start_[ShelfId::kMaxShelfCount];
 
     ZoneEntryStack *global_list_[ShelfId::kMaxShelfCount];
     uint64_t min_obj_size_;
     uint64_t fast_alloc_;
+    uint64_t freelist_stripes_;
+    bool compact_header_;
+    uint64_t slab_class_cnt_;
+    uint64_t slab_classes_[MAX_SLAB_CLASSES];
+    uint64_t grow_watermark_; // bytes, see Config::GrowWatermark
+    bool eager_merge_;        // NVMM_EAGER_MERGE
+    uint64_t merge_slice_us_; // see Config::MergeSliceMicroSeconds
+    bool lazy_zero_;          // NVMM_LAZY_ZERO, needs the background worker
+    uint64_t huge_threshold_; // see Config::HugeAllocThreshold
+    std::mutex huge_mutex_;   // guards huge_gen_
+    uint64_t huge_gen_[ShelfId::kMaxShelfCount]; // gh_->huge_gen we mapped
+    int shelf_node_[ShelfId::kMaxShelfCount]; // see numa_bind
+    bool numa_; // some shelf is bound to a node, Alloc prefers local ones
 
     bool is_open_;
     bool is_invalid_;
@@ -159,21 +214,60 @@ class EpochZoneHeap : public Heap {
     size_t get_total_size();
     int get_total_data_shelfs();
     Offset get_offset_from_shelfIndexoffset(Offset offset);
+    void group_by_shelf(GlobalPtr *ptrs, size_t count,
+                        std::vector<std::vector<Offset>> &groups,
+                        std::vector<ShelfIndex> &huge);
     int get_shelfnum_from_shelfIndexoffset(Offset offset);
 
-    // for the background cleaner thread
-    std::thread cleaner_thread_;
-    std::mutex cleaner_mutex_;
-    std::condition_variable running_cv_;
+    // huge objects, one per shelf (see Config::HugeAllocThreshold)
+    bool IsHugeShelf(ShelfIndex shelf_idx);
+    GlobalPtr AllocHuge(size_t size);
+    void FreeHuge(ShelfIndex shelf_idx);
+    void DelayFreeHuge(EpochOp &op, ShelfIndex shelf_idx);
+    // takes a chunk for size off the due delayed free list of the shelf, or
+    // returns 0
+    Offset AllocRecycled(int shelf_num, size_t size);
+
+    // delayed free of the chunk at idx of the shelf, whose header entry is
+    // entry; buffered per thread until the EpochOp ends (see
+    // DelayedFreeBuffer)
+    void DelayFree(EpochOp &op, int shelf_num, uint64_t idx, zone_entry entry);
+    // publishes the delayed frees this thread buffered for this heap
+    void FlushDelayedFrees();
+    // frees the huge objects whose delayed free is due, or all of them;
+    // returns the number of those not due yet
+    uint64_t FreeDueHuge(bool all);
+    void *MapHuge(ShelfIndex shelf_idx);
+    void RecoverHuge();
+
+    // for the background cleaner, a task of the Scheduler
+    std::mutex cleaner_mutex_; // serializes StartWorker and StopWorker
     bool no_bgthread_;
-    bool cleaner_start_;
-    bool cleaner_stop_;
-    bool cleaner_running_;
+    std::atomic<int> cleaner_task_; // -1 while not started
+    uint64_t cleaner_sleep_us_;
+    int advance_cb_; // handle of our EpochManager advance callback, or -1
+
+    // per-thread chunk caches (NVMM_THREAD_CACHE)
+    bool thread_cache_;
+    uint64_t cache_owner_; // unique for every Open(), also keys alloc hints
+    std::mutex caches_mutex_;
+    std::vector<std::shared_ptr<ThreadCache>> caches_;
+    ThreadCache *GetThreadCache();
+    void FlushThreadCaches(bool detach);
 
     // start/stop the background cleaner
     int StartWorker();
     int StopWorker();
-    void BackgroundWorker();
+    // one round of the cleaner; returns how long to sleep
+    uint64_t CleanerRound();
+    // wakes the worker before its sleep is over
+    void KickWorker();
+    // records that count chunks joined the delayed free lists
+    void AddBacklog(uint64_t count);
+    void MergeStep(int shelf_num);
+    // runs recover on every shelf, spread over Config::RecoveryThreads
+    void RecoverShelfs(const char *what,
+                       const std::function<void(ShelfHeap *, uint64_t)> &recover);
     void OfflineFree();
 };
 } // namespace nvmm
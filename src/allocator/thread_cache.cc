@@ -0,0 +1,227 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <algorithm>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nvmm/log.h"
+
+#include "shelf_usage/zone_shelf_heap.h"
+
+#include "allocator/thread_cache.h"
+
+namespace nvmm {
+
+namespace {
+
+// the caches of the calling thread, one per open heap it has touched
+struct CacheRegistry {
+    std::vector<std::shared_ptr<ThreadCache>> caches;
+    ~CacheRegistry() {
+        // return the cached chunks when the thread exits
+        for (auto &cache : caches)
+            cache->Detach();
+    }
+};
+
+thread_local CacheRegistry registry;
+
+inline uint64_t size_to_level(size_t size, size_t min_obj_size) {
+    size = std::max(size, min_obj_size);
+    uint64_t level = (uint64_t)(63 - __builtin_clzl(size)) -
+                     (uint64_t)__builtin_ctzl(min_obj_size);
+    if (size & (size - 1))
+        level++;
+    return level;
+}
+
+} // namespace
+
+ThreadCache::ThreadCache(uint64_t owner, ShelfHeap *const *shelves,
+                         size_t min_obj_size)
+    : owner_{owner}, shelves_{shelves}, min_obj_size_{min_obj_size},
+      level_cnt_{0}, detached_{false} {
+    if (min_obj_size_ <= kMaxCachedSize)
+        level_cnt_ = size_to_level(kMaxCachedSize, min_obj_size_) + 1;
+}
+
+ThreadCache::~ThreadCache() { Detach(); }
+
+ThreadCache *ThreadCache::Lookup(uint64_t owner) {
+    for (auto &cache : registry.caches) {
+        if (cache->Owner() == owner)
+            return cache.get();
+    }
+    return NULL;
+}
+
+void ThreadCache::Register(std::shared_ptr<ThreadCache> cache) {
+    // forget the caches of heaps that have been closed in the meantime
+    registry.caches.erase(
+        std::remove_if(registry.caches.begin(), registry.caches.end(),
+                       [](const std::shared_ptr<ThreadCache> &c) {
+                           return c->IsDetached();
+                       }),
+        registry.caches.end());
+    registry.caches.push_back(cache);
+}
+
+// std::min/max take references, so these need a definition
+uint64_t const ThreadCache::kMinMagazineCnt;
+uint64_t const ThreadCache::kMaxMagazineCnt;
+
+uint64_t ThreadCache::capacity(uint64_t level) {
+    uint64_t cnt = kMaxMagazineBytes / (min_obj_size_ << level);
+    return std::min(std::max(cnt, kMinMagazineCnt), kMaxMagazineCnt);
+}
+
+std::vector<Offset> &ThreadCache::magazine(int shelf_num, uint64_t level) {
+    size_t idx = (size_t)shelf_num * level_cnt_ + level;
+    if (idx >= magazines_.size())
+        magazines_.resize(((size_t)shelf_num + 1) * level_cnt_);
+    return magazines_[idx];
+}
+
+Offset ThreadCache::Alloc(int shelf_num, size_t size) {
+    if (size > kMaxCachedSize || level_cnt_ == 0)
+        return 0;
+    uint64_t level = size_to_level(size, min_obj_size_);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (detached_)
+        return 0;
+
+    ShelfHeap *shelf = shelves_[shelf_num];
+    if (shelf->IsSlabSize(size))
+        return 0;
+    std::vector<Offset> &mag = magazine(shelf_num, level);
+    if (mag.empty()) {
+        // refill half a magazine in one go
+        uint64_t batch = capacity(level) / 2;
+        mag.resize(batch);
+        uint64_t cnt = shelf->TakeChunks(level, batch, mag.data());
+        mag.resize(cnt);
+        if (cnt == 0)
+            return 0;
+    }
+    Offset offset = mag.back();
+    mag.pop_back();
+    shelf->MarkAllocated(offset, level);
+    return offset;
+}
+
+void ThreadCache::Free(int shelf_num, Offset offset) {
+    if (offset == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(detached_ == false);
+
+    ShelfHeap *shelf = shelves_[shelf_num];
+    if (shelf->IsSlabSlot(offset)) {
+        shelf->Free(offset);
+        return;
+    }
+    cache_released(shelf_num, offset, shelf->Release(offset));
+}
+
+void ThreadCache::Free(int shelf_num, Offset offset, size_t size) {
+    if (offset == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(detached_ == false);
+
+    ShelfHeap *shelf = shelves_[shelf_num];
+    if (shelf->IsSlabSize(size)) {
+        shelf->Free(offset, size);
+        return;
+    }
+    uint64_t level = shelf->SizeToLevel(size);
+    assert(shelf->BlockSize(offset) == (min_obj_size_ << level));
+    shelf->Release(offset, level);
+    cache_released(shelf_num, offset, level);
+}
+
+// keeps a released chunk in the magazine of its level, handing half of it
+// back when it overflows
+void ThreadCache::cache_released(int shelf_num, Offset offset, uint64_t level) {
+    ShelfHeap *shelf = shelves_[shelf_num];
+    if (level >= level_cnt_) {
+        shelf->PutChunks(level, &offset, 1);
+        return;
+    }
+
+    std::vector<Offset> &mag = magazine(shelf_num, level);
+    mag.push_back(offset);
+    uint64_t cap = capacity(level);
+    if (mag.size() > cap) {
+        // keep half a magazine, hand the rest back as one chain
+        uint64_t keep = cap / 2;
+        shelf->PutChunks(level, mag.data() + keep, mag.size() - keep);
+        mag.resize(keep);
+    }
+}
+
+void ThreadCache::flush_locked() {
+    if (level_cnt_ == 0)
+        return;
+    for (size_t idx = 0; idx < magazines_.size(); idx++) {
+        std::vector<Offset> &mag = magazines_[idx];
+        if (mag.empty())
+            continue;
+        int shelf_num = (int)(idx / level_cnt_);
+        uint64_t level = idx % level_cnt_;
+        LOG(trace) << "ThreadCache: returning " << mag.size()
+                   << " chunks of level " << level << " to shelf "
+                   << shelf_num;
+        shelves_[shelf_num]->PutChunks(level, mag.data(), mag.size());
+        mag.clear();
+    }
+}
+
+void ThreadCache::Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (detached_)
+        return;
+    flush_locked();
+}
+
+void ThreadCache::Detach() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (detached_)
+        return;
+    flush_locked();
+    detached_ = true;
+}
+
+bool ThreadCache::IsDetached() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return detached_;
+}
+
+} // namespace nvmm
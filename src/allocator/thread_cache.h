@@ -0,0 +1,107 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#ifndef _NVMM_THREAD_CACHE_H_
+#define _NVMM_THREAD_CACHE_H_
+
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "nvmm/global_ptr.h"
+
+namespace nvmm {
+
+class ShelfHeap;
+
+//
+// Per-thread magazines of free chunks in front of the zone freelists of an
+// open heap. Small allocs and frees are served from the magazines, which are
+// refilled from and drained to the shared freelists in batches, so most
+// alloc/free pairs never touch the freelist heads in FAM.
+//
+// A cached chunk is neither allocated nor on a freelist. Caches are drained
+// when their thread exits or when the heap is closed; if the process crashes
+// the cached chunks are reclaimed by the offline garbage collection.
+//
+class ThreadCache {
+  public:
+    // chunks larger than this are never cached
+    static size_t const kMaxCachedSize = 32 * 1024;
+    // bounds on the number of chunks (and bytes) a magazine holds
+    static uint64_t const kMinMagazineCnt = 4;
+    static uint64_t const kMaxMagazineCnt = 64;
+    static size_t const kMaxMagazineBytes = 256 * 1024;
+
+    // shelves is the shelf array of the owning heap; entries may be filled
+    // in later (e.g., by a resize) but must stay valid until Detach()
+    ThreadCache(uint64_t owner, ShelfHeap *const *shelves,
+                size_t min_obj_size);
+    ~ThreadCache();
+
+    ThreadCache(const ThreadCache &) = delete;
+    ThreadCache &operator=(const ThreadCache &) = delete;
+
+    // the calling thread's cache for owner, or NULL if it has none yet
+    static ThreadCache *Lookup(uint64_t owner);
+    // installs cache as the calling thread's cache for its owner; the cache
+    // is drained and detached when the thread exits
+    static void Register(std::shared_ptr<ThreadCache> cache);
+
+    // returns 0 if the size is not cached or no chunk could be found
+    Offset Alloc(int shelf_num, size_t size);
+    void Free(int shelf_num, Offset offset);
+    // sized free (see Zone::free(Offset, size_t))
+    void Free(int shelf_num, Offset offset, size_t size);
+
+    // returns all cached chunks to their freelists
+    void Flush();
+    // flushes and stops using the owner's shelves
+    void Detach();
+    bool IsDetached();
+
+    uint64_t Owner() const { return owner_; }
+
+  private:
+    uint64_t capacity(uint64_t level);
+    std::vector<Offset> &magazine(int shelf_num, uint64_t level);
+    void flush_locked();
+    void cache_released(int shelf_num, Offset offset, uint64_t level);
+
+    uint64_t owner_;
+    ShelfHeap *const *shelves_;
+    size_t min_obj_size_;
+    uint64_t level_cnt_; // number of cached levels
+
+    std::mutex mutex_;
+    bool detached_;
+    // indexed by shelf_num * level_cnt_ + level
+    std::vector<std::vector<Offset>> magazines_;
+};
+
+} // namespace nvmm
+#endif
@@ -50,6 +50,13 @@ static int const kVirtualPageSize = 64*1024;
 
 #define MAX_ZONE_SIZE (1024 * GB)
 
+/*
+ * Slab allocation: size classes are served from slots carved out of
+ * SLAB_SIZE chunks
+ */
+#define SLAB_SIZE (64 * KB)
+#define MAX_SLAB_CLASSES 16
+
 /*
  * Round non-negative x up to the nearest multiple of positive
  * multiple
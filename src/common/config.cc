@@ -102,6 +102,42 @@ int Config::LoadConfigFile(std::string path) {
     if(nvmm["shelf_user"]) {
         ShelfUser=nvmm["shelf_user"].as<std::string>();
     }
+    if(nvmm["freelist_stripes"]) {
+        FreelistStripes=nvmm["freelist_stripes"].as<uint64_t>();
+    }
+    if(nvmm["slab_size_classes"]) {
+        SlabSizeClasses=nvmm["slab_size_classes"].as<std::vector<uint64_t>>();
+    }
+    if(nvmm["zone_initial_size"]) {
+        ZoneInitialSize=nvmm["zone_initial_size"].as<uint64_t>();
+    }
+    if(nvmm["grow_watermark"]) {
+        GrowWatermark=nvmm["grow_watermark"].as<uint64_t>();
+    }
+    if(nvmm["merge_slice_us"]) {
+        MergeSliceMicroSeconds=nvmm["merge_slice_us"].as<uint64_t>();
+    }
+    if(nvmm["recovery_threads"]) {
+        RecoveryThreads=nvmm["recovery_threads"].as<uint64_t>();
+    }
+    if(nvmm["huge_alloc_threshold"]) {
+        HugeAllocThreshold=nvmm["huge_alloc_threshold"].as<uint64_t>();
+    }
+    if(nvmm["compact_zone_header"]) {
+        CompactZoneHeader=nvmm["compact_zone_header"].as<bool>();
+    }
+    if(nvmm["numa_policy"]) {
+        NumaPolicy=nvmm["numa_policy"].as<std::string>();
+    }
+    if(nvmm["numa_nodes"]) {
+        NumaNodes=nvmm["numa_nodes"].as<std::vector<uint64_t>>();
+    }
+    if(nvmm["scheduler_threads"]) {
+        SchedulerThreads=nvmm["scheduler_threads"].as<uint64_t>();
+    }
+    if(nvmm["scheduler_cpus"]) {
+        SchedulerCpus=nvmm["scheduler_cpus"].as<std::vector<uint64_t>>();
+    }
 
     Setup();
     return ret;
@@ -111,6 +147,27 @@ void Config::Print() {
     std::cout << "NVMM Config " << std::endl;
     std::cout << "- shelf_base: " << ShelfBase << std::endl;
     std::cout << "- shelf_user: " << ShelfUser << std::endl;
+    std::cout << "- freelist_stripes: " << FreelistStripes << std::endl;
+    std::cout << "- slab_size_classes:";
+    for (auto size : SlabSizeClasses)
+        std::cout << " " << size;
+    std::cout << std::endl;
+    std::cout << "- zone_initial_size: " << ZoneInitialSize << std::endl;
+    std::cout << "- grow_watermark: " << GrowWatermark << std::endl;
+    std::cout << "- merge_slice_us: " << MergeSliceMicroSeconds << std::endl;
+    std::cout << "- recovery_threads: " << RecoveryThreads << std::endl;
+    std::cout << "- huge_alloc_threshold: " << HugeAllocThreshold << std::endl;
+    std::cout << "- compact_zone_header: " << (CompactZoneHeader ? "yes" : "no") << std::endl;
+    std::cout << "- numa_policy: " << NumaPolicy << std::endl;
+    std::cout << "- numa_nodes:";
+    for (auto node : NumaNodes)
+        std::cout << " " << node;
+    std::cout << std::endl;
+    std::cout << "- scheduler_threads: " << SchedulerThreads << std::endl;
+    std::cout << "- scheduler_cpus:";
+    for (auto cpu : SchedulerCpus)
+        std::cout << " " << cpu;
+    std::cout << std::endl;
 }
 
 
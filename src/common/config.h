@@ -27,16 +27,25 @@
 #define NVMM_CONFIG_H
 
 #include <cstddef> // size_t
+#include <stdint.h>
 #include <iostream>
 #include <assert.h>
 #include <string>
+#include <vector>
 
 namespace nvmm {
 
 class Config {
 public:
     Config(std::string base=SHELF_BASE_DIR, std::string user=SHELF_USER)
-        : ShelfBase(base), ShelfUser(user) {
+        : ShelfBase(base), ShelfUser(user),
+          FreelistStripes(kDefaultFreelistStripes),
+          SlabSizeClasses(DefaultSlabSizeClasses()),
+          ZoneInitialSize(0), GrowWatermark(kDefaultGrowWatermark),
+          MergeSliceMicroSeconds(kDefaultMergeSliceMicroSeconds),
+          RecoveryThreads(0), HugeAllocThreshold(0),
+          CompactZoneHeader(true), NumaPolicy("none"),
+          SchedulerThreads(kDefaultSchedulerThreads) {
         if(base.empty()) ShelfBase = SHELF_BASE_DIR;
         if(user.empty()) ShelfUser = SHELF_USER;
         Setup();
@@ -55,6 +64,67 @@ public:
 
     std::string RootShelfPath;
     std::string EpochShelfPath;
+
+    // Number of freelist heads per level in newly created heaps (1-64); an
+    // existing heap keeps the value it was created with
+    uint64_t FreelistStripes;
+
+    // Slot sizes served by slabs in heaps created with NVMM_SLAB_ALLOC
+    // (ascending multiples of 16 that are not powers of two, at least the
+    // min object size and at most SLAB_SIZE/8)
+    std::vector<uint64_t> SlabSizeClasses;
+
+    // Size the zone of a newly created shelf starts with, rounded up to a
+    // power of two; the zone grows on demand up to the shelf size. 0 starts
+    // with the whole shelf.
+    uint64_t ZoneInitialSize;
+
+    // The background worker grows a zone ahead of demand once it has no free
+    // chunk of at least this many bytes left; 0 disables it
+    uint64_t GrowWatermark;
+
+    // When allocations fail at a level, the background worker merges the
+    // levels below it in slices, for at most this long per shelf and round;
+    // 0 disables it
+    uint64_t MergeSliceMicroSeconds;
+
+    // Threads recovery spreads the shelves of a heap and the ranges of a
+    // zone over; 0 means one per hardware thread
+    uint64_t RecoveryThreads;
+
+    // Allocations larger than this many bytes get a shelf of their own,
+    // sized to the page, instead of a power-of-two chunk of a zone; 0
+    // disables it
+    uint64_t HugeAllocThreshold;
+
+    // Newly created heaps store the header entry of each min object size
+    // unit of a shelf in 4 bytes instead of 8, for shelves of fewer than 2^24
+    // units; an existing heap keeps the format it was created with
+    bool CompactZoneHeader;
+
+    // Where newly created heaps put the pages of their data shelves:
+    // "none" (first touch), "interleave" (every shelf over all nodes),
+    // "per_node" (shelf i on the i-th online node, round robin) or
+    // "explicit" (shelf i on NumaNodes[i % NumaNodes.size()]). Allocations
+    // prefer shelves on the node of the calling thread.
+    std::string NumaPolicy;
+    std::vector<uint64_t> NumaNodes;
+
+    // Threads running the background work of all heaps and the epoch
+    // manager of a process (see Scheduler), and the CPUs they may run on;
+    // no CPUs means any
+    uint64_t SchedulerThreads;
+    std::vector<uint64_t> SchedulerCpus;
+
+    static uint64_t const kDefaultFreelistStripes = 4;
+    static uint64_t const kDefaultGrowWatermark = 64 * 1024 * 1024;
+    static uint64_t const kDefaultMergeSliceMicroSeconds = 1000;
+    static uint64_t const kDefaultSchedulerThreads = 2;
+    // 1.25x, 1.5x and 1.75x of the powers of two from 64 to 1024
+    static std::vector<uint64_t> DefaultSlabSizeClasses() {
+        return {80, 96, 112, 160, 192, 224, 320, 384, 448,
+                640, 768, 896, 1280, 1536, 1792};
+    }
 };
 
 //TODO: global instance for now
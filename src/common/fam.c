@@ -52,11 +52,37 @@ void* fam_memset_persist(void *pmemdest, int c, size_t len)
   return pmem_memset_persist(pmemdest, c, len);
 }
 
+void* fam_memset_nt_persist(void *pmemdest, int c, size_t len)
+{
+  char *dest = (char *)pmemdest;
+  char *end = dest + len;
+  char *first = (char *)(((uintptr_t)dest + 15) & ~(uintptr_t)15);
+  char *last = (char *)((uintptr_t)end & ~(uintptr_t)15);
+  __m128i v = _mm_set1_epi8((char)c);
+  char *p;
+
+  if (first >= last)
+    return fam_memset_persist(pmemdest, c, len);
+
+  // the unaligned head and tail go through the cache
+  fam_memset_persist(dest, c, (size_t)(first - dest));
+  fam_memset_persist(last, c, (size_t)(end - last));
+  for (p = first; p < last; p += 16)
+    _mm_stream_si128((__m128i *)p, v);
+  _mm_sfence();
+  return pmemdest;
+}
+
 void *fam_memcpy(void *dest, const void *src, size_t n)
 {
   return memcpy(dest, src, n);
 }
 
+void *fam_memcpy_persist(void *pmemdest, const void *src, size_t len)
+{
+  return pmem_memcpy_persist(pmemdest, src, len);
+}
+
 int fam_memcmp(const void *s1, const void *s2, size_t n)
 {
   return memcmp(s1, s2, n);
@@ -0,0 +1,108 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <errno.h>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "nvmm/log.h"
+
+#include "common/numa.h"
+
+namespace nvmm {
+
+// calls to numa_current_node between two getcpu calls
+static int const kNodeRefreshCalls = 64;
+
+static uint64_t read_online_nodes() {
+    // a list of ranges, e.g. "0-1,3"
+    std::ifstream in("/sys/devices/system/node/online");
+    std::string list;
+    if (!(in >> list))
+        return 1;
+    uint64_t mask = 0;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        int low = atoi(range.c_str());
+        int high = dash == std::string::npos ? low
+                                             : atoi(range.c_str() + dash + 1);
+        for (int node = low; node <= high && node < kMaxNumaNodes; node++)
+            mask |= 1UL << node;
+        pos = end + 1;
+    }
+    return mask ? mask : 1;
+}
+
+uint64_t numa_online_nodes() {
+    static uint64_t const online = read_online_nodes();
+    return online;
+}
+
+int numa_current_node() {
+    static thread_local int node = 0;
+    static thread_local int calls = 0;
+    if (calls-- == 0) {
+        unsigned cpu, n;
+        if (syscall(SYS_getcpu, &cpu, &n, NULL) == 0 && n < kMaxNumaNodes)
+            node = (int)n;
+        calls = kNodeRefreshCalls - 1;
+    }
+    return node;
+}
+
+bool numa_bind(void *addr, size_t len, int node) {
+    if (node == kNumaNone || len == 0)
+        return true;
+    int mode;
+    unsigned long mask;
+    if (node == kNumaInterleave) {
+        mode = MPOL_INTERLEAVE;
+        mask = numa_online_nodes();
+    } else {
+        if (node < 0 || node >= kMaxNumaNodes)
+            return false;
+        mode = MPOL_BIND;
+        mask = 1UL << node;
+    }
+    // the kernel drops the last bit of maxnode
+    if (syscall(SYS_mbind, addr, len, mode, &mask, kMaxNumaNodes + 1, 0) != 0) {
+        LOG(error) << "numa: mbind to node " << node
+                   << " failed: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+} // namespace nvmm
@@ -0,0 +1,56 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#ifndef _NVMM_NUMA_H_
+#define _NVMM_NUMA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nvmm {
+
+/*
+ * NUMA placement of shelves, done with the raw system calls so that libnuma
+ * is not needed. Nodes above kMaxNumaNodes - 1 are ignored.
+ */
+static int const kMaxNumaNodes = 64;
+static int const kNumaNone = -1;       // no policy, pages go where first touched
+static int const kNumaInterleave = -2; // pages interleaved over all nodes
+
+// the online nodes, bit i = node i; node 0 only if it cannot be read
+uint64_t numa_online_nodes();
+
+// the node the calling thread runs on, looked up again every few calls
+int numa_current_node();
+
+// sets the memory policy of [addr, addr + len) to the node, to
+// kNumaInterleave or, for kNumaNone, leaves it alone. For a shared mapping of
+// a tmpfs file the policy sticks to the file, so pages touched later through
+// other mappings follow it as well. Returns false if the kernel refused.
+bool numa_bind(void *addr, size_t len, int node);
+
+} // namespace nvmm
+
+#endif
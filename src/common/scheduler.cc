@@ -0,0 +1,287 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <pthread.h>
+#include <sched.h>
+
+#include "nvmm/log.h"
+
+#include "common/config.h"
+#include "common/scheduler.h"
+
+namespace nvmm {
+
+static Scheduler *instance = NULL;
+
+Scheduler *Scheduler::GetInstance() {
+    static Scheduler scheduler;
+    return &scheduler;
+}
+
+Scheduler::Scheduler()
+    : mutex_{new std::mutex}, work_cv_{new std::condition_variable},
+      done_cv_{new std::condition_variable},
+      threads_{new std::vector<std::thread>}, stop_{false},
+      timer_due_{kIdle}, next_handle_{0}, wheel_(kWheelSlots),
+      wheel_cnt_{0}, tick_{0} {
+    instance = this;
+    tick_ = NowTick();
+    pthread_atfork(&Scheduler::PrepareFork, &Scheduler::ParentFork,
+                   &Scheduler::ChildFork);
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(*mutex_);
+        stop_ = true;
+        work_cv_->notify_all();
+    }
+    for (auto &thread : *threads_)
+        thread.join();
+    for (auto &task : tasks_)
+        delete task.second;
+    instance = NULL;
+    delete threads_;
+    delete done_cv_;
+    delete work_cv_;
+    delete mutex_;
+}
+
+void Scheduler::PrepareFork() {
+    if (instance)
+        instance->mutex_->lock();
+}
+
+void Scheduler::ParentFork() {
+    if (instance)
+        instance->mutex_->unlock();
+}
+
+void Scheduler::ChildFork() {
+    Scheduler *s = instance;
+    if (s == NULL)
+        return;
+    // the threads are gone and the tasks belong to the parent; what they
+    // left behind may be in any state, so it is dropped, not freed
+    s->mutex_ = new std::mutex;
+    s->work_cv_ = new std::condition_variable;
+    s->done_cv_ = new std::condition_variable;
+    s->threads_ = new std::vector<std::thread>;
+    s->stop_ = false;
+    s->timer_due_ = kIdle;
+    s->tasks_.clear();
+    for (auto &slot : s->wheel_)
+        slot.clear();
+    s->wheel_cnt_ = 0;
+    s->tick_ = s->NowTick();
+    s->ready_.clear();
+}
+
+int Scheduler::AddTask(Task task, uint64_t delay_us) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    if (threads_->empty())
+        Start();
+    Entry *entry = new Entry;
+    entry->task = task;
+    entry->due_tick = 0;
+    entry->on_wheel = false;
+    entry->ready = false;
+    entry->running = false;
+    entry->woken = false;
+    entry->removed = false;
+    entry->orphan = false;
+    int handle = next_handle_++;
+    tasks_[handle] = entry;
+    Schedule(entry, delay_us);
+    // the new timer may be due before the one slept on
+    work_cv_->notify_all();
+    return handle;
+}
+
+void Scheduler::Wake(int handle) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    auto it = tasks_.find(handle);
+    if (it == tasks_.end())
+        return;
+    Entry *entry = it->second;
+    if (entry->running) {
+        entry->woken = true;
+    } else if (!entry->ready) {
+        Unschedule(entry);
+        MakeReady(entry);
+    }
+}
+
+void Scheduler::RemoveTask(int handle) {
+    std::unique_lock<std::mutex> lock(*mutex_);
+    auto it = tasks_.find(handle);
+    if (it == tasks_.end())
+        return;
+    Entry *entry = it->second;
+    tasks_.erase(it);
+    entry->removed = true;
+    Unschedule(entry);
+    if (entry->ready) {
+        ready_.erase(std::find(ready_.begin(), ready_.end(), entry));
+        entry->ready = false;
+    }
+    if (entry->running && entry->runner == std::this_thread::get_id()) {
+        entry->orphan = true;
+        return;
+    }
+    done_cv_->wait(lock, [entry] { return !entry->running; });
+    delete entry;
+}
+
+size_t Scheduler::ThreadCount() {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    return threads_->size();
+}
+
+void Scheduler::Start() {
+    size_t cnt = std::max(config.SchedulerThreads, (uint64_t)1);
+    for (size_t i = 0; i < cnt; i++)
+        threads_->emplace_back(&Scheduler::Worker, this, i);
+}
+
+uint64_t Scheduler::NowTick() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now)
+               .count() /
+           kTickMicroSeconds;
+}
+
+void Scheduler::Schedule(Entry *entry, uint64_t delay_us) {
+    if (delay_us == kIdle)
+        return;
+    if (delay_us == 0) {
+        MakeReady(entry);
+        return;
+    }
+    // round up, so that a task never runs early
+    entry->due_tick = NowTick() + (delay_us + kTickMicroSeconds - 1) / kTickMicroSeconds;
+    std::list<Entry *> &slot = wheel_[entry->due_tick % kWheelSlots];
+    entry->wheel_pos = slot.insert(slot.end(), entry);
+    entry->on_wheel = true;
+    wheel_cnt_++;
+}
+
+void Scheduler::Unschedule(Entry *entry) {
+    if (!entry->on_wheel)
+        return;
+    wheel_[entry->due_tick % kWheelSlots].erase(entry->wheel_pos);
+    entry->on_wheel = false;
+    wheel_cnt_--;
+}
+
+void Scheduler::MakeReady(Entry *entry) {
+    entry->ready = true;
+    ready_.push_back(entry);
+    work_cv_->notify_one();
+}
+
+uint64_t Scheduler::Advance() {
+    uint64_t now = NowTick();
+    if (wheel_cnt_ == 0) {
+        tick_ = now;
+        return kIdle;
+    }
+    // a full turn visits every slot
+    uint64_t ticks = std::min(now - tick_, kWheelSlots);
+    for (uint64_t t = now - ticks + 1; t <= now; t++) {
+        std::list<Entry *> &slot = wheel_[t % kWheelSlots];
+        for (auto it = slot.begin(); it != slot.end();) {
+            Entry *entry = *it++;
+            if (entry->due_tick <= now) {
+                Unschedule(entry);
+                MakeReady(entry);
+            }
+        }
+    }
+    tick_ = now;
+    // slots holding timers of later turns cost a spurious wakeup per turn
+    for (uint64_t d = 1; d <= kWheelSlots; d++) {
+        if (!wheel_[(now + d) % kWheelSlots].empty())
+            return d;
+    }
+    return kIdle;
+}
+
+void Scheduler::Worker(size_t i) {
+    if (!config.SchedulerCpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (auto cpu : config.SchedulerCpus)
+            CPU_SET(cpu, &cpus);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret != 0)
+            LOG(error) << "scheduler: cannot set the affinity of thread " << i;
+    }
+
+    std::unique_lock<std::mutex> lock(*mutex_);
+    while (!stop_) {
+        uint64_t next = Advance();
+        if (ready_.empty()) {
+            // one thread sleeps until the next timer, the others until woken
+            uint64_t due = next == kIdle ? kIdle : tick_ + next;
+            if (due >= timer_due_) {
+                work_cv_->wait(lock);
+            } else {
+                timer_due_ = due;
+                work_cv_->wait_for(lock,
+                                   std::chrono::microseconds(next * kTickMicroSeconds));
+                if (timer_due_ == due)
+                    timer_due_ = kIdle;
+            }
+            continue;
+        }
+
+        Entry *entry = ready_.front();
+        ready_.pop_front();
+        entry->ready = false;
+        entry->running = true;
+        entry->runner = std::this_thread::get_id();
+        lock.unlock();
+        uint64_t delay_us = entry->task();
+        lock.lock();
+        entry->running = false;
+        if (entry->removed) {
+            if (entry->orphan)
+                delete entry;
+            else
+                done_cv_->notify_all();
+        } else if (entry->woken) {
+            entry->woken = false;
+            MakeReady(entry);
+        } else {
+            Schedule(entry, delay_us);
+        }
+    }
+}
+
+} // namespace nvmm
@@ -0,0 +1,127 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#ifndef _NVMM_SCHEDULER_H_
+#define _NVMM_SCHEDULER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace nvmm {
+
+/*
+ * The background work of a process: periodic and on-demand tasks of the open
+ * heaps and the epoch manager, run by a small pool of threads (see
+ * Config::SchedulerThreads and Config::SchedulerCpus) instead of one mostly
+ * idle thread each.
+ *
+ * A task returns the microseconds until it wants to run again, or kIdle to
+ * run only when woken. Timers sit on a wheel of kWheelSlots ticks; the
+ * threads sleep until the first occupied slot. A task never runs on two
+ * threads at once. The threads start with the first task; a forked child
+ * starts over with no tasks, like it would have no threads.
+ */
+class Scheduler {
+  public:
+    typedef std::function<uint64_t()> Task;
+    static uint64_t const kIdle = ~0UL;
+    static uint64_t const kTickMicroSeconds = 1000;
+    static uint64_t const kWheelSlots = 512;
+
+    // there is only one instance in a process
+    static Scheduler *GetInstance();
+
+    // runs task after delay_us (kIdle: once woken) and then as it asks;
+    // returns a handle for Wake and RemoveTask
+    int AddTask(Task task, uint64_t delay_us);
+    // runs the task as soon as a thread is free, once more if it is running
+    void Wake(int handle);
+    // once it returns the task is gone and no longer running, unless it is
+    // called by the task itself
+    void RemoveTask(int handle);
+
+    // threads in the pool
+    size_t ThreadCount();
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+  private:
+    struct Entry {
+        Task task;
+        uint64_t due_tick;
+        bool on_wheel;
+        std::list<Entry *>::iterator wheel_pos;
+        bool ready;   // on ready_
+        bool running;
+        bool woken;   // woken while running
+        bool removed;
+        bool orphan;  // removed by itself, freed once the run is over
+        std::thread::id runner;
+    };
+
+    Scheduler();
+    ~Scheduler();
+
+    static void PrepareFork();
+    static void ParentFork();
+    static void ChildFork();
+
+    void Start();
+    void Worker(size_t i);
+    uint64_t NowTick();
+    void Schedule(Entry *entry, uint64_t delay_us);
+    void Unschedule(Entry *entry);
+    void MakeReady(Entry *entry);
+    // moves the tasks due by now to ready_; returns the ticks until the next
+    // occupied slot, or kIdle
+    uint64_t Advance();
+
+    // pointers, so that a forked child can start over with new ones
+    std::mutex *mutex_;
+    std::condition_variable *work_cv_; // ready tasks or new timers
+    std::condition_variable *done_cv_; // a task finished a run
+    std::vector<std::thread> *threads_;
+    bool stop_;
+    uint64_t timer_due_; // the tick a thread sleeps until, or kIdle
+
+    std::map<int, Entry *> tasks_;
+    int next_handle_;
+    std::vector<std::list<Entry *>> wheel_;
+    uint64_t wheel_cnt_;
+    uint64_t tick_; // the ticks up to here are done
+    std::deque<Entry *> ready_;
+};
+
+} // namespace nvmm
+
+#endif
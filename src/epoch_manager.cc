@@ -180,6 +180,14 @@ void EpochManager::register_failure_callback(EpochManagerCallback cb) {
     return pimpl_->em->register_failure_callback(cb);
 }
 
+int EpochManager::register_advance_callback(EpochAdvanceCallback cb) {
+    return pimpl_->em->register_advance_callback(cb);
+}
+
+void EpochManager::unregister_advance_callback(int handle) {
+    pimpl_->em->unregister_advance_callback(handle);
+}
+
 void EpochManager::set_debug_level(int level) {
     pimpl_->em->set_debug_level(level);
 }
@@ -241,6 +241,22 @@ bool ShelfManager::IsInvalid(ShelfId shelf_id) {
         return false;
 }
 
+void ShelfManager::UnmapShelf(ShelfId shelf_id) {
+    ShelfManager::Lock();
+    auto result = map_.find(shelf_id);
+    if (result == map_.end()) {
+        ShelfManager::Unlock();
+        return;
+    }
+    void *base = std::get<0>(result->second);
+    size_t length = std::get<1>(result->second);
+    (void)map_.erase(result);
+    (void)reverse_map_.erase(base);
+    ShelfManager::Unlock();
+    LOG(trace) << "UnmapShelf: mapping unregistered";
+    (void)ShelfFile::Unmap(base, length, true);
+}
+
 void ShelfManager::Reset() {
     for (auto it = map_.begin(); it != map_.end(); it++) {
         void *base = std::get<0>(it->second);
@@ -76,6 +76,9 @@ class ShelfManager {
     static ErrorCode MarkInvalid(ShelfId shelf_id);
     // check if the given shelf is invalid
     static bool IsInvalid(ShelfId shelf_id);
+    // unregister a shelf and unmap it if it is registered, e.g., after the
+    // shelf was deleted; takes the lock
+    static void UnmapShelf(ShelfId shelf_id);
     // unmap everything, clear both mappings
     static void Reset();
 
@@ -37,7 +37,9 @@
 
 #include <atomic>
 #include <iostream>
+#include <sched.h> // sched_getcpu
 #include <thread>
+#include <unistd.h> // sysconf
 
 
 
@@ -46,31 +48,38 @@ namespace internal {
 
 
 
+// The CPU whose reader counter this thread uses, and the shared locks it
+// holds; the CPU is looked up again only when it holds none.
+static thread_local int readerCpu = -1;
+static thread_local int readerHeld = 0;
+
+
 /**
  * Default constructor
  *
+ * Sizes the counters for the online CPUs
  */
 DCLCRWLock::DCLCRWLock ()
 {
-    int hw_cores = std::thread::hardware_concurrency();
-    // Default number of cores assumes this machine has 8 cores
-    if (hw_cores == 0) hw_cores = DCLC_NUMBER_OF_CORES;
-    numCores = hw_cores;
-    countersLength = numCores*DCLC_COUNTERS_RATIO;
-    writersMutex.store(DCLC_RWL_UNLOCKED);
-    readersCounters = new std::atomic<int>[countersLength];
-    for (int idx = 0; idx < countersLength; idx += DCLC_COUNTERS_RATIO) {
-        readersCounters[idx] = 0;
-    }
+    long hw_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (hw_cores <= 0) hw_cores = DCLC_NUMBER_OF_CORES;
+    init((int)hw_cores, true);
 }
 
 
 /**
  * With this constructor the use can specify the number of cores on the system
  */
-DCLCRWLock::DCLCRWLock (int num_cores)
+DCLCRWLock::DCLCRWLock (int num_cores, bool cpu_slots)
 {
-    this->numCores = num_cores;
+    init(num_cores, cpu_slots);
+}
+
+
+void DCLCRWLock::init (int num_cores, bool cpu_slots)
+{
+    numCores = num_cores;
+    cpuSlots = cpu_slots;
     countersLength = num_cores*DCLC_COUNTERS_RATIO;
     writersMutex.store(DCLC_RWL_UNLOCKED);
     readersCounters = new std::atomic<int>[countersLength];
@@ -91,11 +100,17 @@ DCLCRWLock::~DCLCRWLock ()
 
 
 /**
- * Hashes a number and returns the index in the array of Reader's counters
- *
- * Returns a random index to be used in readers_counters[]
+ * Returns the index in the array of Reader's counters: the one of the CPU
+ * this thread runs on, or of a hash of its thread id
  */
 int DCLCRWLock::thread2idx (void) {
+    if (cpuSlots) {
+        // keep the counter we already count on, wherever we run now
+        if (readerHeld == 0) readerCpu = sched_getcpu();
+        if (readerCpu >= 0) {
+            return (readerCpu % numCores)*DCLC_COUNTERS_RATIO;
+        }
+    }
     std::size_t tid = hashFunc(std::this_thread::get_id());
     return (int)((tid % numCores)*DCLC_COUNTERS_RATIO);
 }
@@ -111,6 +126,7 @@ void DCLCRWLock::sharedLock (void)
         readersCounters[idx].fetch_add(1);
         if (writersMutex.load() == DCLC_RWL_UNLOCKED) {
             // Acquired lock in read-only mode
+            readerHeld++;
             return;
         } else {
             // A Writer has acquired the lock, must reset to 0 and wait
@@ -129,7 +145,9 @@ void DCLCRWLock::sharedLock (void)
  */
 bool DCLCRWLock::sharedUnlock (void)
 {
-    if (readersCounters[thread2idx()].fetch_add(-1) <= 0) {
+    const int idx = thread2idx();
+    if (readerHeld > 0) readerHeld--;
+    if (readersCounters[idx].fetch_add(-1) <= 0) {
         // ERROR: no matching lock() for this unlock()
         std::cout << "ERROR: no matching lock() for this unlock()\n";
         return false;
@@ -180,6 +198,7 @@ bool DCLCRWLock::trySharedLock (void)
     readersCounters[tid].fetch_add(1);
     if (writersMutex.load() == DCLC_RWL_UNLOCKED) {
         // Acquired lock in read-only mode
+        readerHeld++;
         return true;
     } else {
         // A Writer has acquired the lock, must reset to 0 and wait
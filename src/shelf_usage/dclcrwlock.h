@@ -32,16 +32,24 @@ namespace internal {
 // Cache line optimization constants
 #define DCLC_CACHE_LINE          64               // Size in bytes of a cache line
 #define DCLC_CACHE_PADD          (DCLC_CACHE_LINE-sizeof(std::atomic<int>))
-#define DCLC_NUMBER_OF_CORES     32
+#define DCLC_NUMBER_OF_CORES     32               // if the online CPUs are unknown
 #define DCLC_HASH_RATIO           3
 #define DCLC_COUNTERS_RATIO      (DCLC_HASH_RATIO*DCLC_CACHE_LINE/sizeof(int))
 
 
-/* This is not recursive/reentrant */
+/*
+ * Readers count on the counter of the CPU they run on, remembered by the
+ * thread while it holds shared locks so that the unlock finds the same
+ * counter after a migration. With cpu_slots == false (or without
+ * sched_getcpu) they count on a hash of their thread id instead, as the
+ * original does.
+ *
+ * This is not recursive/reentrant
+ */
 class DCLCRWLock {
 public:
     DCLCRWLock();
-    DCLCRWLock(int num_cores);
+    DCLCRWLock(int num_cores, bool cpu_slots = true);
     ~DCLCRWLock();
     void sharedLock(void);
     bool trySharedLock(void);
@@ -50,6 +58,7 @@ public:
     bool exclusiveUnlock(void);
 
 private:
+    void init(int num_cores, bool cpu_slots);
     int thread2idx(void);
 
 private:
@@ -57,6 +66,8 @@ private:
     std::hash<std::thread::id> hashFunc;
     /* Number of cores on the system */
     int          numCores;
+    /* Index readers by CPU rather than by thread id */
+    bool         cpuSlots;
     /* Length of readers_counters[] */
     int          countersLength;
     /* Distributed Counters for Readers */
@@ -24,11 +24,14 @@
  */
 
 #include <assert.h>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <new>
 #include <sstream>
 #include <stdexcept>
 #include <stdio.h>
+#include <stdlib.h> // posix_memalign
 #include <string>
 #include <thread>
 #include <unistd.h>
@@ -36,6 +39,9 @@
 #include "nvmm/fam.h"
 #include "nvmm/epoch_manager.h"
 
+#include "common/common.h"
+#include "common/scheduler.h"
+
 #include "shelf_usage/participant_manager.h"
 #include "shelf_usage/epoch_vector_internal.h"
 #include "shelf_usage/hrtime.h"
@@ -45,6 +51,62 @@ using nvmm::internal::EpochVector;
 
 namespace nvmm {
 
+/*
+ * Epoch state of one thread, alone on its cache line. epoch is the local
+ * epoch its critical region joined, or EPOCH_NO_PARTICIPANT outside of one;
+ * the heartbeat reads it from other threads. The records of a process form
+ * a list that only grows; a thread that exits leaves its record to the next
+ * new thread.
+ */
+struct ThreadEpoch {
+    std::atomic<EpochCounter> epoch;
+    std::atomic<bool> in_use;
+    int depth;         // nesting of critical regions, only for the owner
+    ThreadEpoch *next; // set once, before the record is on the list
+};
+static_assert(sizeof(ThreadEpoch) <= kCacheLineSize,
+              "ThreadEpoch must fit in a cache line");
+
+static std::atomic<ThreadEpoch *> thread_epochs(NULL);
+
+// the record of this thread, NULL until its first critical region
+static thread_local ThreadEpoch *my_epoch = NULL;
+
+// hands the record back when the thread exits
+struct ThreadEpochRelease {
+    ~ThreadEpochRelease() {
+        if (my_epoch)
+            my_epoch->in_use.store(false, std::memory_order_release);
+    }
+};
+static thread_local ThreadEpochRelease my_epoch_release;
+
+static ThreadEpoch *register_thread_epoch() {
+    ThreadEpoch *te;
+    for (te = thread_epochs.load(std::memory_order_acquire); te; te = te->next) {
+        bool in_use = false;
+        if (!te->in_use.load(std::memory_order_relaxed) &&
+            te->in_use.compare_exchange_strong(in_use, true))
+            break;
+    }
+    if (!te) {
+        void *line;
+        int ret = posix_memalign(&line, kCacheLineSize, kCacheLineSize);
+        if (ret != 0)
+            throw std::bad_alloc();
+        te = new (line) ThreadEpoch;
+        te->epoch.store(internal::EPOCH_NO_PARTICIPANT);
+        te->in_use.store(true);
+        te->depth = 0;
+        te->next = thread_epochs.load(std::memory_order_relaxed);
+        while (!thread_epochs.compare_exchange_weak(te->next, te))
+            ;
+    }
+    (void)&my_epoch_release; // to have it destroyed at thread exit
+    my_epoch = te;
+    return te;
+}
+
 class HeartBeat {
 public:
     HeartBeat()
@@ -61,9 +123,9 @@ EpochManagerImpl::EpochManagerImpl(void *addr, bool may_create) :
     terminate_heartbeat_(false),
     debug_level_(0),
     cb_(NULL),
-    last_frontier_(0)
+    last_frontier_(0),
+    next_advance_cb_(0)
 {
-    active_epoch_count_.store(0);
     epoch_vec_ = new EpochVector(&*metadata_pool_, may_create);
 
     pid_ = ParticipantManager::get_self_id();
@@ -81,41 +143,27 @@ EpochManagerImpl::EpochManagerImpl(void *addr, bool may_create) :
         std::cerr << "Epoch Manager registered as participant: " << epoch_participant_.id() << std::endl;
     }
 
-    pthread_mutex_init(&active_epoch_mutex_, NULL);
+    // critical regions join the frontier we just reported
+    local_epoch_.store(epoch_participant_.reported());
 
     // Attempt to advance frontier to ensure frontier advances at least once in
     // the lifetime of the process in case the process doesn't run long enough
     advance_frontier();
 
-    // Spawn monitor threads
-    std::thread mt(&EpochManagerImpl::monitor_thread_entry, this);
-    monitor_thread_ = std::move(mt);
-    std::thread hbt(&EpochManagerImpl::heartbeat_thread_entry, this);
-    heartbeat_thread_ = std::move(hbt);
+    // Monitor and heartbeat run on the background threads of the process
+    last_debug_output_ = internal::get_hrtime();
+    Scheduler *scheduler = Scheduler::GetInstance();
+    monitor_task_ = scheduler->AddTask(
+        [this]() { monitor_task_entry(); return MONITOR_INTERVAL_US; },
+        MONITOR_INTERVAL_US);
+    heartbeat_task_ = scheduler->AddTask(
+        [this]() { heartbeat_task_entry(); return HEARTBEAT_INTERVAL_US; },
+        HEARTBEAT_INTERVAL_US);
 }
 
 
 EpochManagerImpl::~EpochManagerImpl() {
-    bool join_monitor = false;
-    bool join_heartbeat = false;
-    
-    // first signal all threads we want to terminate
-    if (!terminate_monitor_) {
-        terminate_monitor_ = true;
-        join_monitor = true;
-    }
-    if (!terminate_heartbeat_) {
-        terminate_heartbeat_ = true;
-        join_heartbeat = true;
-    }
-
-    // now join terminating threads 
-    if (join_monitor) {
-        monitor_thread_.join();
-    }
-    if (join_heartbeat) {
-        heartbeat_thread_.join();
-    }
+    disable_monitor();
 
     epoch_participant_.unregister();
     delete epoch_vec_;
@@ -126,15 +174,19 @@ void EpochManagerImpl::disable_monitor()
 {
     if (!terminate_monitor_) {
         terminate_monitor_ = true;
-        monitor_thread_.join();
+        Scheduler::GetInstance()->RemoveTask(monitor_task_);
     }
     if (!terminate_heartbeat_) {
         terminate_heartbeat_ = true;
-        heartbeat_thread_.join();
+        Scheduler::GetInstance()->RemoveTask(heartbeat_task_);
     }
 }
 
 EpochCounter EpochManagerImpl::reported_epoch() {
+    // inside a critical region, the epoch it joined
+    ThreadEpoch *te = my_epoch;
+    if (te && te->depth > 0)
+        return te->epoch.load(std::memory_order_relaxed);
     return epoch_participant_.reported();
 }
 
@@ -150,24 +202,43 @@ void EpochManagerImpl::report_frontier() {
 
 
 void EpochManagerImpl::enter_critical() {
-    epoch_lock_.sharedLock();
-    if (active_epoch_count_.fetch_add(1) == 0) {
-        pthread_mutex_lock(&active_epoch_mutex_);
-        report_frontier();
-        pthread_mutex_unlock(&active_epoch_mutex_);
+    ThreadEpoch *te = my_epoch;
+    if (!te)
+        te = register_thread_epoch();
+    if (te->depth++ > 0)
+        return;
+    // The fence pairs with the one in heartbeat_task_entry: either the
+    // heartbeat sees our epoch, or we see the epoch it moved on to and join
+    // that one instead.
+    EpochCounter epoch = local_epoch_.load(std::memory_order_relaxed);
+    while (1) {
+        te->epoch.store(epoch, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        EpochCounter now = local_epoch_.load(std::memory_order_relaxed);
+        if (now == epoch)
+            break;
+        epoch = now;
     }
 }
 
 
 void EpochManagerImpl::exit_critical() {
-    active_epoch_count_--;
-    epoch_lock_.sharedUnlock();
+    ThreadEpoch *te = my_epoch;
+    assert(te && te->depth > 0);
+    if (--te->depth > 0)
+        return;
+    te->epoch.store(internal::EPOCH_NO_PARTICIPANT, std::memory_order_release);
 }
 
 
 bool EpochManagerImpl::exists_active_critical() {
-    bool active = active_epoch_count_.load() > 0;
-    return active;
+    for (ThreadEpoch *te = thread_epochs.load(std::memory_order_acquire); te;
+         te = te->next) {
+        if (te->epoch.load(std::memory_order_acquire) !=
+            internal::EPOCH_NO_PARTICIPANT)
+            return true;
+    }
+    return false;
 }
 
 
@@ -297,45 +368,52 @@ bool EpochManagerImpl::advance_frontier()
 
 
 /**
- * A monitor thread that periodically wakes up and attempts to advance 
+ * A monitor task that periodically runs and attempts to advance 
  * the frontier 
  */
-void EpochManagerImpl::monitor_thread_entry() { 
-    internal::HRTime last_debug_output = internal::get_hrtime();
-    while (!terminate_monitor_) {
-        usleep(MONITOR_INTERVAL_US);
-        advance_frontier();
+void EpochManagerImpl::monitor_task_entry() { 
+    advance_frontier();
 
-        if (debug_level_) {
-            internal::HRTime current_time = internal::get_hrtime();
-            if (internal::diff_hrtime_us(last_debug_output, current_time) > DEBUG_INTERVAL_US) {
-                std::cerr << epoch_vec_->to_string() << std::endl;
-                last_debug_output = internal::get_hrtime();
-            }
+    if (debug_level_) {
+        internal::HRTime current_time = internal::get_hrtime();
+        if (internal::diff_hrtime_us(last_debug_output_, current_time) > DEBUG_INTERVAL_US) {
+            std::cerr << epoch_vec_->to_string() << std::endl;
+            last_debug_output_ = internal::get_hrtime();
         }
     }
 }
 
 
 /** 
- * A heartbeat thread that periodically wakes up and attempts to advance this
+ * A heartbeat task that periodically runs and attempts to advance this
  * process' reported epoch to the frontier to signal process is alive and makes 
  * progress. Progress here just means completion of epoch operations. 
  * Thus, it doesn't necessarily imply application-level progress and liveness. 
  * For example, the application can be livelock but still complete epochs. 
  */
-void EpochManagerImpl::heartbeat_thread_entry() {
-    while (!terminate_heartbeat_) {
-        usleep(HEARTBEAT_INTERVAL_US);
-        // Grab exclusive lock to effectively drain active epochs and prevent
-        // new epoch operations from occuring so that we can update and report 
-        // our local view of the frontier
-        epoch_lock_.exclusiveLock();
-        assert(active_epoch_count_.load() == 0);
-        pthread_mutex_lock(&active_epoch_mutex_);
-        report_frontier();
-        pthread_mutex_unlock(&active_epoch_mutex_);
-        epoch_lock_.exclusiveUnlock();
+void EpochManagerImpl::heartbeat_task_entry() {
+    // New critical regions join our local view of the frontier from here on,
+    // while the ones still in an older epoch hold back what we report. The
+    // threads are not stopped; see enter_critical for the fence.
+    epoch_lock_.exclusiveLock();
+    EpochCounter old_epoch = epoch_participant_.reported();
+    EpochCounter new_epoch = epoch_vec_->frontier();
+    local_epoch_.store(new_epoch, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (ThreadEpoch *te = thread_epochs.load(std::memory_order_acquire); te;
+         te = te->next) {
+        EpochCounter epoch = te->epoch.load(std::memory_order_acquire);
+        if (epoch != internal::EPOCH_NO_PARTICIPANT && epoch < new_epoch)
+            new_epoch = epoch;
+    }
+    epoch_participant_.update_reported(new_epoch);
+    epoch_lock_.exclusiveUnlock();
+
+    if (new_epoch != old_epoch) {
+        std::lock_guard<std::mutex> lock(advance_cb_mutex_);
+        for (auto &cb : advance_cbs_) {
+            cb.second(new_epoch);
+        }
     }
 }
 
@@ -347,6 +425,18 @@ void EpochManagerImpl::register_failure_callback(EpochManagerCallback cb) {
     cb_ = cb;
 }
 
+int EpochManagerImpl::register_advance_callback(EpochAdvanceCallback cb) {
+    std::lock_guard<std::mutex> lock(advance_cb_mutex_);
+    int handle = next_advance_cb_++;
+    advance_cbs_[handle] = cb;
+    return handle;
+}
+
+void EpochManagerImpl::unregister_advance_callback(int handle) {
+    std::lock_guard<std::mutex> lock(advance_cb_mutex_);
+    advance_cbs_.erase(handle);
+}
+
 void EpochManagerImpl::reset_vector() {
     epoch_vec_->reset();
 }
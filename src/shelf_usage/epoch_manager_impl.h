@@ -27,6 +27,8 @@
 #define _NVMM_EPOCH_MANAGER_IMPL_H_
 
 #include <atomic>
+#include <map>
+#include <mutex>
 #include <pthread.h>
 #include <stddef.h>
 #include <string>
@@ -78,12 +80,17 @@ public:
      * \details
      * This check is inherently racy as the active region may end by the time
      * the function returns.
-     * On the other hand, we have no way to tell if a thread is running inside
-     * a critical region as we don't maintain per-thread state.
      */
     bool exists_active_critical();
 
-    /** Return the last reported epoch by this epoch manager */
+    /**
+     * \brief Return the last reported epoch by this epoch manager
+     *
+     * \details
+     * Inside a critical region, the epoch the region joined instead: it does
+     * not change until the region ends, and the reported epoch does not move
+     * past it.
+     */
     EpochCounter reported_epoch();
 
     /** Return the frontier epoch */
@@ -94,6 +101,10 @@ public:
 
     void register_failure_callback(EpochManagerCallback cb);
 
+    /** See EpochManager::register_advance_callback */
+    int register_advance_callback(EpochAdvanceCallback cb);
+    void unregister_advance_callback(int handle);
+
     EpochManagerImpl(const EpochManagerImpl&)            = delete;
     EpochManagerImpl& operator=(const EpochManagerImpl&) = delete;
 
@@ -127,8 +138,8 @@ private:
     static const size_t TIMEOUT_US            = 1000000;
     static const size_t DEBUG_INTERVAL_US     = 1000000;
 
-    void monitor_thread_entry();
-    void heartbeat_thread_entry();
+    void monitor_task_entry();
+    void heartbeat_task_entry();
 
 private:
     SmartShelf<internal::_EpochVector>      metadata_pool_;      // internal pool storing epoch-manager metadata
@@ -136,16 +147,19 @@ private:
     internal::EpochVector*             epoch_vec_; 
     internal::EpochVector::Participant epoch_participant_;
     internal::DCLCRWLock               epoch_lock_;         // lock protecting local epoch advancement
-    pthread_mutex_t                    active_epoch_mutex_; // mutex protecting active epoch count
-    std::atomic<int>                   active_epoch_count_;
-    std::thread                        monitor_thread_;
-    std::thread                        heartbeat_thread_;
+    std::atomic<EpochCounter>          local_epoch_;        // the epoch new critical regions join
+    int                                monitor_task_;       // see Scheduler
+    int                                heartbeat_task_;
+    struct timespec                    last_debug_output_;
     std::atomic<bool>                  terminate_monitor_;
     std::atomic<bool>                  terminate_heartbeat_;
     int                                debug_level_;
     struct timespec                    last_scan_time_;
     EpochManagerCallback               cb_;
     EpochCounter                       last_frontier_;
+    std::mutex                         advance_cb_mutex_;   // mutex protecting advance_cbs_
+    std::map<int, EpochAdvanceCallback> advance_cbs_;
+    int                                next_advance_cb_;
 
 };
 
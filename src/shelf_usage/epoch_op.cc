@@ -23,11 +23,17 @@
  *
  */
 
+#include <utility>
+#include <vector>
+
 #include "nvmm/epoch_manager.h"
 
 
 namespace nvmm {
 
+// the AtExit calls of this thread still to run
+static thread_local std::vector<std::pair<void (*)(void *), void *>> exit_hooks;
+
 
 EpochOp::EpochOp(EpochManager* em)
     : em_(em)
@@ -36,6 +42,12 @@ EpochOp::EpochOp(EpochManager* em)
 }
 
 EpochOp::~EpochOp() {
+    // a hook may add more hooks, which run in this loop as well
+    for (size_t i = 0; i < exit_hooks.size(); i++) {
+        std::pair<void (*)(void *), void *> hook = exit_hooks[i];
+        hook.first(hook.second);
+    }
+    exit_hooks.clear();
     em_->exit_critical();
 }
 
@@ -44,5 +56,9 @@ EpochCounter EpochOp::reported_epoch() {
     return em_->reported_epoch();
 }
 
+void EpochOp::AtExit(void (*fn)(void *), void *arg) {
+    exit_hooks.emplace_back(fn, arg);
+}
+
 
 } // end namespace nvmm
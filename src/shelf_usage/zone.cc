@@ -34,17 +34,24 @@
 #include <cstring> // for memset
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
 
 #include "nvmm/global_ptr.h"
 #include "nvmm/nvmm_fam_atomic.h"
 
 #include "nvmm/fam.h"
+#include "nvmm/heap.h"
 #include "nvmm/log.h"
 #include "common/common.h"
 #include "shelf_usage/zone_entry_stack.h"
 
 #include "shelf_usage/zone.h"
 #include "shelf_usage/zone_entry.h"
+#include "shelf_usage/zone_bitmap.h"
 
 #include "common/crash_points.h"
 
@@ -95,6 +102,24 @@ inline uint64_t next_power_of_two(uint64_t n)
 //TODO: Add zoneheader size ????
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
+// Max number of chunks linked into one chain by put_chunks()
+#define CHUNK_BATCH 64UL
+// Bound on the number of freelist levels (MAX_ZONE_SIZE keeps it well below)
+#define LEVEL_CNT 64UL
+// Bound on the number of freelist heads per level
+#define MAX_FREELIST_STRIPES 64UL
+// Waiting for another grow: yield this many times, then sleep with
+// exponential backoff of at most GROW_MAX_SLEEP_NS per round
+#define GROW_YIELD_CNT 64UL
+#define GROW_MAX_SLEEP_NS 1000000UL
+// Smallest part of the merge bitmap (in 64-bit words) garbage collection
+// hands to a thread of its own
+#define GC_MIN_RANGE_WORDS (1UL << 16)
+// Zones that zero on alloc get zeroed chunks of LAZY_ZERO_MIN_SIZE up to
+// LAZY_ZERO_LEVEL_BYTES ahead of time, up to LAZY_ZERO_LEVEL_BYTES per level;
+// smaller chunks are cheap enough to zero on the spot
+#define LAZY_ZERO_MIN_SIZE (64UL * 1024)
+#define LAZY_ZERO_LEVEL_BYTES (16UL * 1024 * 1024)
 
 // TODO: Possibly an enum instead for merge states.
 #define MERGE_DEFAULT 0
@@ -102,6 +127,9 @@ inline uint64_t next_power_of_two(uint64_t n)
 #define MERGE_BITMAP_COMPLETED 2
 #define MERGE_FREELIST_COMPLETED 3
 
+// Set in the level field of the header entry of a chunk that is used as a slab
+#define SLAB_LEVEL_FLAG 0x40UL
+
 // API to find which level the size belongs to.
 inline uint64_t find_level_from_size(uint64_t size, size_t min_obj_size)
 {
@@ -110,12 +138,42 @@ inline uint64_t find_level_from_size(uint64_t size, size_t min_obj_size)
 	return power_of_two(size / min_obj_size);
 }
 
+inline uint64_t level_mask(uint64_t low, uint64_t high);
+
 // API to find the size of the object based on the level.
 inline uint64_t find_size_from_level(uint64_t level, size_t min_obj_size)
 {
         return 1UL << (level + power_of_two(min_obj_size));
 }
 
+/*
+ * Slabs
+ *
+ * A slab is a SLAB_SIZE chunk carved into equal slots of one size class. Its
+ * header entry has SLAB_LEVEL_FLAG set, and the chunk starts with a
+ * Slab_Header followed by the occupancy bitmap (a set bit is an allocated
+ * slot; bits past slot_cnt are always set). The slots start at slots_offset.
+ */
+struct Slab_Header {
+    uint64_t size_class;
+    uint64_t slot_size;
+    uint64_t slot_cnt;
+    uint64_t slots_offset;
+    // number of allocated slots
+    uint64_t used;
+    // next slab of the same size class (0 for the last one)
+    Offset next;
+    uint64_t bitmap[0];
+};
+
+// Slabs of one size class; head, tail and the Slab_Header next fields are
+// protected by lock and rebuilt by offline recovery
+struct SlabList {
+    uint64_t lock;
+    Offset head;
+    Offset tail;
+};
+
 /*
  * Zone Header
  */
@@ -140,14 +198,33 @@ struct Zone_Header {
     uint64_t merge_status;
     // Current level where merge is happening. When there is no merge going on, its value is -1
     int64_t current_merge_level;
+    // Bit i is set when a freelist of level i may be non-empty. Set after every
+    // push and cleared by a pop that finds all stripes of the level empty, so a
+    // set bit can be stale but a clear bit is only stale after a crash (alloc
+    // falls back to a full scan).
+    uint64_t nonempty_levels;
+    // Number of freelist heads (stripes) per level; fixed when the zone is
+    // created. The heads of level i are free_list[i*freelist_stripes, ...).
+    uint64_t freelist_stripes;
+    // Bytes per header entry: 4 in a compact header (see zone_entry::pack),
+    // otherwise 8; fixed when the zone is created
+    uint64_t entry_size;
+    // Slot sizes served by slabs (ascending); fixed when the zone is created.
+    // A zone without slab size classes never creates a slab.
+    uint64_t slab_class_cnt;
+    uint64_t slab_classes[MAX_SLAB_CLASSES];
+    SlabList slab_lists[MAX_SLAB_CLASSES];
+    // Free chunks of each level whose contents are the opposite of what the
+    // freelists promise (see zero_step()): zeroed chunks in a zone that zeroes
+    // on alloc, chunks that still have to be zeroed in a fast_alloc zone
+    ZoneEntryStack lazy_list[LEVEL_CNT];
     // A copy of the freelist we are going to merge
     ZoneEntryStack safe_copy;
     // Stack used to track the post merge freelist level.
-    
-ZoneEntryStack post_merge_level;
+    ZoneEntryStack post_merge_level;
     // Stack used to track the post merge freelist for level+!.
     ZoneEntryStack post_merge_next_level;
-    // Array of stack to track the freelist for various freelists.
+    // Array of stack to track the freelist for various freelists, striped per level.
     // Note: Never ever directly use the size of Zone_Header directly as it will never include
     // the below array of Stack.
     ZoneEntryStack free_list[0];
@@ -164,9 +241,30 @@ int64_t cas64(int64_t* target, int64_t old_value, int64_t new_value) {
     return fam_atomic_64_compare_and_store(target, old_value, new_value);
 }
 
-inline size_t get_zoneheader_size(size_t shelf_size, size_t min_obj_size) {
+// A grow only pushes one chunk, so it is short: yield for a while, then sleep
+// for exponentially longer rounds capped at GROW_MAX_SLEEP_NS
+static inline void grow_backoff(uint64_t attempt) {
+    if (attempt < GROW_YIELD_CNT) {
+        sched_yield();
+        return;
+    }
+    uint64_t shift = MIN(attempt - GROW_YIELD_CNT, 10UL);
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long)MIN(1000UL << shift, GROW_MAX_SLEEP_NS);
+    nanosleep(&ts, NULL);
+}
+
+// level of the chunk described by a header entry, without the slab flag
+inline uint64_t chunk_level(zone_entry entry) {
+    return entry.level() & ~SLAB_LEVEL_FLAG;
+}
+
+inline size_t get_zoneheader_size(size_t shelf_size, size_t min_obj_size,
+                                  uint64_t stripes) {
     size_t max_zone_level = find_level_from_size(shelf_size, min_obj_size);
-    return next_power_of_two(sizeof(Zone_Header) + (sizeof(ZoneEntryStack) * (max_zone_level + 1)));
+    return next_power_of_two(sizeof(Zone_Header) +
+                             (sizeof(ZoneEntryStack) * (max_zone_level + 1) * stripes));
 
 }
 
@@ -175,8 +273,17 @@ inline size_t get_merge_bitmap_size(size_t shelf_size, size_t min_obj_size) {
     return round_up((1UL << max_zone_level)/BYTE,kCacheLineSize);
 }
 
-inline size_t get_header_bitmap_size(size_t shelf_size, size_t min_obj_size) {
-    return round_up(shelf_size/min_obj_size*sizeof(zone_entry),kCacheLineSize);
+// A compact header is only possible if the index of every unit fits the
+// next field of a packed entry
+inline bool use_compact_header(size_t shelf_size, size_t min_obj_size,
+                               bool compact) {
+    return compact && shelf_size/min_obj_size < zone_entry::compact_next_limit;
+}
+
+inline size_t get_header_bitmap_size(size_t shelf_size, size_t min_obj_size,
+                                     bool compact) {
+    size_t entry_size = compact ? sizeof(uint32_t) : sizeof(zone_entry);
+    return round_up(shelf_size/min_obj_size*entry_size,kCacheLineSize);
 }
 
 //
@@ -186,16 +293,31 @@ inline size_t get_header_bitmap_size(size_t shelf_size, size_t min_obj_size) {
 // 2. merge bitmap
 // 3. header
 // 
-size_t Zone::get_header_size(size_t shelf_size, size_t min_obj_size) {
+size_t Zone::get_header_size(size_t shelf_size, size_t min_obj_size,
+                             uint64_t stripes, bool compact) {
 
     size_t merge_bitmap_size, zoneheader_size, header_bitmap_size;
     merge_bitmap_size = get_merge_bitmap_size(shelf_size, min_obj_size);
-    zoneheader_size = get_zoneheader_size(shelf_size, min_obj_size);
-    header_bitmap_size = get_header_bitmap_size(shelf_size, min_obj_size);
+    zoneheader_size = get_zoneheader_size(shelf_size, min_obj_size, stripes);
+    header_bitmap_size = get_header_bitmap_size(
+        shelf_size, min_obj_size,
+        use_compact_header(shelf_size, min_obj_size, compact));
 
     return header_bitmap_size + zoneheader_size + merge_bitmap_size;
 }
 
+// The size a zone of shelf_size starts with when requested_size is asked for:
+// a power of two larger than the merge bitmap (which the zone start holds)
+// and the min object size, and at most the shelf. 0 asks for the whole shelf.
+size_t Zone::get_initial_size(size_t shelf_size, size_t min_obj_size,
+                              size_t requested_size) {
+    if (requested_size == 0 || requested_size >= shelf_size)
+        return shelf_size;
+    size_t min_size = next_power_of_two(
+        MAX(get_merge_bitmap_size(shelf_size, min_obj_size), min_obj_size) + 1);
+    return MIN(MAX(next_power_of_two(requested_size), min_size), shelf_size);
+}
+
 /*
 Constructor for the Zone object. We here just pass in the mmap'ed memory
 address and max pool size to initialize the underlying Shelf object.
@@ -227,14 +349,25 @@ Zone::Zone(void *addr, size_t max_pool_size, void *helper, size_t helper_size)
     zone_header_ptr = (char *)helper;
     struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
     uint64_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
-    size_t zoneheader_size = get_zoneheader_size(max_pool_size,min_obj_size);
+    freelist_stripes = nvmm_read(&zoneheader->freelist_stripes);
+    eager_merge = false;
+    lazy_zero = false;
+    missed_levels = 0;
+    slab_class_cnt = nvmm_read(&zoneheader->slab_class_cnt);
+    for (uint64_t i = 0; i < slab_class_cnt; i++)
+        slab_classes[i] = nvmm_read(&zoneheader->slab_classes[i]);
+    size_t zoneheader_size = get_zoneheader_size(max_pool_size,min_obj_size,freelist_stripes);
     size_t merge_bitmap_size = get_merge_bitmap_size(max_pool_size,min_obj_size);
 
+    // a zone from before compact headers has no entry size
+    bool compact = nvmm_read(&zoneheader->entry_size) == sizeof(uint32_t);
     header_ptr = (char*)helper + zoneheader_size + merge_bitmap_size;
-    header_size = get_header_bitmap_size(nvmm_read(&zoneheader->max_zone_size), min_obj_size);
+    header_size = get_header_bitmap_size(nvmm_read(&zoneheader->max_zone_size), min_obj_size, compact);
+    entries = ZoneEntryArray(header_ptr, compact);
     // Merge bitmap starts right after zoneheader. 
     // Note: zone_header_ptr is char *
     merge_bitmap_start_addr = (uint8_t*)(zone_header_ptr + zoneheader_size);    
+    rebuild_level_summary(zoneheader);
     //print_freelist();
         return;
 }
@@ -247,7 +380,9 @@ Zone::~Zone()
 
 Zone::Zone(void *addr, size_t initial_pool_size, size_t min_obj_size,
            uint64_t fast_alloc, size_t max_pool_size, void *helper,
-           size_t helper_size)
+           size_t helper_size, uint64_t stripes,
+           const uint64_t *slab_class_sizes, uint64_t slab_class_size_cnt,
+           bool compact)
     : shelf_location_ptr((char *)addr), header_ptr((char *)helper) {
     uint64_t max_level_per_zone = 0;
     size_t bitmap_size = 0;
@@ -264,11 +399,23 @@ Zone::Zone(void *addr, size_t initial_pool_size, size_t min_obj_size,
     size_t max_zone_size;
     size_t max_zone_level;
 
+    if (stripes == 0 || stripes > MAX_FREELIST_STRIPES) {
+        message << "freelist stripes must be between 1 and "
+                << MAX_FREELIST_STRIPES << std::endl;
+        throw std::runtime_error(message.str());
+    }
+
     // zoneheader_size is rounded up to the closest power of two (i.e., a valid
     // object/chunk size)
-    zoneheader_size = get_zoneheader_size(max_pool_size, min_obj_size);
+    zoneheader_size = get_zoneheader_size(max_pool_size, min_obj_size, stripes);
     fam_memset_persist(zoneheader, 0, zoneheader_size);
 
+    freelist_stripes = stripes;
+    fam_atomic_u64_write(&zoneheader->freelist_stripes, stripes);
+    eager_merge = false;
+    lazy_zero = false;
+    missed_levels = 0;
+
     if (min_obj_size < MIN_OBJ_SIZE) {
         message << "min size less than " << MIN_OBJ_SIZE << std::endl;
         throw std::runtime_error(message.str());
@@ -324,6 +471,25 @@ Zone::Zone(void *addr, size_t initial_pool_size, size_t min_obj_size,
         throw std::runtime_error(message.str());
     }
 
+    if (slab_class_size_cnt > MAX_SLAB_CLASSES) {
+        message << "more than " << MAX_SLAB_CLASSES << " slab size classes"
+                << std::endl;
+        throw std::runtime_error(message.str());
+    }
+    for (uint64_t i = 0; i < slab_class_size_cnt; i++) {
+        uint64_t size = slab_class_sizes[i];
+        if (size % 16 != 0 || size < min_obj_size || size > SLAB_SIZE / 8 ||
+            is_power_of_two(size) ||
+            (i > 0 && size <= slab_class_sizes[i - 1])) {
+            message << "invalid slab size class " << size << std::endl;
+            throw std::runtime_error(message.str());
+        }
+        slab_classes[i] = size;
+        fam_atomic_u64_write(&zoneheader->slab_classes[i], size);
+    }
+    slab_class_cnt = slab_class_size_cnt;
+    fam_atomic_u64_write(&zoneheader->slab_class_cnt, slab_class_cnt);
+
     // for delayed-free
     // Min value should be 8 bytes.
     bitmap_size = ((1UL << max_zone_level) / BYTE);
@@ -331,8 +497,12 @@ Zone::Zone(void *addr, size_t initial_pool_size, size_t min_obj_size,
     // printf("Zone Header size = %ld, Bitmap Size = %ld, Merge Bitmap Size =
     // %ld\n", zoneheader_size, bitmap_size, merge_bitmap_size);
 
+    compact = use_compact_header(max_zone_size, min_obj_size, compact);
+    fam_atomic_u64_write(&zoneheader->entry_size,
+                         compact ? sizeof(uint32_t) : sizeof(zone_entry));
     header_ptr = (char *)helper + zoneheader_size + merge_bitmap_size;
-    header_size = get_header_bitmap_size(max_zone_size, min_obj_size);
+    header_size = get_header_bitmap_size(max_zone_size, min_obj_size, compact);
+    entries = ZoneEntryArray(header_ptr, compact);
 
     assert(bitmap_size >= 8 && merge_bitmap_size >= 8);
     if (header_size < bitmap_size) {
@@ -374,7 +544,7 @@ Zone::Zone(void *addr, size_t initial_pool_size, size_t min_obj_size,
        // Code commented out now, as we cannot allocate starting of a zone (Offset 0).
        // Once we enable it we can add entire zone into the freelist.
        freelist_level = find_level_from_size(initial_pool_size, min_obj_size);
-       zoneheader->free_list[freelist_level].push(header_ptr, 0);
+       freelist_push(zoneheader, freelist_level, 0);
 #endif
        
        // reserve first block. Allocator de=osen't support offset 0
@@ -387,7 +557,7 @@ Zone::Zone(void *addr, size_t initial_pool_size, size_t min_obj_size,
         while (chunk_size < initial_pool_size) {
                freelist_level = find_level_from_size(chunk_size, min_obj_size);
                ptr = to_Offset(advance_ptr);
-               zoneheader->free_list[freelist_level].push(header_ptr, ptr/min_obj_size);
+               freelist_push(zoneheader, freelist_level, ptr/min_obj_size);
                advance_ptr = (char*)advance_ptr + chunk_size;
                chunk_size = chunk_size << 1;
         }
@@ -428,10 +598,13 @@ Offset Zone::alloc(size_t size)
 {
 	/*
 	1. Identify the freelist level from which we need to seek in free objects.
-	2. Loop from the freelist level calculated above to the current zone level
+	2. Loop over the levels, from the freelist level calculated above to the
+	   current zone level, that the occupancy summary marks as non-empty
 	2.1 Pop a free object from the freelist.
 	2.2 If the free object of same size, then set the bitmap and return.
 	2.3 Else split the free object until the desired size is reached.
+	3. If nothing is found, scan all the levels once in case the summary is
+	   stale (e.g., after a crash) before waiting for or starting a grow.
 
 	Spliting an object is simple - break the object into two parts and
 	pick up the pointer for the right object and insert it into the stack.
@@ -439,14 +612,20 @@ Offset Zone::alloc(size_t size)
 	*/
 	size_t min_obj_size;
         uint64_t zone_fast_alloc;
-        Offset new_chunk_ptr;
 	uint64_t current_zone_level, max_zone_level, current_zone_level_old;
-	uint64_t orig_freelist_level, level;
-	size_t cur_size, chunk_size;
+	uint64_t orig_freelist_level, level, levels;
+	size_t chunk_size;
+	Offset result;
 	struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
 	bool grow_in_progress = false;
 	
 	// TODO: size > current_zone_size
+	if (slab_class_cnt) {
+		uint64_t slab_class = find_slab_class(size);
+		if (slab_class < slab_class_cnt)
+			return slab_alloc(zoneheader, slab_class);
+	}
+
 	min_obj_size = nvmm_read(&zoneheader->min_obj_size);
         zone_fast_alloc = nvmm_read(&zoneheader->zone_fast_alloc);
 
@@ -461,44 +640,46 @@ retry:	//current_zone_level = fam_atomic_u64_read(&zoneheader->current_zone_leve
 	// current_zone_level atomically. Current zone level is updated only during a grow()
 	// operation and it is not a frequent operation. So the overheads of retry will be minimum.
 	current_zone_level = nvmm_read(&zoneheader->current_zone_level);
-	for (level = orig_freelist_level; level <= current_zone_level; level++)
-	{
-		/*
-		TODO: Performance
-		We can track an approximate counter for the free list entries. This can
-		help in avoiding peeping into empty stack and hence improve performance.
-		As the counter is not needed for correctness purpose, we can live with
-		stale values.
-		*/
-                Offset result = (zoneheader->free_list[level].pop(header_ptr))*min_obj_size;
-		if (result) {
-			cur_size = find_size_from_level(level, min_obj_size);
-			while (level != orig_freelist_level) {
-				new_chunk_ptr = result + (cur_size >> 1);
-                                CrashPoints::CrashHere("alloc during split");
-                                // add the second half to the freelist
-				zoneheader->free_list[level-1].push(header_ptr, new_chunk_ptr/min_obj_size);
-				level--;
-				cur_size = cur_size >> 1;
-			}
-                        if (!zone_fast_alloc)
-                            // Zero out the chunk before returning the pointer
-                            // to the caller.
-                            fam_memset_persist(from_Offset(result), 0,
-                                               chunk_size);
-                        CrashPoints::CrashHere("alloc before set bitmap");
-			set_bitmap_bit(zoneheader, orig_freelist_level, result);
-                        return result;
-		}
+	if (orig_freelist_level > current_zone_level)
+		goto grow;
+
+	// a chunk that was zeroed ahead of time saves us the memset
+	if (!zone_fast_alloc &&
+	    fam_atomic_u64_read(&zoneheader->lazy_list[orig_freelist_level].head) != 0) {
+		result = zoneheader->lazy_list[orig_freelist_level].pop(entries)*min_obj_size;
+		if (result)
+			goto zeroed;
+	}
+
+	// one word read tells us which levels are worth a pop
+	levels = nvmm_read(&zoneheader->nonempty_levels) &
+		level_mask(orig_freelist_level, current_zone_level);
+	while (levels) {
+		level = (uint64_t)__builtin_ctzl(levels);
+		result = alloc_from_level(zoneheader, level, orig_freelist_level);
+		if (result)
+			goto found;
+		levels &= levels - 1;
+	}
+
+	for (level = orig_freelist_level; level <= current_zone_level; level++) {
+		result = alloc_from_level(zoneheader, level, orig_freelist_level);
+		if (result)
+			goto found;
 	}
+
+	// the chunks on the lazy lists are free too
+	if (flush_lazy_lists(zoneheader))
+		goto retry;
+
+grow:
 	/* TODO: Should we again check the current_zone_level so that if we a grow that was happening in parallel
 	 * has not updated the current_zone_level and this alloc call is looking at older current_zone_level and hence
 	 * miss the topmost level to check for a chunk????
 	 */
 	// Wait for other grow to complete so that we can try again for alloc.
-	while (is_grow_in_progress(zoneheader)) {
-		// TODO: 1 second wait time is too long. Can we decrease this?
-		sleep(1);
+	for (uint64_t attempt = 0; is_grow_in_progress(zoneheader); attempt++) {
+		grow_backoff(attempt);
 		grow_in_progress = true;
 	}
 
@@ -529,7 +710,182 @@ retry:	//current_zone_level = fam_atomic_u64_read(&zoneheader->current_zone_leve
         //print_freelist();
         //print_bitmap();
 
+	// nothing at or above this level: a hint for the merge scheduler
+	__atomic_fetch_or(&missed_levels, 1UL << orig_freelist_level, __ATOMIC_RELAXED);
 	return 0;
+
+found:
+        if (!zone_fast_alloc)
+            // Zero out the chunk before returning the pointer
+            // to the caller.
+            fam_memset_persist(from_Offset(result), 0, chunk_size);
+zeroed:
+        CrashPoints::CrashHere("alloc before set bitmap");
+	set_bitmap_bit(zoneheader, orig_freelist_level, result);
+        return result;
+}
+
+// Pops a chunk from the given level and splits it down to orig_level,
+// returning the leftmost piece; returns 0 if the level is empty
+Offset Zone::alloc_from_level(struct Zone_Header *zoneheader, uint64_t level,
+                              uint64_t orig_level)
+{
+	size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+	Offset result = freelist_pop(zoneheader, level)*min_obj_size;
+	if (result) {
+		size_t cur_size = find_size_from_level(level, min_obj_size);
+		while (level != orig_level) {
+			Offset new_chunk_ptr = result + (cur_size >> 1);
+			CrashPoints::CrashHere("alloc during split");
+			// add the second half to the freelist
+			freelist_push(zoneheader, level-1, new_chunk_ptr/min_obj_size);
+			level--;
+			cur_size = cur_size >> 1;
+		}
+	}
+	return result;
+}
+
+/***************************************************************************/
+/*                                                                         */
+/* Freelist access                                                         */
+/*                                                                         */
+/***************************************************************************/
+
+// bits [low, high] set
+inline uint64_t level_mask(uint64_t low, uint64_t high)
+{
+	uint64_t upto = (high >= 63) ? ~0UL : ((1UL << (high + 1)) - 1);
+	return upto & (~0UL << low);
+}
+
+void Zone::mark_level_nonempty(struct Zone_Header *zoneheader, uint64_t level)
+{
+	uint64_t bit = 1UL << level;
+	if (!(nvmm_read(&zoneheader->nonempty_levels) & bit))
+		fam_atomic_64_fetch_or((int64_t *)&zoneheader->nonempty_levels, (int64_t)bit);
+}
+
+void Zone::mark_level_empty(struct Zone_Header *zoneheader, uint64_t level)
+{
+	uint64_t bit = 1UL << level;
+	if (!(nvmm_read(&zoneheader->nonempty_levels) & bit))
+		return;
+	fam_atomic_64_fetch_and((int64_t *)&zoneheader->nonempty_levels, (int64_t)~bit);
+	// a push may have slipped in between our empty pop and the clear; pushers
+	// set the bit after their CAS, so re-checking the heads here is enough to
+	// never leave a populated level unmarked
+	if (!level_is_empty(zoneheader, level))
+		mark_level_nonempty(zoneheader, level);
+}
+
+inline ZoneEntryStack &Zone::freelist(struct Zone_Header *zoneheader,
+                                      uint64_t level, uint64_t stripe)
+{
+	return zoneheader->free_list[level*freelist_stripes + stripe];
+}
+
+// Threads push to and pop from the stripe of the CPU they run on, so that
+// threads on different CPUs mostly CAS different heads
+inline uint64_t Zone::local_stripe()
+{
+	if (freelist_stripes == 1)
+		return 0;
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	return (uint64_t)cpu % freelist_stripes;
+}
+
+bool Zone::level_is_empty(struct Zone_Header *zoneheader, uint64_t level)
+{
+	for (uint64_t s = 0; s < freelist_stripes; s++) {
+		if (fam_atomic_u64_read(&freelist(zoneheader, level, s).head) != 0)
+			return false;
+	}
+	return true;
+}
+
+void Zone::freelist_push(struct Zone_Header *zoneheader, uint64_t level, uint64_t idx)
+{
+	freelist(zoneheader, level, local_stripe()).push(entries, idx);
+	mark_level_nonempty(zoneheader, level);
+}
+
+// For a chunk whose header entry was just reset to free at this level, so
+// the push does not have to read it back
+void Zone::freelist_push_released(struct Zone_Header *zoneheader, uint64_t level, uint64_t idx)
+{
+	freelist(zoneheader, level, local_stripe()).push(entries, idx,
+	                                                 zone_entry(false, level));
+	mark_level_nonempty(zoneheader, level);
+}
+
+// Pops from the local stripe first and steals from the sibling stripes when
+// it is empty
+uint64_t Zone::freelist_pop(struct Zone_Header *zoneheader, uint64_t level)
+{
+	uint64_t local = local_stripe();
+	for (uint64_t i = 0; i < freelist_stripes; i++) {
+		uint64_t s = (local + i) % freelist_stripes;
+		uint64_t idx = freelist(zoneheader, level, s).pop(entries);
+		if (idx != 0)
+			return idx;
+	}
+	mark_level_empty(zoneheader, level);
+	return 0;
+}
+
+// Takes the given chunk off the freelists of its level if it is at the top of
+// one of the stripes
+bool Zone::freelist_take(struct Zone_Header *zoneheader, uint64_t level, uint64_t idx)
+{
+	uint64_t local = local_stripe();
+	for (uint64_t i = 0; i < freelist_stripes; i++) {
+		uint64_t s = (local + i) % freelist_stripes;
+		if (freelist(zoneheader, level, s).pop_if_head(entries, idx))
+			return true;
+	}
+	return false;
+}
+
+uint64_t Zone::freelist_pop_chain(struct Zone_Header *zoneheader, uint64_t level,
+                                  uint64_t max, uint64_t *idxes)
+{
+	uint64_t local = local_stripe();
+	for (uint64_t i = 0; i < freelist_stripes; i++) {
+		uint64_t s = (local + i) % freelist_stripes;
+		uint64_t cnt = freelist(zoneheader, level, s).pop_chain(entries, max, idxes);
+		if (cnt != 0)
+			return cnt;
+	}
+	mark_level_empty(zoneheader, level);
+	return 0;
+}
+
+void Zone::freelist_push_chain(struct Zone_Header *zoneheader, uint64_t level,
+                               const uint64_t *idxes, uint64_t cnt)
+{
+	freelist(zoneheader, level, local_stripe()).push_chain(entries, idxes, cnt);
+	mark_level_nonempty(zoneheader, level);
+}
+
+void Zone::freelist_push_linked(struct Zone_Header *zoneheader, uint64_t level,
+                                uint64_t first_idx, uint64_t last_idx,
+                                uint64_t cnt)
+{
+	freelist(zoneheader, level, local_stripe()).push_linked(entries, first_idx, last_idx, cnt);
+	mark_level_nonempty(zoneheader, level);
+}
+
+// Rebuilds the bits a crash may have left unset; setting a bit is always safe
+void Zone::rebuild_level_summary(struct Zone_Header *zoneheader)
+{
+	uint64_t current_zone_level = nvmm_read(&zoneheader->current_zone_level);
+	for (uint64_t level = 0; level <= current_zone_level; level++) {
+		if (!level_is_empty(zoneheader, level))
+			mark_level_nonempty(zoneheader, level);
+	}
 }
 
 /***************************************************************************/
@@ -550,10 +906,302 @@ void Zone::free(Offset block) {
         return;
 
     struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
-    // TODO: optimization
-    // read the entry once, and then pass the entry and entry ptr to get_level_from_Offset,
-    // reset_bitmap_bit, and free_list.push
+    if (is_slab_slot(block)) {
+        slab_free(zoneheader, block);
+        return;
+    }
     uint64_t level = get_level(zoneheader, block);
+    free_chunk(zoneheader, block, level);
+}
+
+void Zone::free(Offset block, size_t size) {
+    if (block == 0)
+        return;
+
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    // a slab size is always served from a slab
+    if (is_slab_size(size)) {
+        assert(is_slab_slot(block));
+        slab_free(zoneheader, block);
+        return;
+    }
+    uint64_t level = size_to_level(size);
+    assert(level == get_level(zoneheader, block));
+    free_chunk(zoneheader, block, level);
+}
+
+// The rest of free() once the level of the chunk is known. Every path
+// leaves the header entry reset to free at the level it pushes to, so the
+// pushes take the entry from us instead of reading it back.
+void Zone::free_chunk(struct Zone_Header *zoneheader, Offset block,
+                      uint64_t level) {
+    uint64_t idx = block/nvmm_read(&zoneheader->min_obj_size);
+    if (lazy_zero && nvmm_read(&zoneheader->zone_fast_alloc) == 1) {
+        // zero_step() zeroes it and moves it to the freelists
+        reset_bitmap_bit(zoneheader, level, block);
+        zoneheader->lazy_list[level].push(entries, idx,
+                                          zone_entry(false, level));
+        return;
+    }
+    release(block, level);
+    if (eager_merge) {
+        level = coalesce(zoneheader, block, level);
+        idx = block/nvmm_read(&zoneheader->min_obj_size);
+    }
+    freelist_push_released(zoneheader, level, idx);
+}
+
+void Zone::set_lazy_zero(bool enable) {
+    lazy_zero = enable;
+}
+
+size_t Zone::zero_step(size_t max_bytes) {
+    /*
+    Moves zeroing off the alloc and free paths:
+    - In a fast_alloc zone, free() leaves the chunks on the lazy lists, and
+      we zero them and move them to the freelists.
+    - Otherwise, we keep some zeroed chunks on the lazy lists for alloc() to
+      take first. They are taken off the freelists of their own level, so no
+      chunk is split for it.
+    Non-temporal stores keep the zeroing from flushing the cache. A chunk is
+    on neither list while we zero it; if we crash, the offline garbage
+    collection reclaims it (and zeroes it in a fast_alloc zone).
+    */
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    bool fast_alloc = (nvmm_read(&zoneheader->zone_fast_alloc) == 1);
+    uint64_t current_zone_level = nvmm_read(&zoneheader->current_zone_level);
+    size_t done = 0;
+
+    for (uint64_t level = 0; level <= current_zone_level && done < max_bytes; level++) {
+        size_t chunk_size = find_size_from_level(level, min_obj_size);
+        ZoneEntryStack &lazy = zoneheader->lazy_list[level];
+        if (fast_alloc) {
+            while (done < max_bytes) {
+                uint64_t idx = lazy.pop(entries);
+                if (idx == 0)
+                    break;
+                fam_memset_nt_persist(from_Offset(idx*min_obj_size), 0, chunk_size);
+                freelist_push(zoneheader, level, idx);
+                done += chunk_size;
+            }
+            continue;
+        }
+
+        if (chunk_size < LAZY_ZERO_MIN_SIZE || chunk_size > LAZY_ZERO_LEVEL_BYTES)
+            continue;
+        uint64_t want = LAZY_ZERO_LEVEL_BYTES / chunk_size;
+        for (uint64_t have = lazy_chunks(zoneheader, level, want);
+             have < want && done < max_bytes; have++) {
+            uint64_t idx = freelist_pop(zoneheader, level);
+            if (idx == 0)
+                break;
+            fam_memset_nt_persist(from_Offset(idx*min_obj_size), 0, chunk_size);
+            lazy.push(entries, idx);
+            done += chunk_size;
+        }
+    }
+    return done;
+}
+
+uint64_t Zone::lazy_chunks(struct Zone_Header *zoneheader, uint64_t level,
+                           uint64_t max) {
+    // only an estimate while others push and pop, as in free_chunks()
+    uint64_t cnt = 0;
+    uint64_t idx = fam_atomic_u64_read(&zoneheader->lazy_list[level].head);
+    while (idx != 0 && cnt < max) {
+        zone_entry entry = entries.load(idx);
+        if (entry.is_allocated() || entry.level() != level)
+            break;
+        cnt++;
+        idx = entry.next();
+    }
+    return cnt;
+}
+
+bool Zone::flush_lazy_lists(struct Zone_Header *zoneheader) {
+    // moves every chunk on the lazy lists to the freelists, zeroing the ones
+    // of a fast_alloc zone on the way
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    bool fast_alloc = (nvmm_read(&zoneheader->zone_fast_alloc) == 1);
+    uint64_t current_zone_level = nvmm_read(&zoneheader->current_zone_level);
+    bool moved = false;
+
+    for (uint64_t level = 0; level <= current_zone_level; level++) {
+        ZoneEntryStack &lazy = zoneheader->lazy_list[level];
+        if (fam_atomic_u64_read(&lazy.head) == 0)
+            continue;
+        uint64_t idx;
+        while ((idx = lazy.pop(entries)) != 0) {
+            if (fast_alloc)
+                clear_data(idx*min_obj_size, zoneheader, level);
+            freelist_push(zoneheader, level, idx);
+            moved = true;
+        }
+    }
+    return moved;
+}
+
+void Zone::set_eager_merge(bool enable) {
+    eager_merge = enable;
+}
+
+uint64_t Zone::coalesce(struct Zone_Header *zoneheader, Offset &block,
+                        uint64_t level) {
+    /*
+    Merge the freed chunk with its buddy for as long as the buddy is free:
+    1. Check the header entry of the buddy: it must be free and of the same
+       level.
+    2. Claim the buddy by popping it off the freelist it is on. Only a buddy
+       at the top of one of the stripes of its level can be claimed; any other
+       free buddy is left for merge().
+    3. Mark the merged chunk free at level+1 and repeat from there.
+    The header encoding does not change. A crash between 2 and the final
+    push leaks chunks that are free in the header but on no freelist, which
+    is exactly what the offline garbage collection reclaims.
+    */
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    uint64_t current_zone_level = nvmm_read(&zoneheader->current_zone_level);
+
+    // the chunk at the top level has no buddy
+    while (level < current_zone_level) {
+        Offset buddy = block ^ find_size_from_level(level, min_obj_size);
+        // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+        zone_entry entry = entries.load(buddy/min_obj_size + 1);
+        if (entry.is_allocated() || entry.level() != level)
+            break;
+        if (!freelist_take(zoneheader, level, buddy/min_obj_size))
+            break;
+        CrashPoints::CrashHere("coalesce after take");
+        block = MIN(block, buddy);
+        level++;
+        reset_bitmap_bit(zoneheader, level, block);
+    }
+    return level;
+}
+
+size_t Zone::block_size(Offset block) {
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    if (is_slab_slot(block)) {
+        Slab_Header *sh = (Slab_Header *)from_Offset(block & ~(SLAB_SIZE - 1));
+        return nvmm_read(&sh->slot_size);
+    }
+    return find_size_from_level(get_level(zoneheader, block),
+                                nvmm_read(&zoneheader->min_obj_size));
+}
+
+bool Zone::grow_in_place(Offset block, size_t size) {
+    /*
+    Grows an allocated chunk to the level of size by taking its buddies on
+    the right, one level at a time, like coalesce() does for a free chunk:
+    1. The chunk must be aligned to the new size, so that all the buddies
+       are on its right.
+    2. Claim each buddy by popping it off the top of a freelist stripe of
+       its level; if one cannot be claimed, push the ones we took back and give up.
+    3. Zero the new part (unless the zone zeroes on free) and mark the chunk
+       allocated at the new level.
+    A crash before 3 leaves the buddies free in the header but on no
+    freelist, and the offline garbage collection reclaims them.
+    */
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    if (block == 0 || is_slab_slot(block))
+        return false;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    size_t chunk_size = next_power_of_two(MAX(size, min_obj_size));
+    uint64_t new_level = find_level_from_size(chunk_size, min_obj_size);
+    uint64_t old_level = get_level(zoneheader, block);
+    if (new_level <= old_level)
+        return true;
+    if (new_level > nvmm_read(&zoneheader->current_zone_level) ||
+        block % chunk_size != 0)
+        return false;
+
+    uint64_t level;
+    for (level = old_level; level < new_level; level++) {
+        Offset buddy = block + find_size_from_level(level, min_obj_size);
+        // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+        zone_entry entry = entries.load(buddy/min_obj_size + 1);
+        // the halves a split pushes keep a stale level in the header, so
+        // being on a freelist of the level is what tells us the buddy is
+        // a free chunk of that level
+        if (entry.is_allocated() ||
+            !freelist_take(zoneheader, level, buddy/min_obj_size))
+            break;
+        CrashPoints::CrashHere("grow in place after take");
+    }
+    if (level < new_level) {
+        while (level-- > old_level)
+            freelist_push(zoneheader, level,
+                          (block + find_size_from_level(level, min_obj_size))/min_obj_size);
+        return false;
+    }
+
+    size_t old_size = find_size_from_level(old_level, min_obj_size);
+    if (nvmm_read(&zoneheader->zone_fast_alloc) != 1)
+        fam_memset_persist(from_Offset(block + old_size), 0, chunk_size - old_size);
+    set_bitmap_bit(zoneheader, new_level, block);
+    return true;
+}
+
+void Zone::free_batch(const Offset *blocks, uint64_t count) {
+    /*
+    Same as free() for each block, except that the blocks are grouped by
+    level and each group is published with a single push. While a block is
+    being released its header entry is rewritten once: the alloc bit is
+    cleared and it is linked to the previous block of the same level.
+    */
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    bool fast_alloc = (nvmm_read(&zoneheader->zone_fast_alloc) == 1);
+    uint64_t first[LEVEL_CNT] = {0}; // idx+1 of the first chunk of each chain
+    uint64_t last[LEVEL_CNT] = {0};
+    uint64_t cnt[LEVEL_CNT] = {0};
+
+    // coalescing needs every chunk to be looked at on its own
+    if (eager_merge) {
+        for (uint64_t i = 0; i < count; i++)
+            free(blocks[i]);
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        Offset block = blocks[i];
+        if (block == 0)
+            continue;
+        if (is_slab_slot(block)) {
+            slab_free(zoneheader, block);
+            continue;
+        }
+        uint64_t level = get_level(zoneheader, block);
+        assert(level < LEVEL_CNT);
+        if (fast_alloc)
+            clear_data(block, zoneheader, level);
+        // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+        uint64_t idx = block/min_obj_size+1;
+        zone_entry new_entry(false, level, first[level]);
+        entries.store(idx, new_entry);
+        if (last[level] == 0)
+            last[level] = idx;
+        first[level] = idx;
+        cnt[level]++;
+    }
+
+    for (uint64_t level = 0; level < LEVEL_CNT; level++) {
+        if (first[level])
+            freelist_push_linked(zoneheader, level, first[level]-1, last[level]-1,
+                                 cnt[level]);
+    }
+}
+
+uint64_t Zone::release(Offset block) {
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    uint64_t level = get_level(zoneheader, block);
+    release(block, level);
+    return level;
+}
+
+void Zone::release(Offset block, uint64_t level) {
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
     // Do we really need to do fam_persist???
     //int64_t* b = (int64_t*) from_Offset(block);
     //fam_persist(b, find_size_from_level);
@@ -562,7 +1210,144 @@ void Zone::free(Offset block) {
 
     // TODO: to be safe, maybe we should check if the chunk was actually allocated or not
     reset_bitmap_bit(zoneheader, level, block);
-    zoneheader->free_list[level].push(header_ptr, block/nvmm_read(&zoneheader->min_obj_size));
+}
+
+/***************************************************************************/
+/*                                                                         */
+/* Batched alloc/free for the per-thread caches                            */
+/*                                                                         */
+/***************************************************************************/
+
+uint64_t Zone::size_to_level(size_t size)
+{
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    return find_level_from_size(next_power_of_two(MAX(size, min_obj_size)), min_obj_size);
+}
+
+uint64_t Zone::take_chunks(uint64_t level, uint64_t count, Offset *chunks)
+{
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    uint64_t current_zone_level = nvmm_read(&zoneheader->current_zone_level);
+
+    if (count == 0 || level > current_zone_level)
+        return 0;
+
+    // common case: cut a whole batch off the freelist of this level with one CAS
+    uint64_t cnt = freelist_pop_chain(zoneheader, level, count, chunks);
+    if (cnt) {
+        for (uint64_t i = 0; i < cnt; i++)
+            chunks[i] = chunks[i]*min_obj_size;
+        return cnt;
+    }
+
+    // otherwise carve as many pieces as needed out of one larger chunk
+    for (uint64_t l = level + 1; l <= current_zone_level; l++) {
+        Offset result = freelist_pop(zoneheader, l)*min_obj_size;
+        if (result) {
+            size_t chunk_size = find_size_from_level(level, min_obj_size);
+            uint64_t pieces = 1UL << (l - level);
+            cnt = MIN(count, pieces);
+            for (uint64_t i = 0; i < cnt; i++)
+                chunks[i] = result + i*chunk_size;
+            CrashPoints::CrashHere("alloc during split");
+            put_range(zoneheader, result, level, cnt, pieces);
+            return cnt;
+        }
+    }
+    return 0;
+}
+
+// Give pieces [from, to) of the chunk at base back to the freelists, where a
+// piece is a chunk of the given level. The range is decomposed into the
+// fewest buddy-aligned chunks, so at most one chunk is pushed per level.
+void Zone::put_range(struct Zone_Header *zoneheader, Offset base,
+                     uint64_t level, uint64_t from, uint64_t to)
+{
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    size_t chunk_size = find_size_from_level(level, min_obj_size);
+    while (from < to) {
+        // the largest aligned block starting at from that still fits
+        uint64_t order = from ? (uint64_t)__builtin_ctzl(from) : 63;
+        while ((1UL << order) > to - from)
+            order--;
+        Offset ptr = base + from*chunk_size;
+        freelist_push(zoneheader, level + order, ptr/min_obj_size);
+        from += 1UL << order;
+    }
+}
+
+uint64_t Zone::alloc_batch(size_t size, uint64_t count, Offset *chunks)
+{
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    if (is_slab_size(size)) {
+        uint64_t total;
+        for (total = 0; total < count; total++) {
+            chunks[total] = alloc(size);
+            if (chunks[total] == 0)
+                break;
+        }
+        return total;
+    }
+
+    uint64_t level = size_to_level(size);
+    size_t chunk_size = find_size_from_level(level, nvmm_read(&zoneheader->min_obj_size));
+    bool zero = !nvmm_read(&zoneheader->zone_fast_alloc);
+    uint64_t total = 0;
+
+    while (total < count) {
+        uint64_t cnt = take_chunks(level, count - total, chunks + total);
+        if (cnt == 0) {
+            // nothing left at or above this level; let alloc() try to grow
+            chunks[total] = alloc(size);
+            if (chunks[total] == 0)
+                break;
+            total++;
+            continue;
+        }
+
+        // zero contiguous runs with one call, then set the header entries
+        if (zero) {
+            uint64_t run = 0;
+            for (uint64_t i = 1; i <= cnt; i++) {
+                if (i == cnt || chunks[total+i] != chunks[total+i-1] + chunk_size) {
+                    fam_memset_persist(from_Offset(chunks[total+run]), 0,
+                                       (i - run)*chunk_size);
+                    run = i;
+                }
+            }
+        }
+        CrashPoints::CrashHere("alloc before set bitmap");
+        for (uint64_t i = 0; i < cnt; i++)
+            set_bitmap_bit(zoneheader, level, chunks[total+i]);
+        total += cnt;
+    }
+    return total;
+}
+
+void Zone::mark_allocated(Offset block, uint64_t level)
+{
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    if (!nvmm_read(&zoneheader->zone_fast_alloc))
+        clear_data(block, zoneheader, level);
+    CrashPoints::CrashHere("alloc before set bitmap");
+    set_bitmap_bit(zoneheader, level, block);
+}
+
+void Zone::put_chunks(uint64_t level, const Offset *chunks, uint64_t count)
+{
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    uint64_t idxes[CHUNK_BATCH];
+    while (count > 0) {
+        uint64_t cnt = MIN(count, CHUNK_BATCH);
+        for (uint64_t i = 0; i < cnt; i++)
+            idxes[i] = chunks[i]/min_obj_size;
+        freelist_push_chain(zoneheader, level, idxes, cnt);
+        chunks += cnt;
+        count -= cnt;
+    }
 }
 
 void Zone::clear_data(Offset block, struct Zone_Header *zoneheader,
@@ -572,6 +1357,290 @@ void Zone::clear_data(Offset block, struct Zone_Header *zoneheader,
     fam_memset_persist(from_Offset(block), 0, size);
 }
 
+/***************************************************************************/
+/*                                                                         */
+/* Slabs                                                                   */
+/*                                                                         */
+/***************************************************************************/
+
+// Slots are aligned to min_obj_size so that an offset rounded down to
+// min_obj_size (as the delayed free lists keep it) still falls in its slot
+inline void slab_geometry(uint64_t slot_size, size_t min_obj_size,
+                          uint64_t &slot_cnt, uint64_t &slots_offset)
+{
+    uint64_t words = (SLAB_SIZE / slot_size + 63) / 64;
+    slots_offset = round_up(sizeof(Slab_Header) + words * sizeof(uint64_t),
+                            min_obj_size);
+    slot_cnt = (SLAB_SIZE - slots_offset) / slot_size;
+}
+
+static inline void lock_slab_list(SlabList *list)
+{
+    while (cas64((int64_t *)&list->lock, 0, 1) != 0)
+        sched_yield();
+}
+
+static inline void unlock_slab_list(SlabList *list)
+{
+    fam_atomic_u64_write(&list->lock, 0);
+}
+
+// Sets the first clear bit of the occupancy bitmap and returns its slot, or
+// slot_cnt if the slab is full. Only the holder of the list lock sets bits.
+static uint64_t claim_slot(Slab_Header *slab)
+{
+    uint64_t slot_cnt = nvmm_read(&slab->slot_cnt);
+    for (uint64_t w = 0; w < (slot_cnt + 63) / 64; w++) {
+        uint64_t bits = fam_atomic_u64_read(&slab->bitmap[w]);
+        if (bits == ~0UL)
+            continue;
+        uint64_t bit = (uint64_t)__builtin_ctzl(~bits);
+        fam_atomic_64_fetch_or((int64_t *)&slab->bitmap[w], (int64_t)(1UL << bit));
+        return w * 64 + bit;
+    }
+    return slot_cnt;
+}
+
+// Returns the smallest size class that fits size, or slab_class_cnt when the
+// power-of-two chunk would not waste more than that class
+uint64_t Zone::find_slab_class(size_t size)
+{
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t chunk_size =
+        next_power_of_two(MAX(size, nvmm_read(&zoneheader->min_obj_size)));
+    for (uint64_t i = 0; i < slab_class_cnt; i++) {
+        if (slab_classes[i] >= size)
+            return (slab_classes[i] < chunk_size) ? i : slab_class_cnt;
+    }
+    return slab_class_cnt;
+}
+
+bool Zone::is_slab_size(size_t size)
+{
+    return slab_class_cnt && find_slab_class(size) < slab_class_cnt;
+}
+
+bool Zone::is_slab_slot(Offset block)
+{
+    if (slab_class_cnt == 0)
+        return false;
+    Offset slab = block & ~(SLAB_SIZE - 1);
+    if (slab == block)
+        return false;
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+    uint64_t idx = slab / nvmm_read(&zoneheader->min_obj_size) + 1;
+    zone_entry entry = entries.load(idx);
+    return entry.is_allocated() && (entry.level() & SLAB_LEVEL_FLAG);
+}
+
+Offset Zone::slab_alloc(struct Zone_Header *zoneheader, uint64_t slab_class)
+{
+    /*
+    1. Walk the slabs of the size class from the head, moving full slabs to
+       the tail, until a slab with a clear bit is found.
+    2. If all slabs are full, allocate a new one and link it at the head.
+    3. Set the bit of the slot, then count it in used.
+    Frees never take the lock; they clear the bit first and then decrement
+    used, so a slab with used == 0 has no slot allocated or being freed.
+    */
+    SlabList *list = &zoneheader->slab_lists[slab_class];
+    Offset first_full = 0;
+    Offset result = 0;
+    Slab_Header *sh = NULL;
+    uint64_t slot;
+
+    lock_slab_list(list);
+    for (;;) {
+        Offset slab = fam_atomic_u64_read(&list->head);
+        if (slab == 0 || slab == first_full)
+            break;
+        sh = (Slab_Header *)from_Offset(slab);
+        slot = claim_slot(sh);
+        if (slot < nvmm_read(&sh->slot_cnt)) {
+            result = slab + nvmm_read(&sh->slots_offset) + slot * nvmm_read(&sh->slot_size);
+            break;
+        }
+        Offset tail = fam_atomic_u64_read(&list->tail);
+        if (slab == tail)
+            break;
+        if (first_full == 0)
+            first_full = slab;
+        Slab_Header *tail_sh = (Slab_Header *)from_Offset(tail);
+        fam_atomic_u64_write(&list->head, fam_atomic_u64_read(&sh->next));
+        fam_atomic_u64_write(&sh->next, 0);
+        fam_atomic_u64_write(&tail_sh->next, slab);
+        fam_atomic_u64_write(&list->tail, slab);
+    }
+
+    if (result == 0) {
+        Offset slab = slab_create(zoneheader, slab_class);
+        if (slab) {
+            sh = (Slab_Header *)from_Offset(slab);
+            slot = claim_slot(sh);
+            result = slab + nvmm_read(&sh->slots_offset) + slot * nvmm_read(&sh->slot_size);
+        }
+    }
+
+    if (result) {
+        CrashPoints::CrashHere("slab alloc before used");
+        fam_atomic_u64_fetch_and_add(&sh->used, 1);
+    }
+    unlock_slab_list(list);
+
+    if (result && !nvmm_read(&zoneheader->zone_fast_alloc))
+        fam_memset_persist(from_Offset(result), 0, slab_classes[slab_class]);
+    return result;
+}
+
+// Must be called with the list lock of the size class held
+Offset Zone::slab_create(struct Zone_Header *zoneheader, uint64_t slab_class)
+{
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    SlabList *list = &zoneheader->slab_lists[slab_class];
+    uint64_t slot_size = slab_classes[slab_class];
+    uint64_t slot_cnt, slots_offset;
+
+    Offset slab = alloc(SLAB_SIZE);
+    if (slab == 0)
+        return 0;
+
+    slab_geometry(slot_size, min_obj_size, slot_cnt, slots_offset);
+    uint64_t words = (slot_cnt + 63) / 64;
+    Slab_Header *sh = (Slab_Header *)from_Offset(slab);
+    fam_memset_persist(sh, 0, sizeof(Slab_Header) + words * sizeof(uint64_t));
+    fam_atomic_u64_write(&sh->size_class, slab_class);
+    fam_atomic_u64_write(&sh->slot_size, slot_size);
+    fam_atomic_u64_write(&sh->slot_cnt, slot_cnt);
+    fam_atomic_u64_write(&sh->slots_offset, slots_offset);
+    if (slot_cnt % 64)
+        fam_atomic_u64_write(&sh->bitmap[words - 1], ~0UL << (slot_cnt % 64));
+
+    // the chunk becomes a slab once its header entry says so; offline
+    // recovery relinks slabs from these entries
+    CrashPoints::CrashHere("slab create before set bitmap");
+    set_bitmap_bit(zoneheader,
+                   find_level_from_size(SLAB_SIZE, min_obj_size) | SLAB_LEVEL_FLAG,
+                   slab);
+
+    fam_atomic_u64_write(&sh->next, fam_atomic_u64_read(&list->head));
+    fam_atomic_u64_write(&list->head, slab);
+    if (fam_atomic_u64_read(&list->tail) == 0)
+        fam_atomic_u64_write(&list->tail, slab);
+    return slab;
+}
+
+void Zone::slab_free(struct Zone_Header *zoneheader, Offset block)
+{
+    Offset slab = block & ~(SLAB_SIZE - 1);
+    Slab_Header *sh = (Slab_Header *)from_Offset(slab);
+    uint64_t slot_size = nvmm_read(&sh->slot_size);
+    uint64_t slots_offset = nvmm_read(&sh->slots_offset);
+
+    assert(block >= slab + slots_offset);
+    // round up, as the delayed free lists hand back offsets rounded down to
+    // min_obj_size
+    uint64_t slot = (block - slab - slots_offset + slot_size - 1) / slot_size;
+    assert(slot < nvmm_read(&sh->slot_cnt));
+
+    if (nvmm_read(&zoneheader->zone_fast_alloc) == 1)
+        fam_memset_persist(from_Offset(slab + slots_offset + slot * slot_size), 0,
+                           slot_size);
+    fam_atomic_64_fetch_and((int64_t *)&sh->bitmap[slot / 64],
+                            (int64_t)~(1UL << (slot % 64)));
+    fam_atomic_u64_fetch_and_add(&sh->used, (uint64_t)-1);
+}
+
+// Returns the slabs that have no allocated slot to the freelists
+void Zone::slab_reclaim(struct Zone_Header *zoneheader)
+{
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    uint64_t level = find_level_from_size(SLAB_SIZE, min_obj_size);
+
+    for (uint64_t i = 0; i < slab_class_cnt; i++) {
+        SlabList *list = &zoneheader->slab_lists[i];
+        lock_slab_list(list);
+        Offset prev = 0;
+        Offset slab = fam_atomic_u64_read(&list->head);
+        while (slab) {
+            Slab_Header *sh = (Slab_Header *)from_Offset(slab);
+            Offset next = fam_atomic_u64_read(&sh->next);
+            if (fam_atomic_u64_read(&sh->used) != 0) {
+                prev = slab;
+                slab = next;
+                continue;
+            }
+            if (prev)
+                fam_atomic_u64_write(&((Slab_Header *)from_Offset(prev))->next, next);
+            else
+                fam_atomic_u64_write(&list->head, next);
+            if (fam_atomic_u64_read(&list->tail) == slab)
+                fam_atomic_u64_write(&list->tail, prev);
+
+            if (nvmm_read(&zoneheader->zone_fast_alloc) == 1)
+                clear_data(slab, zoneheader, level);
+            reset_bitmap_bit(zoneheader, level, slab);
+            freelist_push(zoneheader, level, slab / min_obj_size);
+            slab = next;
+        }
+        unlock_slab_list(list);
+    }
+}
+
+void Zone::slab_crash_recovery()
+{
+    /*
+      Offline only!
+
+      The header entries are the ground truth: every chunk whose entry is
+      allocated with SLAB_LEVEL_FLAG is a slab. Rebuild the slab lists and the
+      used counters from them and from the occupancy bitmaps, and drop the
+      list locks.
+    */
+    if (slab_class_cnt == 0)
+        return;
+
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    size_t zone_size = find_size_from_level(nvmm_read(&zoneheader->current_zone_level),
+                                            min_obj_size);
+
+    for (uint64_t i = 0; i < slab_class_cnt; i++) {
+        SlabList *list = &zoneheader->slab_lists[i];
+        fam_atomic_u64_write(&list->head, 0);
+        fam_atomic_u64_write(&list->tail, 0);
+        fam_atomic_u64_write(&list->lock, 0);
+    }
+
+    for (Offset slab = SLAB_SIZE; slab < zone_size; slab += SLAB_SIZE) {
+        // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+        zone_entry entry = entries.load(slab / min_obj_size + 1);
+        if (!entry.is_allocated() || !(entry.level() & SLAB_LEVEL_FLAG))
+            continue;
+
+        Slab_Header *sh = (Slab_Header *)from_Offset(slab);
+        uint64_t slab_class = nvmm_read(&sh->size_class);
+        uint64_t slot_cnt = nvmm_read(&sh->slot_cnt);
+        assert(slab_class < slab_class_cnt);
+
+        uint64_t used = 0;
+        for (uint64_t w = 0; w < (slot_cnt + 63) / 64; w++)
+            used += (uint64_t)__builtin_popcountl(fam_atomic_u64_read(&sh->bitmap[w]));
+        if (slot_cnt % 64)
+            used -= 64 - slot_cnt % 64;
+        fam_atomic_u64_write(&sh->used, used);
+
+        SlabList *list = &zoneheader->slab_lists[slab_class];
+        Offset tail = fam_atomic_u64_read(&list->tail);
+        fam_atomic_u64_write(&sh->next, 0);
+        if (tail)
+            fam_atomic_u64_write(&((Slab_Header *)from_Offset(tail))->next, slab);
+        else
+            fam_atomic_u64_write(&list->head, slab);
+        fam_atomic_u64_write(&list->tail, slab);
+    }
+}
+
 bool Zone::grow()
 {
 	/*
@@ -616,7 +1685,8 @@ bool Zone::grow()
 		return false;
 	} else {
 
-		printf("Grow happening from %ld to %ld level\n", current_zone_level, current_zone_level + 1);
+		LOG(trace) << "Grow happening from " << current_zone_level << " to "
+			   << current_zone_level + 1 << " level";
 
 		old_zone_level = current_zone_level;
 		chunk_size = find_size_from_level(old_zone_level, nvmm_read(&zoneheader->min_obj_size));
@@ -626,9 +1696,10 @@ bool Zone::grow()
 			assert(0);
 		}
 
-		advance_ptr = zone_header_ptr + chunk_size;
-		zoneheader->free_list[old_zone_level].push(header_ptr,
-								 to_Offset(advance_ptr)/nvmm_read(&zoneheader->min_obj_size));
+		// the grown half of the zone starts right after the old zone
+		advance_ptr = shelf_location_ptr + chunk_size;
+		freelist_push(zoneheader, old_zone_level,
+			      to_Offset(advance_ptr)/nvmm_read(&zoneheader->min_obj_size));
 
 
                 // UNLOCK
@@ -650,6 +1721,83 @@ bool Zone::is_grow_in_progress(struct Zone_Header *zoneheader)
 	}
 }
 
+bool Zone::grow_ahead(size_t watermark)
+{
+	/*
+	Grow the zone before an allocation has to, i.e., when the occupancy summary
+	says there is no free chunk of at least watermark bytes left. The summary
+	may be stale; a missed grow is still done by the allocation that misses.
+	*/
+	struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+	size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+	uint64_t current_zone_level = fam_atomic_u64_read((uint64_t *)&zoneheader->current_zone_level);
+
+	if (current_zone_level >= nvmm_read(&zoneheader->max_zone_level))
+		return false;
+
+	uint64_t level = find_level_from_size(next_power_of_two(MAX(watermark, min_obj_size)),
+					      min_obj_size);
+	if (level <= current_zone_level &&
+	    (nvmm_read(&zoneheader->nonempty_levels) & level_mask(level, current_zone_level)))
+		return false;
+
+	if (is_grow_in_progress(zoneheader))
+		return false;
+	return grow();
+}
+
+bool Zone::may_alloc(size_t size)
+{
+	/*
+	A cheap, approximate check made before alloc(): false means the
+	occupancy summary has no free chunk of the size or larger and the zone
+	cannot grow to make one. The summary can be stale in both directions,
+	so alloc() may still fail after a true and succeed after a false.
+	*/
+	struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+
+	// slab slots are not in the summary
+	if (slab_class_cnt && find_slab_class(size) < slab_class_cnt)
+		return true;
+
+	size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+	uint64_t max_zone_level = nvmm_read(&zoneheader->max_zone_level);
+	uint64_t current_zone_level = fam_atomic_u64_read((uint64_t *)&zoneheader->current_zone_level);
+	uint64_t level = find_level_from_size(next_power_of_two(MAX(size, min_obj_size)),
+					      min_obj_size);
+	if (level > max_zone_level)
+		return false;
+	if (current_zone_level < max_zone_level)
+		return true;
+	if (level > current_zone_level)
+		return false;
+
+	if (nvmm_read(&zoneheader->nonempty_levels) & level_mask(level, current_zone_level))
+		return true;
+	// neither are the chunks on the lazy lists
+	for (uint64_t l = level; l <= current_zone_level; l++) {
+		if (fam_atomic_u64_read(&zoneheader->lazy_list[l].head) != 0)
+			return true;
+	}
+	return false;
+}
+
+bool Zone::must_split(size_t size)
+{
+	struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+
+	if (slab_class_cnt && find_slab_class(size) < slab_class_cnt)
+		return false;
+
+	size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+	uint64_t level = find_level_from_size(next_power_of_two(MAX(size, min_obj_size)),
+					      min_obj_size);
+	if (level >= LEVEL_CNT)
+		return true;
+	if (nvmm_read(&zoneheader->nonempty_levels) & (1UL << level))
+		return false;
+	return fam_atomic_u64_read(&zoneheader->lazy_list[level].head) == 0;
+}
 
 void Zone::grow_crash_recovery()
 {
@@ -681,9 +1829,11 @@ void Zone::grow_crash_recovery()
     zone_size = find_size_from_level(current_zone_level, nvmm_read(&zoneheader->min_obj_size));
 
     for (int64_t level = (int64_t)current_zone_level; level >= 0; level--) {
-        uint64_t idx = fam_atomic_u64_read((uint64_t *)&zoneheader->free_list[level].head);
-        if (idx*nvmm_read(&zoneheader->min_obj_size) >= zone_size)
-            return;
+        for (uint64_t s = 0; s < freelist_stripes; s++) {
+            uint64_t idx = fam_atomic_u64_read((uint64_t *)&freelist(zoneheader, (uint64_t)level, s).head);
+            if (idx*nvmm_read(&zoneheader->min_obj_size) >= zone_size)
+                return;
+        }
     }
 
     // there may be memory leak
@@ -698,9 +1848,7 @@ inline uint64_t Zone::get_level(struct Zone_Header *zoneheader, Offset ptr)
     size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
     // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
     uint64_t idx = ptr/min_obj_size+1;
-    uint64_t *entry_ptr = ((uint64_t*)header_ptr) + idx;
-    zone_entry entry = (zone_entry)fam_atomic_u64_read(entry_ptr);
-    return entry.level();
+    return chunk_level(entries.load(idx));
 }
 
 inline void set_bit(void *address, uint64_t bit_offset)
@@ -747,9 +1895,9 @@ void Zone::print_bitmap() {
     printf("min obj size: %lu\n", nvmm_read(&zoneheader->min_obj_size));
     printf("max obj size: %lu\n", find_size_from_level(nvmm_read(&zoneheader->current_zone_level), nvmm_read(&zoneheader->min_obj_size)));
     for(uint64_t i=1; i<=nvmm_read(&zoneheader->max_zone_size)/nvmm_read(&zoneheader->min_obj_size); i++) {
-        zone_entry entry = ((zone_entry*)header_ptr)[i];
+        zone_entry entry = entries.load(i);
         if (entry.is_allocated())
-            printf("%lu) %lu %lu %lu\n", i-1, entry.is_allocated()?1UL:0UL, find_size_from_level(entry.level(), nvmm_read(&zoneheader->min_obj_size)), entry.next());
+            printf("%lu) %lu %lu %lu%s\n", i-1, entry.is_allocated()?1UL:0UL, find_size_from_level(chunk_level(entry), nvmm_read(&zoneheader->min_obj_size)), entry.next(), (entry.level() & SLAB_LEVEL_FLAG)?" slab":"");
     }
 }
 
@@ -757,14 +1905,16 @@ void Zone::print_freelist() {
     struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
 
     for (uint64_t i = 0; i <= nvmm_read(&zoneheader->current_zone_level); i++) {
-        uint64_t idx = (Offset)zoneheader->free_list[i].head;
-        if (idx==0)
-            continue;
-        printf("level %lu, head %lu, size %lu\n", i, idx-1, find_size_from_level(i, nvmm_read(&zoneheader->min_obj_size)));
-        while (idx>0) {
-            zone_entry entry = ((zone_entry*)header_ptr)[idx];
-            printf("level %lu, %lu) %lu %lu %lu\n", i, idx-1, entry.is_allocated()?1UL:0UL, find_size_from_level(entry.level(), nvmm_read(&zoneheader->min_obj_size)), entry.next()?entry.next()-1:0);
-            idx = entry.next();
+        for (uint64_t s = 0; s < freelist_stripes; s++) {
+            uint64_t idx = (Offset)freelist(zoneheader, i, s).head;
+            if (idx==0)
+                continue;
+            printf("level %lu, stripe %lu, head %lu, size %lu\n", i, s, idx-1, find_size_from_level(i, nvmm_read(&zoneheader->min_obj_size)));
+            while (idx>0) {
+                zone_entry entry = entries.load(idx);
+                printf("level %lu, %lu) %lu %lu %lu\n", i, idx-1, entry.is_allocated()?1UL:0UL, find_size_from_level(entry.level(), nvmm_read(&zoneheader->min_obj_size)), entry.next()?entry.next()-1:0);
+                idx = entry.next();
+            }
         }
     }
 }
@@ -773,14 +1923,17 @@ size_t Zone::get_bitmap_offset()
 {
      return (char*)header_ptr - (char*)zone_header_ptr;
 }
+
+bool Zone::has_compact_header()
+{
+    return entries.compact;
+}
 void Zone::modify_bitmap_bit(struct Zone_Header *zoneheader, uint64_t level, Offset ptr, bool set)
 {
     size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
     // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
     uint64_t idx = ptr/min_obj_size+1;
-    uint64_t *entry_ptr = ((uint64_t*)header_ptr) + idx;
-    zone_entry new_entry(set, level);
-    fam_atomic_u64_write(entry_ptr, (uint64_t)new_entry);
+    entries.store(idx, zone_entry(set, level));
 }
 
 void Zone::set_bitmap_bit(struct Zone_Header *zoneheader, uint64_t level, Offset ptr)
@@ -809,6 +1962,11 @@ void Zone::merge()
     // matter much as we wont find entries in free-lists.
     current_zone_level = fam_atomic_u64_read((uint64_t *)&zoneheader->current_zone_level);
 
+    // give empty slabs and the chunks on the lazy lists back first so that
+    // they can be merged too
+    slab_reclaim(zoneheader);
+    flush_lazy_lists(zoneheader);
+
     merge_level = 0;
     while (merge_level < (int64_t)current_zone_level) {
         if (merge(zoneheader, merge_level)) {
@@ -826,6 +1984,94 @@ void Zone::merge()
     //print_freelist();
 }
 
+uint64_t Zone::take_missed_levels()
+{
+    return __atomic_exchange_n(&missed_levels, 0UL, __ATOMIC_RELAXED);
+}
+
+uint64_t Zone::free_chunks(uint64_t level, uint64_t max)
+{
+    /*
+    Walks the freelists of the level without taking anything off them, so
+    the count is only an estimate when there are concurrent allocs and frees
+    (a chunk popped under our feet ends the walk of its stripe early).
+    */
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    uint64_t cnt = 0;
+    if (level > nvmm_read(&zoneheader->current_zone_level))
+        return 0;
+    for (uint64_t s = 0; s < freelist_stripes && cnt < max; s++) {
+        uint64_t idx = fam_atomic_u64_read(&freelist(zoneheader, level, s).head);
+        while (idx != 0 && cnt < max) {
+            zone_entry entry = entries.load(idx);
+            if (entry.is_allocated() || entry.level() != level)
+                break;
+            cnt++;
+            idx = entry.next();
+        }
+    }
+    return cnt;
+}
+
+uint64_t Zone::merge_slice(uint64_t level, uint64_t max_chunks)
+{
+    /*
+    An incremental merge that needs neither the merge lock nor the merge
+    bitmap:
+    1. Take up to max_chunks chunks off the freelists of the level.
+    2. Sort them by address and pair up the buddies.
+    3. Push every pair as one chunk of level+1 and the rest back to the level.
+    The chunks are only ours while they are off the freelists, so this can run
+    alongside allocs, frees and merge(). A crash between 1 and 3 leaves them
+    free in the header but on no freelist, which the offline garbage collection
+    reclaims.
+    */
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+
+    // the chunk at the top level has no buddy
+    if (level >= nvmm_read(&zoneheader->current_zone_level) || max_chunks == 0)
+        return 0;
+
+    // 1
+    std::vector<uint64_t> idxes(max_chunks);
+    uint64_t cnt = 0;
+    while (cnt < max_chunks) {
+        uint64_t n = freelist_pop_chain(zoneheader, level,
+                                        MIN(max_chunks - cnt, CHUNK_BATCH),
+                                        idxes.data() + cnt);
+        if (n == 0)
+            break;
+        cnt += n;
+    }
+    CrashPoints::CrashHere("merge slice after take");
+
+    // 2
+    std::sort(idxes.begin(), idxes.begin() + cnt);
+    uint64_t units = 1UL << level; // chunk size in min_obj_size units
+    std::vector<uint64_t> merged, unmerged;
+    for (uint64_t i = 0; i < cnt;) {
+        if (i + 1 < cnt && idxes[i] % (2 * units) == 0 &&
+            idxes[i + 1] == idxes[i] + units) {
+            reset_bitmap_bit(zoneheader, level + 1, idxes[i] * min_obj_size);
+            merged.push_back(idxes[i]);
+            i += 2;
+        } else {
+            unmerged.push_back(idxes[i]);
+            i++;
+        }
+    }
+
+    // 3
+    for (uint64_t i = 0; i < merged.size(); i += CHUNK_BATCH)
+        freelist_push_chain(zoneheader, level + 1, merged.data() + i,
+                            MIN(merged.size() - i, CHUNK_BATCH));
+    for (uint64_t i = 0; i < unmerged.size(); i += CHUNK_BATCH)
+        freelist_push_chain(zoneheader, level, unmerged.data() + i,
+                            MIN(unmerged.size() - i, CHUNK_BATCH));
+    return merged.size();
+}
+
 bool Zone::is_merge_in_progress(struct Zone_Header *zoneheader)
 {
     uint64_t merge_in_progress = fam_atomic_u64_read((uint64_t *)&zoneheader->merge_in_progress);
@@ -888,27 +2134,71 @@ void Zone::swap_freelist(struct Zone_Header *zoneheader, uint64_t level) {
     uint64_t level_head;
     uint64_t safe_copy_head;
 
-    level_head = fam_atomic_u64_read((uint64_t *)&zoneheader->free_list[level].head);
-    for (;;) {
-        // Loop until the safe copy and level freelist are in sync and nobody changes the level
-        // freelist before the safe copy is properly copied and the level freelist is cleared.
-    retry:
+    // A safe copy left over by a merge that crashed before it was done with
+    // it belongs to another level; drop it (the offline GC reclaims its
+    // chunks) rather than splice this level's chains into it.
+    fam_atomic_u64_write((uint64_t *)&zoneheader->safe_copy.head, 0);
+
+    for (uint64_t s = 0; s < freelist_stripes; s++) {
+        ZoneEntryStack &list = freelist(zoneheader, level, s);
+        level_head = fam_atomic_u64_read((uint64_t *)&list.head);
         safe_copy_head = fam_atomic_u64_read((uint64_t *)&zoneheader->safe_copy.head);
+        if (safe_copy_head == 0) {
+            for (;;) {
+                // Loop until the safe copy and level freelist are in sync and nobody changes the level
+                // freelist before the safe copy is properly copied and the level freelist is cleared.
+            retry:
+                safe_copy_head = fam_atomic_u64_read((uint64_t *)&zoneheader->safe_copy.head);
+
+                // TODO: do we need CAS here? it seems that no one else can be doing merge since we have
+                // the merge lock
+                old_value = cas64((int64_t *)&zoneheader->safe_copy.head, safe_copy_head, level_head);
+                if (old_value != (int64_t)safe_copy_head) {
+                    goto retry;
+                }
 
-        // TODO: do we need CAS here? it seems that no one else can be doing merge since we have
-        // the merge lock
-        old_value = cas64((int64_t *)&zoneheader->safe_copy.head, safe_copy_head, level_head);
-        if (old_value != (int64_t)safe_copy_head) {
-            goto retry;
+                // CAS is required here because there can be concurrent allocations and frees
+                old_value = cas64((int64_t *)&list.head, level_head, 0);
+                if (old_value == (int64_t)level_head) {
+                    break;
+                }
+                level_head = old_value;
+                LOG(trace) << "merge: swap freelist trying again";
+            }
+            // the chain is ours now: take its chunks off the stripe's count
+            uint64_t cnt = 0;
+            for (uint64_t idx = level_head; idx != 0; idx = entries.load(idx).next())
+                cnt++;
+            list.adjust_count(-(int64_t)cnt);
+            continue;
         }
 
-        // CAS is required here because there can be concurrent allocations and frees
-        old_value = cas64((int64_t *)&zoneheader->free_list[level].head, level_head, 0);
-        if (old_value == (int64_t)level_head) {
-            break;
+        // The safe copy already holds the chains of earlier stripes: detach
+        // this stripe's chain and splice it in front. A crash in between
+        // leaves the safe copy non-empty, so recovery asks for the offline GC.
+        for (;;) {
+            if (level_head == 0)
+                break;
+            old_value = cas64((int64_t *)&list.head, level_head, 0);
+            if (old_value == (int64_t)level_head)
+                break;
+            level_head = old_value;
+        }
+        if (level_head == 0)
+            continue;
+
+        uint64_t tail = level_head;
+        uint64_t cnt = 1;
+        zone_entry entry = entries.load(tail);
+        while (entry.next() != 0) {
+            tail = entry.next();
+            entry = entries.load(tail);
+            cnt++;
         }
-        level_head = old_value;
-        printf("Trying again\n");
+        list.adjust_count(-(int64_t)cnt);
+        entry.link_next(safe_copy_head);
+        entries.store(tail, entry);
+        fam_atomic_u64_write((uint64_t *)&zoneheader->safe_copy.head, level_head);
     }
 
     CrashPoints::CrashHere("merge after 3");
@@ -934,7 +2224,6 @@ void Zone::create_merge_bitmap(struct Zone_Header *zoneheader, uint64_t level) {
     //Offset merge_bitmap_start = zoneheader->merge_bitmap_start_addr;
     size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
     size_t chunk_size = find_size_from_level(level, min_obj_size);
-    zone_entry *alloc_bitmap_ptr = (zone_entry*)header_ptr;
 
     uint64_t next_idx;
     uint64_t idx = nvmm_read(&zoneheader->safe_copy.head);
@@ -947,7 +2236,7 @@ void Zone::create_merge_bitmap(struct Zone_Header *zoneheader, uint64_t level) {
         if (idx == 0) {
             break;
         }
-        zone_entry entry = (zone_entry)fam_atomic_u64_read((uint64_t *)(alloc_bitmap_ptr+idx));
+        zone_entry entry = entries.load(idx);
         next_idx = entry.next();
 
         bitmap_offset = ((idx-1)*min_obj_size/chunk_size)/ (ATOMIC_SIZE);
@@ -972,7 +2261,7 @@ void Zone::do_merge(struct Zone_Header *zoneheader, uint64_t level) {
     assert(nvmm_read(&zoneheader->merge_status) == MERGE_BITMAP_COMPLETED);
     LOG(trace) << "merge: do merge";
 
-    uint64_t shift, length = 0, max_bitmap_length;
+    uint64_t max_bitmap_length;
     uint64_t  bitmap_data;
     uint64_t unmerged_chunks = 0, merged_chunks = 0;
     Offset new_chunk_ptr;
@@ -990,57 +2279,46 @@ void Zone::do_merge(struct Zone_Header *zoneheader, uint64_t level) {
         max_bitmap_length = 1;
     }
 
-    while (length < max_bitmap_length) {
-        shift = 0x0000000000000003;
-        bitmap_data = fam_atomic_u64_read((uint64_t *)(merge_bitmap_start_addr + length));
-        // No need to check anything in case the entire 64 bytes is 0.
-        if (bitmap_data == 0) {
-            length = length + 8;
-            continue;
+    // TODO: Do we need to worry about reading something extra in the last 8 byte read. This problem
+    // shouldn't happen as the max_bitmap_length will be a multiple of 8 always until the last few
+    // levels where it can be less than 8 bytes. In that case, as the merge_bitmap size is way more
+    // than max_bitmap_length and so everything should work fine.
+    uint64_t *bitmap_words = (uint64_t *)merge_bitmap_start_addr;
+    uint64_t word_cnt = (max_bitmap_length + 7) / 8;
+    for (uint64_t w = bitmap_find_nonzero(bitmap_words, 0, word_cnt); w < word_cnt;
+         w = bitmap_find_nonzero(bitmap_words, w + 1, word_cnt)) {
+        // No need to check anything in case the entire 64 bits are 0.
+        bitmap_data = fam_atomic_u64_read(bitmap_words + w);
+
+        // Merge the buddies to make a larger chunk.
+        uint64_t pairs = bitmap_buddy_pairs(bitmap_data);
+        while (pairs) {
+            uint64_t i = (uint64_t)__builtin_ctzl(pairs);
+            pairs &= pairs - 1;
+            new_chunk_ptr = (w * ATOMIC_SIZE + i) * chunk_size;
+            // As the starting part is always reserved for zone-header, there will
+            // never be a case where new_chunk_ptr is 0.
+            //TODO: Aseert the bitmap and merge bitmap addresses too.
+            assert(new_chunk_ptr != 0);
+            assert(new_chunk_ptr <= nvmm_read(&zoneheader->max_zone_size));
+            zoneheader->post_merge_next_level.push(entries, new_chunk_ptr/min_obj_size);
+            merged_chunks = merged_chunks + 2;
         }
 
-        // TODO: Do we need to worry about reading something extra in the last 8 byte read. This problem
-        // shouldn't happen as the max_bitmap_length will be a multiple of 8 always until the last few
-        // levels where it can be less than 8 bytes. In that case, as the merge_bitmap size is way more
-        // than max_bitmap_length and so everything should work fine.
-        uint i;
-        for (i = 0; i<(8 * BYTE); i+=2) {
-            if ((bitmap_data & shift) == shift) {
-                // Merge the buddies to make a larger chunk.
-                new_chunk_ptr = ((BYTE * length) + i) * chunk_size;
-                //printf("New chunk address %ld, length %ld, i %ld\n", new_chunk_ptr, length, i);
-                // As the starting part is always reserved for zone-header, there will
-                // never be a case where new_chunk_ptr is 0.
-                //TODO: Aseert the bitmap and merge bitmap addresses too.
-                assert(new_chunk_ptr != 0);
-                assert(new_chunk_ptr <= nvmm_read(&zoneheader->max_zone_size));
-                //std::cout << "merged: " << new_chunk_ptr/min_obj_size-1 << std::endl;
-                zoneheader->post_merge_next_level.push(header_ptr, new_chunk_ptr/min_obj_size);
-                merged_chunks = merged_chunks + 2;
-            } else {
-                // The buddies are not present. Hence keep the chunk at the same level.
-                if ((bitmap_data >> i) & 1UL) {
-                    // The left buddy is present.
-                    new_chunk_ptr = ((BYTE * length) + i) * chunk_size;
-                } else if ((bitmap_data >> (i + 1)) & 1UL) {
-                    // the right buddy is present.
-                    new_chunk_ptr = (((BYTE * length) + i) + 1 ) * chunk_size;
-                } else {
-                    shift = shift << 2;
-                    continue;
-                }
-                // As the starting part is always reserved for zone-header, there will
-                // never be a case where new_chunk_ptr is 0.
-                assert(new_chunk_ptr != 0);
-                assert(new_chunk_ptr <= nvmm_read(&zoneheader->max_zone_size));
-                //std::cout << "unmerged: " << new_chunk_ptr/min_obj_size-1 << std::endl;
-                zoneheader->post_merge_level.push(header_ptr, new_chunk_ptr/min_obj_size);
-                unmerged_chunks = unmerged_chunks + 1;
-            }
-            shift = shift << 2;
+        // The buddies are not present. Hence keep the chunk at the same level.
+        uint64_t singles = bitmap_buddy_singles(bitmap_data);
+        while (singles) {
+            uint64_t i = (uint64_t)__builtin_ctzl(singles);
+            singles &= singles - 1;
+            // either the left or the right buddy is present
+            if (((bitmap_data >> i) & 1UL) == 0)
+                i++;
+            new_chunk_ptr = (w * ATOMIC_SIZE + i) * chunk_size;
+            assert(new_chunk_ptr != 0);
+            assert(new_chunk_ptr <= nvmm_read(&zoneheader->max_zone_size));
+            zoneheader->post_merge_level.push(entries, new_chunk_ptr/min_obj_size);
+            unmerged_chunks = unmerged_chunks + 1;
         }
-        assert(shift == 0);
-        length = length + 8;
         CrashPoints::CrashHere("merge during 7");
     }
 
@@ -1063,21 +2341,21 @@ void Zone::finish_merge(struct Zone_Header *zoneheader, uint64_t level) {
 
     // Again merge back the chunks to the freelist.
     for(;;) {
-        result = zoneheader->post_merge_next_level.pop(header_ptr);
+        result = zoneheader->post_merge_next_level.pop(entries);
         if (!result) {
             break;
         }
-        zoneheader->free_list[level + 1].push(header_ptr, result);
+        freelist_push(zoneheader, level + 1, result);
     }
 
     CrashPoints::CrashHere("merge during 9");
 
     for(;;) {
-        result = zoneheader->post_merge_level.pop(header_ptr);
+        result = zoneheader->post_merge_level.pop(entries);
         if (!result) {
             break;
         }
-        zoneheader->free_list[level].push(header_ptr, result);
+        freelist_push(zoneheader, level, result);
     }
 
     // zero out the merge bitmap
@@ -1301,35 +2579,40 @@ inline void set_n_bits(void *address, uint64_t offset, uint64_t n) {
     }
 }
 
-// check n bits starting from offset within the byte of address
-// address is always byte-aligned
-inline bool check_n_bits(void *address, uint64_t offset, uint64_t n) {
-    uint8_t *byte_ptr = (uint8_t*)address;
-    while(n>0) {
-        uint64_t to_fill = MIN(BYTE-offset, n);
-        uint8_t mark = (uint8_t)(((1UL << to_fill)-1) << offset);
-        if (((*byte_ptr) & mark) != mark)
-            return false;
-        n-=to_fill;
-        offset = 0;
-        byte_ptr++;
-    }
-    return true;
-}
-
 void Zone::online_recover()
 {
     merge_crash_recovery();
 }
 
-void Zone::offline_recover()
+void Zone::offline_recover(uint64_t threads)
 {
     grow_crash_recovery();
     merge_crash_recovery();
-    garbage_collection();
+    slab_crash_recovery();
+    garbage_collection(MAX(threads, 1UL));
 }
 
-void Zone::garbage_collection()
+// Runs fn over [0, cnt) split into up to threads ranges, each at least
+// min_cnt long and starting at a multiple of align, on threads of their own.
+static void parallel_ranges(uint64_t cnt, uint64_t align, uint64_t min_cnt,
+                            uint64_t threads,
+                            const std::function<void(uint64_t, uint64_t)> &fn)
+{
+    uint64_t per = MAX((cnt + threads - 1) / threads, min_cnt);
+    per = (per + align - 1) / align * align;
+    if (per >= cnt) {
+        fn(0, cnt);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (uint64_t begin = per; begin < cnt; begin += per)
+        workers.push_back(std::thread(fn, begin, MIN(begin + per, cnt)));
+    fn(0, per);
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void Zone::garbage_collection(uint64_t threads)
 {
     /*
       Offline only!
@@ -1369,71 +2652,145 @@ void Zone::garbage_collection()
 
     // 3
     size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
-    uint64_t max_level = nvmm_read(&zoneheader->max_zone_level);
+    // a leaked chunk may not have been zeroed yet (see zero_step())
+    bool fast_alloc = (nvmm_read(&zoneheader->zone_fast_alloc) == 1);
+    // only the part of the zone that has been grown; the rest is handed out by
+    // later grows
+    uint64_t max_level = nvmm_read(&zoneheader->current_zone_level);
 
-    zone_entry *alloc_bitmap_ptr = (zone_entry*)header_ptr;
     uint64_t alloc_bitmap_bit_cnt = (1UL << max_level);
 
     uint8_t *merge_bitmap_ptr = merge_bitmap_start_addr;
     uint64_t merge_bitmap_bit_cnt = (1UL << max_level);
+    uint64_t *merge_bitmap_words = (uint64_t *)merge_bitmap_start_addr;
+    uint64_t merge_bitmap_word_cnt = (merge_bitmap_bit_cnt + ATOMIC_SIZE - 1) / ATOMIC_SIZE;
 
+    /*
+      3.1 and 3.3/3.4 touch disjoint words for disjoint ranges of pairs, so
+      they run on up to threads threads, each on its own range of the merge
+      bitmap; 3.2 walks the freelists on this thread.
+    */
     for(uint64_t level = 0; level<=max_level; level++) {
         uint64_t BIT = (1UL << level);
         size_t chunk_size = find_size_from_level(level, min_obj_size);
+        // ranges hold whole pairs of BITs
+        uint64_t align = MAX(2*BIT/ATOMIC_SIZE, 1UL);
+
         // 3.1
-        for(uint64_t i=0; i < alloc_bitmap_bit_cnt; i+=BIT) {
-            // i=0 is reserved to represent NULL
-            zone_entry entry = alloc_bitmap_ptr[i+1];
-            if (entry.is_allocated() && entry.level() == level) {
-                uint64_t merge_bytepos = i/BYTE, merge_bitpos = i%BYTE;
-                set_n_bits(merge_bitmap_ptr+merge_bytepos, merge_bitpos, BIT);
+        parallel_ranges(merge_bitmap_word_cnt, align, GC_MIN_RANGE_WORDS, threads,
+                        [&](uint64_t begin, uint64_t end) {
+            uint64_t first = begin*ATOMIC_SIZE;
+            uint64_t last = MIN(end*ATOMIC_SIZE, alloc_bitmap_bit_cnt);
+            if (level == 0) {
+                // every entry is a chunk: compare them in bulk
+                // i=0 is reserved to represent NULL
+                zone_entry mask(true, SLAB_LEVEL_FLAG-1), value(true, 0);
+                if (entries.compact)
+                    bitmap_match_entries32((const uint32_t *)entries.base+1+first,
+                                           last-first, mask.pack(), value.pack(),
+                                           merge_bitmap_words+begin);
+                else
+                    bitmap_match_entries((const uint64_t *)entries.base+1+first,
+                                         last-first, (uint64_t)mask, (uint64_t)value,
+                                         merge_bitmap_words+begin);
+                return;
             }
-        }
+            for(uint64_t i=first; i < last; i+=BIT) {
+                // i=0 is reserved to represent NULL
+                zone_entry entry = entries.load(i+1);
+                if (entry.is_allocated() && chunk_level(entry) == level) {
+                    uint64_t merge_bytepos = i/BYTE, merge_bitpos = i%BYTE;
+                    set_n_bits(merge_bitmap_ptr+merge_bytepos, merge_bitpos, BIT);
+                }
+            }
+        });
 
         // 3.2
-        uint64_t next_idx, idx = zoneheader->free_list[level].head;
-        for (;;) {
-            if (idx == 0) {
-                break;
-            }
+        for (uint64_t s = 0; s <= freelist_stripes; s++) {
+            // the lazy list of the level comes last
+            ZoneEntryStack &list = s < freelist_stripes ?
+                freelist(zoneheader, level, s) : zoneheader->lazy_list[level];
+            uint64_t next_idx, idx = list.head;
+            // a crash can leave the count off; set it to what we find
+            int64_t cnt = 0;
+            for (;;) {
+                if (idx == 0) {
+                    list.adjust_count(cnt - list.size());
+                    break;
+                }
+                cnt++;
 
-            zone_entry entry = (zone_entry)fam_atomic_u64_read((uint64_t *)(alloc_bitmap_ptr+idx));
-            next_idx = entry.next();
+                zone_entry entry = entries.load(idx);
+                next_idx = entry.next();
 
-            uint64_t merge_bytepos = (idx-1)/BYTE;
-            uint64_t merge_bitpos = (idx-1)%BYTE;
-            set_n_bits(merge_bitmap_ptr+merge_bytepos, merge_bitpos, BIT);
-            idx = next_idx;
+                uint64_t merge_bytepos = (idx-1)/BYTE;
+                uint64_t merge_bitpos = (idx-1)%BYTE;
+                set_n_bits(merge_bitmap_ptr+merge_bytepos, merge_bitpos, BIT);
+                idx = next_idx;
+            }
         }
 
         // 3.3 && 3.4
-        for(uint64_t i=0; i < merge_bitmap_bit_cnt; i+=2*BIT) {
-            // check two BITs at a time
-            uint64_t merge_bytepos1 = i/BYTE, merge_bitpos1 = i%BYTE;
-            uint64_t merge_bytepos2 = (i+BIT)/BYTE, merge_bitpos2 = (i+BIT)%BYTE;
-            bool res1 = check_n_bits(merge_bitmap_ptr+merge_bytepos1, merge_bitpos1, BIT);
-            bool res2 = check_n_bits(merge_bitmap_ptr+merge_bytepos2, merge_bitpos2, BIT);
-            if (res1==false && res2==true) {
-                Offset ptr = (i/BIT) * chunk_size;
-                LOG(trace) << "push " << i/BIT;
-                zoneheader->free_list[level].push(header_ptr, ptr/min_obj_size);
-                set_n_bits(merge_bitmap_ptr+merge_bytepos1, merge_bitpos1, BIT);
-            }
-            if (res1==true && res2==false) {
-                Offset ptr = (i/BIT+1) * chunk_size;
-                LOG(trace) <<  "push else " << i/BIT +1;
-                zoneheader->free_list[level].push(header_ptr, ptr/min_obj_size);
-                set_n_bits(merge_bitmap_ptr+merge_bytepos2, merge_bitpos2, BIT);
+        // the chunk at the max level has no buddy; checking one would read
+        // (and set) bits past the end of the merge bitmap
+        if (level == max_level)
+            continue;
+        parallel_ranges(merge_bitmap_word_cnt, align, GC_MIN_RANGE_WORDS, threads,
+                        [&](uint64_t begin, uint64_t end) {
+            if (BIT < ATOMIC_SIZE) {
+                // a word holds whole pairs: only words with both 0s and 1s can
+                // hold a pair with a single BIT set
+                uint64_t left_starts = bitmap_group_starts(2*BIT);
+                uint64_t BIT_mask = (1UL << BIT) - 1;
+                for (uint64_t w = bitmap_find_mixed(merge_bitmap_words, begin, end);
+                     w < end;
+                     w = bitmap_find_mixed(merge_bitmap_words, w+1, end)) {
+                    uint64_t full = bitmap_full_groups(merge_bitmap_words[w], BIT);
+                    uint64_t left = full & left_starts;
+                    uint64_t right = (full >> BIT) & left_starts;
+                    uint64_t lost = left ^ right;
+                    while (lost) {
+                        uint64_t b = (uint64_t)__builtin_ctzl(lost);
+                        lost &= lost - 1;
+                        if ((left >> b) & 1UL)
+                            b += BIT; // the right BIT is 0
+                        Offset ptr = ((w*ATOMIC_SIZE + b)/BIT) * chunk_size;
+                        LOG(trace) << "push " << ptr/chunk_size;
+                        if (fast_alloc)
+                            clear_data(ptr, zoneheader, level);
+                        freelist_push(zoneheader, level, ptr/min_obj_size);
+                        merge_bitmap_words[w] |= BIT_mask << b;
+                    }
+                }
+            } else {
+                // a BIT is one or more whole words
+                uint64_t BIT_words = BIT/ATOMIC_SIZE;
+                for (uint64_t w = begin; w < end; w += 2*BIT_words) {
+                    bool res1 = bitmap_find_not_full(merge_bitmap_words, w, w+BIT_words) == w+BIT_words;
+                    bool res2 = bitmap_find_not_full(merge_bitmap_words, w+BIT_words, w+2*BIT_words) == w+2*BIT_words;
+                    if (res1 == res2)
+                        continue;
+                    uint64_t lost_w = res1 ? w+BIT_words : w;
+                    Offset ptr = (lost_w*ATOMIC_SIZE/BIT) * chunk_size;
+                    LOG(trace) << "push " << ptr/chunk_size;
+                    if (fast_alloc)
+                        clear_data(ptr, zoneheader, level);
+                    freelist_push(zoneheader, level, ptr/min_obj_size);
+                    memset(merge_bitmap_words + lost_w, 0xff, BIT_words*sizeof(uint64_t));
+                }
             }
-        }
+        });
     }
 
     // 4
-    for(uint64_t i=0; i < merge_bitmap_bit_cnt; i++) {
-        uint64_t merge_bytepos = i/BYTE, merge_bitpos = i%BYTE;
-        if (check_n_bits(merge_bitmap_ptr+merge_bytepos, merge_bitpos, 1)==false) {
-            printf("WARNING: GC failed!\n");
-        }
+    uint64_t set_bits;
+    if (merge_bitmap_bit_cnt < ATOMIC_SIZE)
+        set_bits = (uint64_t)__builtin_popcountl(merge_bitmap_words[0] &
+                                                 ((1UL << merge_bitmap_bit_cnt) - 1));
+    else
+        set_bits = bitmap_popcount(merge_bitmap_words, merge_bitmap_word_cnt);
+    if (set_bits != merge_bitmap_bit_cnt) {
+        printf("WARNING: GC failed!\n");
     }
 }
 
@@ -1442,4 +2799,68 @@ void Zone::stats() {
     print_freelist();
 }
 
+void Zone::get_stats(ShelfStats *stats, bool exact) {
+    struct Zone_Header *zoneheader = (struct Zone_Header *)zone_header_ptr;
+    size_t min_obj_size = nvmm_read(&zoneheader->min_obj_size);
+    uint64_t grow_level = fam_atomic_u64_read(&zoneheader->current_zone_level);
+    // no walk goes on for longer than the zone has chunks, even if the lists
+    // change under our feet
+    uint64_t units = 1UL << grow_level;
+
+    stats->huge = false;
+    stats->size = nvmm_read(&zoneheader->max_zone_size);
+    stats->grow_level = grow_level;
+    stats->grown_size = find_size_from_level(grow_level, min_obj_size);
+    stats->free_bytes = 0;
+    stats->largest_free_chunk = 0;
+    stats->levels.assign(grow_level + 1, LevelStats());
+
+    for (uint64_t level = 0; level <= grow_level; level++) {
+        LevelStats &ls = stats->levels[level];
+        ls.chunk_size = find_size_from_level(level, min_obj_size);
+        int64_t cnt = 0;
+        for (uint64_t s = 0; s <= freelist_stripes; s++) {
+            // the lazy list of the level comes last
+            ZoneEntryStack &list = s < freelist_stripes ?
+                freelist(zoneheader, level, s) : zoneheader->lazy_list[level];
+            if (!exact) {
+                cnt += list.size();
+                continue;
+            }
+            uint64_t idx = fam_atomic_u64_read(&list.head);
+            for (uint64_t i = 0; idx != 0 && i < units; i++) {
+                cnt++;
+                idx = entries.load(idx).next();
+            }
+        }
+        // the counters of the stripes can be behind one another
+        ls.free_chunks = cnt > 0 ? (uint64_t)cnt : 0;
+        stats->free_bytes += ls.free_chunks * ls.chunk_size;
+        if (ls.free_chunks)
+            stats->largest_free_chunk = ls.chunk_size;
+    }
+
+    if (exact) {
+        // an allocated chunk covers the entries of the units after its own
+        stats->used_bytes = 0;
+        for (uint64_t i = 0; i < units;) {
+            // i=0 is reserved to represent NULL
+            zone_entry entry = entries.load(i+1);
+            if (!entry.is_allocated()) {
+                i++;
+                continue;
+            }
+            uint64_t level = MIN(chunk_level(entry), grow_level);
+            stats->levels[level].used_chunks++;
+            stats->used_bytes += stats->levels[level].chunk_size;
+            i += 1UL << level;
+        }
+    } else {
+        stats->used_bytes = stats->grown_size - MIN(stats->free_bytes, stats->grown_size);
+    }
+
+    stats->fragmentation = stats->free_bytes ?
+        1.0 - (double)stats->largest_free_chunk / (double)stats->free_bytes : 0.0;
+}
+
 }
@@ -30,14 +30,21 @@
 #include <stdint.h>
 
 #include "nvmm/global_ptr.h"
+#include "common/common.h"
+#include "shelf_usage/zone_entry.h"
 
 namespace nvmm {
 
+struct ZoneEntryStack;
+struct ShelfStats;
+
 class Zone {
 public:
   Zone(void *addr, size_t initial_pool_size, size_t min_object_size,
        uint64_t fast_alloc, size_t max_pool_size, void *helper,
-       size_t helper_size);
+       size_t helper_size, uint64_t stripes = 1,
+       const uint64_t *slab_class_sizes = NULL,
+       uint64_t slab_class_size_cnt = 0, bool compact = false);
 
   // Zone(void *addr, size_t initial_pool_size, size_t min_object_size,
   //     size_t max_pool_size, void *helper, size_t helper_size, void
@@ -50,16 +57,86 @@ public:
 
   ~Zone();
 
-  // Static function to return header size
-  static size_t get_header_size(size_t shelf_size, size_t min_obj_size);
+  // Static function to return header size. A compact header packs the
+  // entries into half the space; zones with 2^24 or more min_obj_size units
+  // get a regular one anyway.
+  static size_t get_header_size(size_t shelf_size, size_t min_obj_size,
+                                uint64_t stripes = 1, bool compact = false);
+  // Static function to return the size a zone starts with
+  static size_t get_initial_size(size_t shelf_size, size_t min_obj_size,
+                                 size_t requested_size);
 
   // returns 0 if no blocks are currently available
   Offset alloc(size_t size);
   // [unsafe_]free(0) is a no-op
   void free(Offset block);
+  // sized free: size is what the block was allocated (or last grown) with;
+  // the level comes from it instead of the header entry, which debug builds
+  // check against it
+  void free(Offset block, size_t size);
+  // with eager merge, free() merges a chunk with its free buddy right away
+  // when it can claim the buddy (per process, off by default)
+  void set_eager_merge(bool enable);
+  // the number of bytes an allocated block holds (chunk or slab slot size)
+  size_t block_size(Offset block);
+  // grows an allocated chunk in place to hold size bytes by claiming its
+  // free buddies on the right; returns false, leaving it as it was, if it
+  // cannot (a chunk never shrinks)
+  bool grow_in_place(Offset block, size_t size);
+  // frees count blocks, publishing one chain per level
+  void free_batch(const Offset *blocks, uint64_t count);
+  // allocates up to count chunks of the same size; returns how many
+  uint64_t alloc_batch(size_t size, uint64_t count, Offset *chunks);
+
+  // Batched interface used by the per-thread chunk caches.
+  // Chunks handed out by take_chunks() are neither allocated nor on a
+  // freelist until they go through mark_allocated() or put_chunks(); if the
+  // process dies in between, offline garbage collection reclaims them.
+  uint64_t size_to_level(size_t size);
+  // takes up to count free chunks of the given level; returns how many
+  uint64_t take_chunks(uint64_t level, uint64_t count, Offset *chunks);
+  void mark_allocated(Offset block, uint64_t level);
+  // the first half of free(): returns the level of the released chunk
+  uint64_t release(Offset block);
+  // same as release(), with the level already known
+  void release(Offset block, uint64_t level);
+  void put_chunks(uint64_t level, const Offset *chunks, uint64_t count);
+
+  // Sizes that fit one of the slab size classes the zone was created with
+  // are served from slots of SLAB_SIZE chunks (slabs) instead of chunks of
+  // their own; free() accepts both. merge() returns empty slabs to the zone.
+  bool is_slab_size(size_t size);
+  bool is_slab_slot(Offset block);
+
+  // grows the zone if it has no free chunk of at least watermark bytes;
+  // returns true if a grow was done or is under way
+  bool grow_ahead(size_t watermark);
+  // false if alloc(size) is bound to fail as far as the occupancy summary
+  // can tell; lets callers skip a full zone without its miss path
+  bool may_alloc(size_t size);
+  // true if the occupancy summary has no free chunk of exactly the size, so
+  // alloc(size) would split a larger chunk or grow; false for slab sizes
+  bool must_split(size_t size);
+
+  // Building blocks for an incremental merge scheduler:
+  // the levels whose allocations failed since the last call (bit i = level i)
+  uint64_t take_missed_levels();
+  // the number of chunks on the freelists of a level, counting up to max
+  uint64_t free_chunks(uint64_t level, uint64_t max);
+  // merges the buddies among up to max_chunks chunks of the level; returns
+  // the number of chunks of level+1 it made
+  uint64_t merge_slice(uint64_t level, uint64_t max_chunks);
+
+  // With lazy zeroing (per process, off by default), chunks are zeroed by
+  // zero_step() off the alloc and free paths; it zeroes up to max_bytes and
+  // returns how many bytes it zeroed
+  void set_lazy_zero(bool enable);
+  size_t zero_step(size_t max_bytes);
+
   void merge();
-  void
-  offline_recover(); // grow, merge, and garbage collection; must run offline
+  // grow, merge, and garbage collection; must run offline. The garbage
+  // collection splits the zone into ranges for up to threads threads.
+  void offline_recover(uint64_t threads = 1);
   void online_recover(); // merge; can run online
 
   // TODO
@@ -77,6 +154,7 @@ public:
   Offset PtrToOffset(void *p);
 
   size_t get_bitmap_offset();
+  bool has_compact_header();
 
   // for delayed free
   uint64_t min_obj_size();
@@ -88,17 +166,33 @@ public:
   void print_bitmap();
   void print_freelist();
   void stats();
+  // fills in the zone part of stats (see HeapStats)
+  void get_stats(ShelfStats *stats, bool exact);
 
 private:
   char *shelf_location_ptr;
   char *header_ptr;
   size_t header_size;
+  // the header entries at header_ptr
+  ZoneEntryArray entries;
   char *zone_header_ptr;
   size_t zone_header_size;
 
   // Starting address used for merge bitmap
   uint8_t *merge_bitmap_start_addr;
 
+  // Number of freelist heads per level (copy of the zone header field)
+  uint64_t freelist_stripes;
+
+  bool eager_merge;
+  bool lazy_zero;
+  // levels of failed allocations in this process (see take_missed_levels)
+  uint64_t missed_levels;
+
+  // Slab size classes (copy of the zone header fields)
+  uint64_t slab_class_cnt;
+  uint64_t slab_classes[MAX_SLAB_CLASSES];
+
   // shortcut for from_Offset; does not work well on Zone*:
   //   need (*fba)[ptr] for that case
   void *operator[](Offset p) { return from_Offset(p); }
@@ -121,8 +215,50 @@ private:
   bool merge(struct Zone_Header *zoneheader, uint64_t level);
   void grow_crash_recovery();
   void merge_crash_recovery();
-  void garbage_collection();
+  void garbage_collection(uint64_t threads);
+  uint64_t lazy_chunks(struct Zone_Header *zoneheader, uint64_t level,
+                       uint64_t max);
+  bool flush_lazy_lists(struct Zone_Header *zoneheader);
+  void free_chunk(struct Zone_Header *zoneheader, Offset block,
+                  uint64_t level);
   void clear_data(Offset block, struct Zone_Header *zoneheader, uint64_t level);
+  uint64_t coalesce(struct Zone_Header *zoneheader, Offset &block,
+                    uint64_t level);
+  void put_range(struct Zone_Header *zoneheader, Offset base, uint64_t level,
+                 uint64_t from, uint64_t to);
+  Offset alloc_from_level(struct Zone_Header *zoneheader, uint64_t level,
+                          uint64_t orig_level);
+
+  // all freelist pushes and pops go through these to keep the per-level
+  // occupancy summary up to date
+  void freelist_push(struct Zone_Header *zoneheader, uint64_t level,
+                     uint64_t idx);
+  void freelist_push_released(struct Zone_Header *zoneheader, uint64_t level,
+                              uint64_t idx);
+  uint64_t freelist_pop(struct Zone_Header *zoneheader, uint64_t level);
+  bool freelist_take(struct Zone_Header *zoneheader, uint64_t level,
+                     uint64_t idx);
+  uint64_t freelist_pop_chain(struct Zone_Header *zoneheader, uint64_t level,
+                              uint64_t max, uint64_t *idxes);
+  void freelist_push_chain(struct Zone_Header *zoneheader, uint64_t level,
+                           const uint64_t *idxes, uint64_t cnt);
+  void freelist_push_linked(struct Zone_Header *zoneheader, uint64_t level,
+                            uint64_t first_idx, uint64_t last_idx,
+                            uint64_t cnt);
+  ZoneEntryStack &freelist(struct Zone_Header *zoneheader, uint64_t level,
+                           uint64_t stripe);
+  uint64_t local_stripe();
+  bool level_is_empty(struct Zone_Header *zoneheader, uint64_t level);
+  void mark_level_nonempty(struct Zone_Header *zoneheader, uint64_t level);
+  void mark_level_empty(struct Zone_Header *zoneheader, uint64_t level);
+  void rebuild_level_summary(struct Zone_Header *zoneheader);
+
+  uint64_t find_slab_class(size_t size);
+  Offset slab_alloc(struct Zone_Header *zoneheader, uint64_t slab_class);
+  Offset slab_create(struct Zone_Header *zoneheader, uint64_t slab_class);
+  void slab_free(struct Zone_Header *zoneheader, Offset block);
+  void slab_reclaim(struct Zone_Header *zoneheader);
+  void slab_crash_recovery();
 
   bool enter_merge(struct Zone_Header *zoneheader);
   bool leave_merge(struct Zone_Header *zoneheader);
@@ -0,0 +1,384 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "shelf_usage/zone_bitmap.h"
+
+namespace nvmm {
+
+struct BitmapKernels {
+    uint64_t (*find_nonzero)(const uint64_t *, uint64_t, uint64_t);
+    uint64_t (*find_not_full)(const uint64_t *, uint64_t, uint64_t);
+    uint64_t (*find_mixed)(const uint64_t *, uint64_t, uint64_t);
+    uint64_t (*popcount)(const uint64_t *, uint64_t);
+    void (*match_entries)(const uint64_t *, uint64_t, uint64_t, uint64_t,
+                          uint64_t *);
+    void (*match_entries32)(const uint32_t *, uint64_t, uint32_t, uint32_t,
+                            uint64_t *);
+};
+
+/*
+  Plain C
+*/
+
+static uint64_t scalar_find_nonzero(const uint64_t *words, uint64_t from,
+                                    uint64_t to) {
+    for (; from < to; from++)
+        if (words[from] != 0)
+            break;
+    return from;
+}
+
+static uint64_t scalar_find_not_full(const uint64_t *words, uint64_t from,
+                                     uint64_t to) {
+    for (; from < to; from++)
+        if (words[from] != ~0UL)
+            break;
+    return from;
+}
+
+static uint64_t scalar_find_mixed(const uint64_t *words, uint64_t from,
+                                  uint64_t to) {
+    for (; from < to; from++)
+        if (words[from] != 0 && words[from] != ~0UL)
+            break;
+    return from;
+}
+
+static uint64_t scalar_popcount(const uint64_t *words, uint64_t cnt) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < cnt; i++)
+        total += (uint64_t)__builtin_popcountl(words[i]);
+    return total;
+}
+
+static void scalar_match_entries(const uint64_t *entries, uint64_t cnt,
+                                 uint64_t mask, uint64_t value,
+                                 uint64_t *words) {
+    for (uint64_t i = 0; i < cnt; i += 64) {
+        uint64_t n = cnt - i < 64 ? cnt - i : 64;
+        uint64_t bits = 0;
+        for (uint64_t j = 0; j < n; j++)
+            bits |= (uint64_t)((entries[i + j] & mask) == value) << j;
+        words[i / 64] |= bits;
+    }
+}
+
+static void scalar_match_entries32(const uint32_t *entries, uint64_t cnt,
+                                   uint32_t mask, uint32_t value,
+                                   uint64_t *words) {
+    for (uint64_t i = 0; i < cnt; i += 64) {
+        uint64_t n = cnt - i < 64 ? cnt - i : 64;
+        uint64_t bits = 0;
+        for (uint64_t j = 0; j < n; j++)
+            bits |= (uint64_t)((entries[i + j] & mask) == value) << j;
+        words[i / 64] |= bits;
+    }
+}
+
+static const BitmapKernels scalar_kernels = {
+    scalar_find_nonzero, scalar_find_not_full, scalar_find_mixed,
+    scalar_popcount, scalar_match_entries, scalar_match_entries32,
+};
+
+/*
+  AVX2: 4 words at a time
+*/
+
+// 4 bits, one per word, set where the word is 0 / all ones
+#define AVX2_ZERO_LANES(v)                                                     \
+    _mm256_movemask_pd(_mm256_castsi256_pd(                                    \
+        _mm256_cmpeq_epi64((v), _mm256_setzero_si256())))
+#define AVX2_FULL_LANES(v)                                                     \
+    _mm256_movemask_pd(_mm256_castsi256_pd(                                    \
+        _mm256_cmpeq_epi64((v), _mm256_set1_epi64x(-1))))
+
+__attribute__((target("avx2"))) static uint64_t
+avx2_find_nonzero(const uint64_t *words, uint64_t from, uint64_t to) {
+    for (; from + 4 <= to; from += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + from));
+        unsigned lanes = ~(unsigned)AVX2_ZERO_LANES(v) & 0xF;
+        if (lanes)
+            return from + (uint64_t)__builtin_ctz(lanes);
+    }
+    return scalar_find_nonzero(words, from, to);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+avx2_find_not_full(const uint64_t *words, uint64_t from, uint64_t to) {
+    for (; from + 4 <= to; from += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + from));
+        unsigned lanes = ~(unsigned)AVX2_FULL_LANES(v) & 0xF;
+        if (lanes)
+            return from + (uint64_t)__builtin_ctz(lanes);
+    }
+    return scalar_find_not_full(words, from, to);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+avx2_find_mixed(const uint64_t *words, uint64_t from, uint64_t to) {
+    for (; from + 4 <= to; from += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + from));
+        unsigned lanes =
+            ~(unsigned)(AVX2_ZERO_LANES(v) | AVX2_FULL_LANES(v)) & 0xF;
+        if (lanes)
+            return from + (uint64_t)__builtin_ctz(lanes);
+    }
+    return scalar_find_mixed(words, from, to);
+}
+
+// every CPU with AVX2 has POPCNT, which beats a vector popcount here
+__attribute__((target("avx2,popcnt"))) static uint64_t
+avx2_popcount(const uint64_t *words, uint64_t cnt) {
+    uint64_t total0 = 0, total1 = 0, total2 = 0, total3 = 0;
+    uint64_t i = 0;
+    for (; i + 4 <= cnt; i += 4) {
+        total0 += (uint64_t)__builtin_popcountl(words[i]);
+        total1 += (uint64_t)__builtin_popcountl(words[i + 1]);
+        total2 += (uint64_t)__builtin_popcountl(words[i + 2]);
+        total3 += (uint64_t)__builtin_popcountl(words[i + 3]);
+    }
+    for (; i < cnt; i++)
+        total0 += (uint64_t)__builtin_popcountl(words[i]);
+    return total0 + total1 + total2 + total3;
+}
+
+__attribute__((target("avx2"))) static void
+avx2_match_entries(const uint64_t *entries, uint64_t cnt, uint64_t mask,
+                   uint64_t value, uint64_t *words) {
+    __m256i m = _mm256_set1_epi64x((long long)mask);
+    __m256i v = _mm256_set1_epi64x((long long)value);
+    uint64_t i = 0;
+    for (; i + 64 <= cnt; i += 64) {
+        uint64_t bits = 0;
+        for (uint64_t j = 0; j < 64; j += 4) {
+            __m256i e = _mm256_loadu_si256((const __m256i *)(entries + i + j));
+            __m256i eq = _mm256_cmpeq_epi64(_mm256_and_si256(e, m), v);
+            bits |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << j;
+        }
+        words[i / 64] |= bits;
+    }
+    scalar_match_entries(entries + i, cnt - i, mask, value, words + i / 64);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_match_entries32(const uint32_t *entries, uint64_t cnt, uint32_t mask,
+                     uint32_t value, uint64_t *words) {
+    __m256i m = _mm256_set1_epi32((int)mask);
+    __m256i v = _mm256_set1_epi32((int)value);
+    uint64_t i = 0;
+    for (; i + 64 <= cnt; i += 64) {
+        uint64_t bits = 0;
+        for (uint64_t j = 0; j < 64; j += 8) {
+            __m256i e = _mm256_loadu_si256((const __m256i *)(entries + i + j));
+            __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(e, m), v);
+            bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << j;
+        }
+        words[i / 64] |= bits;
+    }
+    scalar_match_entries32(entries + i, cnt - i, mask, value, words + i / 64);
+}
+
+static const BitmapKernels avx2_kernels = {
+    avx2_find_nonzero, avx2_find_not_full, avx2_find_mixed,
+    avx2_popcount, avx2_match_entries, avx2_match_entries32,
+};
+
+/*
+  AVX-512: 8 words at a time
+*/
+
+__attribute__((target("avx512f"))) static uint64_t
+avx512_find_nonzero(const uint64_t *words, uint64_t from, uint64_t to) {
+    for (; from + 8 <= to; from += 8) {
+        __m512i v = _mm512_loadu_si512((const void *)(words + from));
+        __mmask8 lanes = _mm512_test_epi64_mask(v, v);
+        if (lanes)
+            return from + (uint64_t)__builtin_ctz(lanes);
+    }
+    return scalar_find_nonzero(words, from, to);
+}
+
+__attribute__((target("avx512f"))) static uint64_t
+avx512_find_not_full(const uint64_t *words, uint64_t from, uint64_t to) {
+    __m512i ones = _mm512_set1_epi64(-1);
+    for (; from + 8 <= to; from += 8) {
+        __m512i v = _mm512_loadu_si512((const void *)(words + from));
+        __mmask8 lanes = _mm512_cmpneq_epi64_mask(v, ones);
+        if (lanes)
+            return from + (uint64_t)__builtin_ctz(lanes);
+    }
+    return scalar_find_not_full(words, from, to);
+}
+
+__attribute__((target("avx512f"))) static uint64_t
+avx512_find_mixed(const uint64_t *words, uint64_t from, uint64_t to) {
+    __m512i ones = _mm512_set1_epi64(-1);
+    for (; from + 8 <= to; from += 8) {
+        __m512i v = _mm512_loadu_si512((const void *)(words + from));
+        __mmask8 lanes = (__mmask8)(_mm512_test_epi64_mask(v, v) &
+                                    _mm512_cmpneq_epi64_mask(v, ones));
+        if (lanes)
+            return from + (uint64_t)__builtin_ctz(lanes);
+    }
+    return scalar_find_mixed(words, from, to);
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_match_entries(const uint64_t *entries, uint64_t cnt, uint64_t mask,
+                     uint64_t value, uint64_t *words) {
+    __m512i m = _mm512_set1_epi64((long long)mask);
+    __m512i v = _mm512_set1_epi64((long long)value);
+    uint64_t i = 0;
+    for (; i + 64 <= cnt; i += 64) {
+        uint64_t bits = 0;
+        for (uint64_t j = 0; j < 64; j += 8) {
+            __m512i e = _mm512_loadu_si512((const void *)(entries + i + j));
+            __mmask8 eq = _mm512_cmpeq_epi64_mask(_mm512_and_si512(e, m), v);
+            bits |= (uint64_t)eq << j;
+        }
+        words[i / 64] |= bits;
+    }
+    scalar_match_entries(entries + i, cnt - i, mask, value, words + i / 64);
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_match_entries32(const uint32_t *entries, uint64_t cnt, uint32_t mask,
+                       uint32_t value, uint64_t *words) {
+    __m512i m = _mm512_set1_epi32((int)mask);
+    __m512i v = _mm512_set1_epi32((int)value);
+    uint64_t i = 0;
+    for (; i + 64 <= cnt; i += 64) {
+        uint64_t bits = 0;
+        for (uint64_t j = 0; j < 64; j += 16) {
+            __m512i e = _mm512_loadu_si512((const void *)(entries + i + j));
+            __mmask16 eq = _mm512_cmpeq_epi32_mask(_mm512_and_si512(e, m), v);
+            bits |= (uint64_t)eq << j;
+        }
+        words[i / 64] |= bits;
+    }
+    scalar_match_entries32(entries + i, cnt - i, mask, value, words + i / 64);
+}
+
+static const BitmapKernels avx512_kernels = {
+    avx512_find_nonzero, avx512_find_not_full, avx512_find_mixed,
+    avx2_popcount, avx512_match_entries, avx512_match_entries32,
+};
+
+/*
+  Dispatch
+*/
+
+static bool cpu_supports(BitmapKernel kernel) {
+    switch (kernel) {
+    case BITMAP_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    case BITMAP_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("popcnt");
+    case BITMAP_KERNEL_SCALAR:
+        return true;
+    }
+    return false;
+}
+
+static BitmapKernel best_kernel() {
+    if (cpu_supports(BITMAP_KERNEL_AVX512))
+        return BITMAP_KERNEL_AVX512;
+    if (cpu_supports(BITMAP_KERNEL_AVX2))
+        return BITMAP_KERNEL_AVX2;
+    return BITMAP_KERNEL_SCALAR;
+}
+
+static BitmapKernel &current_kernel() {
+    static BitmapKernel kernel = best_kernel();
+    return kernel;
+}
+
+static const BitmapKernels &kernels() {
+    switch (current_kernel()) {
+    case BITMAP_KERNEL_AVX512:
+        return avx512_kernels;
+    case BITMAP_KERNEL_AVX2:
+        return avx2_kernels;
+    case BITMAP_KERNEL_SCALAR:
+        break;
+    }
+    return scalar_kernels;
+}
+
+BitmapKernel bitmap_kernel() { return current_kernel(); }
+
+const char *bitmap_kernel_name(BitmapKernel kernel) {
+    switch (kernel) {
+    case BITMAP_KERNEL_AVX512:
+        return "avx512";
+    case BITMAP_KERNEL_AVX2:
+        return "avx2";
+    case BITMAP_KERNEL_SCALAR:
+        break;
+    }
+    return "scalar";
+}
+
+bool bitmap_set_kernel(BitmapKernel kernel) {
+    if (!cpu_supports(kernel))
+        return false;
+    current_kernel() = kernel;
+    return true;
+}
+
+uint64_t bitmap_find_nonzero(const uint64_t *words, uint64_t from, uint64_t to) {
+    return kernels().find_nonzero(words, from, to);
+}
+
+uint64_t bitmap_find_not_full(const uint64_t *words, uint64_t from,
+                              uint64_t to) {
+    return kernels().find_not_full(words, from, to);
+}
+
+uint64_t bitmap_find_mixed(const uint64_t *words, uint64_t from, uint64_t to) {
+    return kernels().find_mixed(words, from, to);
+}
+
+uint64_t bitmap_popcount(const uint64_t *words, uint64_t cnt) {
+    return kernels().popcount(words, cnt);
+}
+
+void bitmap_match_entries(const uint64_t *entries, uint64_t cnt, uint64_t mask,
+                          uint64_t value, uint64_t *words) {
+    kernels().match_entries(entries, cnt, mask, value, words);
+}
+
+void bitmap_match_entries32(const uint32_t *entries, uint64_t cnt,
+                            uint32_t mask, uint32_t value, uint64_t *words) {
+    kernels().match_entries32(entries, cnt, mask, value, words);
+}
+
+} // namespace nvmm
@@ -0,0 +1,102 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#ifndef _NVMM_ZONE_BITMAP_H_
+#define _NVMM_ZONE_BITMAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nvmm {
+
+/**
+ ** Bulk kernels for the bitmaps and header entries scanned by merge and
+ ** garbage collection
+ **
+ ** A bitmap is an array of 64-bit words; bit i lives in word i/64 at bit
+ ** i%64. The kernels are picked at runtime from the best one the CPU
+ ** supports (AVX-512, AVX2, or plain C); all of them give the same results.
+ **/
+enum BitmapKernel {
+    BITMAP_KERNEL_SCALAR = 0,
+    BITMAP_KERNEL_AVX2,
+    BITMAP_KERNEL_AVX512,
+};
+
+// the kernel in use and its name
+BitmapKernel bitmap_kernel();
+const char *bitmap_kernel_name(BitmapKernel kernel);
+// switches kernels (for testing); returns false if the CPU does not support it
+bool bitmap_set_kernel(BitmapKernel kernel);
+
+// return the index of the first word in [from, to) that is not 0, not all
+// ones, or neither; to if there is none
+uint64_t bitmap_find_nonzero(const uint64_t *words, uint64_t from, uint64_t to);
+uint64_t bitmap_find_not_full(const uint64_t *words, uint64_t from, uint64_t to);
+uint64_t bitmap_find_mixed(const uint64_t *words, uint64_t from, uint64_t to);
+
+// the number of set bits in cnt words
+uint64_t bitmap_popcount(const uint64_t *words, uint64_t cnt);
+
+// sets bit i of words for every entries[i] with (entries[i] & mask) == value
+void bitmap_match_entries(const uint64_t *entries, uint64_t cnt, uint64_t mask,
+                          uint64_t value, uint64_t *words);
+// same, for the 32-bit entries of compact headers
+void bitmap_match_entries32(const uint32_t *entries, uint64_t cnt,
+                            uint32_t mask, uint32_t value, uint64_t *words);
+
+/*
+  Word-level helpers for buddy pairs. Chunks of n bits (n a power of two up to
+  32) are aligned to n, and the buddies of a pair to 2n.
+*/
+
+// a bit at every multiple of n
+inline uint64_t bitmap_group_starts(uint64_t n) {
+    uint64_t mask = 0;
+    for (uint64_t i = 0; i < 64; i += n)
+        mask |= 1UL << i;
+    return mask;
+}
+
+// a bit at the start of every chunk of n bits that has all of its bits set
+inline uint64_t bitmap_full_groups(uint64_t word, uint64_t n) {
+    for (uint64_t s = 1; s < n; s <<= 1)
+        word &= word >> s;
+    return word & bitmap_group_starts(n);
+}
+
+// a bit at the left buddy of every pair of single bits that are both set
+inline uint64_t bitmap_buddy_pairs(uint64_t word) {
+    return word & (word >> 1) & 0x5555555555555555UL;
+}
+
+// a bit at the left buddy of every pair that has only one of its bits set
+inline uint64_t bitmap_buddy_singles(uint64_t word) {
+    return (word ^ (word >> 1)) & 0x5555555555555555UL;
+}
+
+} // namespace nvmm
+
+#endif
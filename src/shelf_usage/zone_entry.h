@@ -30,6 +30,8 @@
 #include <stdint.h>
 #include <assert.h>
 
+#include "nvmm/fam.h"
+
 namespace nvmm {
 
 struct zone_entry {
@@ -66,6 +68,17 @@ struct zone_entry {
     	value = val;
     }
 
+    // The 32-bit form of compact headers keeps the alloc bit and the level
+    // in the top byte and has 24 bits left for the next index
+    static const uint64_t compact_next_limit = (1UL<<24);
+    uint32_t pack() {
+	assert(get_next() < compact_next_limit);
+	return ((uint32_t)(value >> 32) & 0xFF000000U) | (uint32_t)get_next();
+    }
+    static zone_entry unpack(uint32_t val) {
+	return zone_entry(((uint64_t)(val & 0xFF000000U) << 32) | (val & 0xFFFFFFU));
+    }
+
 private:
     uint64_t value;
 
@@ -102,5 +115,32 @@ private:
     }
 };
 
+/*
+  The header entries of a zone, one per min_obj_size unit (idx 0 is reserved
+  for the empty stack, so the entry of unit i is at idx i+1). A compact header
+  stores each of them in 32 bits (see zone_entry::pack) instead of 64.
+ */
+struct ZoneEntryArray {
+    ZoneEntryArray() : base(NULL), compact(false) {}
+    ZoneEntryArray(void *base, bool compact) : base(base), compact(compact) {}
+
+    zone_entry load(uint64_t idx) const {
+	if (compact)
+	    return zone_entry::unpack(fam_atomic_u32_read((uint32_t*)base + idx));
+	return zone_entry(fam_atomic_u64_read((uint64_t*)base + idx));
+    }
+    void store(uint64_t idx, zone_entry entry) const {
+	if (compact)
+	    fam_atomic_u32_write((uint32_t*)base + idx, entry.pack());
+	else
+	    fam_atomic_u64_write((uint64_t*)base + idx, (uint64_t)entry);
+    }
+    // bytes per entry
+    size_t entry_size() const { return compact ? sizeof(uint32_t) : sizeof(uint64_t); }
+
+    void *base;
+    bool compact;
+};
+
 }
 #endif
@@ -39,13 +39,17 @@
 
 namespace nvmm {
 
-void ZoneEntryStack::push(void *addr, uint64_t idx_) {
+void ZoneEntryStack::push(const ZoneEntryArray &entries, uint64_t idx_) {
+    // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+    push(entries, idx_, entries.load(idx_ + 1));
+}
+
+void ZoneEntryStack::push(const ZoneEntryArray &entries, uint64_t idx_,
+                          uint64_t entry_) {
     // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
     uint64_t idx = idx_+1;
 
-    uint64_t* entry_ptr = (uint64_t*)addr + idx;
-    // TODO: can we avoid this atomic read? maybe we should pass in the zone_entry value?
-    zone_entry entry = (zone_entry)fam_atomic_u64_read(entry_ptr);
+    zone_entry entry = (zone_entry)entry_;
 
     uint64_t old[2], store[2], result[2];
     // would non-atomic reads be faster here?
@@ -53,20 +57,22 @@ void ZoneEntryStack::push(void *addr, uint64_t idx_) {
     for (;;) {
         entry.link_next(old[0]);
         // would an atomic write be faster here?
-        fam_atomic_u64_write(entry_ptr, (uint64_t)entry);
+        entries.store(idx, entry);
 
         store[0] = idx;
         store[1] = old[1] + 1;
         fam_atomic_u128_compare_and_store(&head, old, store, result);
-        if (result[0]==old[0] && result[1]==old[1])
+        if (result[0]==old[0] && result[1]==old[1]) {
+            adjust_count(1);
             return;
+        }
 
         old[0] = result[0];
         old[1] = result[1];
     }
 }
 
-uint64_t ZoneEntryStack::pop(void *addr) {
+uint64_t ZoneEntryStack::pop(const ZoneEntryArray &entries) {
     uint64_t old[2], store[2], result[2];
     // would non-atomic reads be faster here?
     fam_atomic_u128_read(&head, old);
@@ -76,15 +82,16 @@ uint64_t ZoneEntryStack::pop(void *addr) {
         if (idx == 0)
             break;
 
-        uint64_t* entry_ptr = (uint64_t*)addr + idx;
         // would an atomic read be faster here?
-        zone_entry entry = (zone_entry)fam_atomic_u64_read(entry_ptr);
+        zone_entry entry = entries.load(idx);
 
         store[0] = entry.next();
         store[1] = old[1] + 1;
         fam_atomic_u128_compare_and_store(&head, old, store, result);
-        if (result[0]==old[0] && result[1]==old[1])
+        if (result[0]==old[0] && result[1]==old[1]) {
+            adjust_count(-1);
             return idx-1;
+        }
 
         old[0] = result[0];
         old[1] = result[1];
@@ -93,5 +100,110 @@ uint64_t ZoneEntryStack::pop(void *addr) {
     return 0;
 }
 
+bool ZoneEntryStack::pop_if_head(const ZoneEntryArray &entries, uint64_t idx_) {
+    // idx 0 is reserved for empty stack so all actual idxes are shifted right by 1
+    uint64_t idx = idx_+1;
+
+    uint64_t old[2], store[2], result[2];
+    fam_atomic_u128_read(&head, old);
+    for (;;) {
+        if (old[0] != idx)
+            return false;
+
+        zone_entry entry = entries.load(idx);
+
+        store[0] = entry.next();
+        store[1] = old[1] + 1;
+        fam_atomic_u128_compare_and_store(&head, old, store, result);
+        if (result[0]==old[0] && result[1]==old[1]) {
+            adjust_count(-1);
+            return true;
+        }
+
+        old[0] = result[0];
+        old[1] = result[1];
+    }
+}
+
+uint64_t ZoneEntryStack::pop_chain(const ZoneEntryArray &entries, uint64_t max,
+                                   uint64_t *idxes) {
+    uint64_t old[2], store[2], result[2];
+    fam_atomic_u128_read(&head, old);
+    for (;;) {
+        // walk up to max entries from the head we observed; if anyone pushes
+        // or pops in the meantime, the aba counter changes and the CAS below
+        // fails, so a chain cut out of a stale view is never published
+        uint64_t cnt = 0;
+        uint64_t idx = old[0];
+        while (idx != 0 && cnt < max) {
+            zone_entry entry = entries.load(idx);
+            idxes[cnt++] = idx-1;
+            idx = entry.next();
+        }
+        if (cnt == 0)
+            break;
+
+        store[0] = idx;
+        store[1] = old[1] + 1;
+        fam_atomic_u128_compare_and_store(&head, old, store, result);
+        if (result[0]==old[0] && result[1]==old[1]) {
+            adjust_count(-(int64_t)cnt);
+            return cnt;
+        }
+
+        old[0] = result[0];
+        old[1] = result[1];
+    }
+
+    return 0;
+}
+
+void ZoneEntryStack::push_chain(const ZoneEntryArray &entries,
+                                const uint64_t *idxes, uint64_t cnt) {
+    if (cnt == 0)
+        return;
+
+    // the chain is private until it is published, so link it up front
+    for (uint64_t i = 0; i + 1 < cnt; i++) {
+        zone_entry entry = entries.load(idxes[i] + 1);
+        entry.link_next(idxes[i+1] + 1);
+        entries.store(idxes[i] + 1, entry);
+    }
+
+    push_linked(entries, idxes[0], idxes[cnt-1], cnt);
+}
+
+void ZoneEntryStack::push_linked(const ZoneEntryArray &entries,
+                                 uint64_t first_idx, uint64_t last_idx,
+                                 uint64_t cnt) {
+    uint64_t first = first_idx + 1;
+    zone_entry last = entries.load(last_idx + 1);
+
+    uint64_t old[2], store[2], result[2];
+    fam_atomic_u128_read(&head, old);
+    for (;;) {
+        last.link_next(old[0]);
+        entries.store(last_idx + 1, last);
+
+        store[0] = first;
+        store[1] = old[1] + 1;
+        fam_atomic_u128_compare_and_store(&head, old, store, result);
+        if (result[0]==old[0] && result[1]==old[1]) {
+            adjust_count((int64_t)cnt);
+            return;
+        }
+
+        old[0] = result[0];
+        old[1] = result[1];
+    }
+}
+
+int64_t ZoneEntryStack::size() {
+    return (int64_t)fam_atomic_u64_read(&count);
+}
+
+void ZoneEntryStack::adjust_count(int64_t delta) {
+    fam_atomic_u64_fetch_and_add(&count, (uint64_t)delta);
+}
 
 }
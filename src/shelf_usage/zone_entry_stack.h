@@ -32,6 +32,7 @@
 
 #include "nvmm/global_ptr.h"
 #include "shelf_usage/smart_shelf.h"
+#include "shelf_usage/zone_entry.h"
 
 namespace nvmm {
 
@@ -42,13 +43,17 @@ namespace nvmm {
  **
  ** The blocks pushed on the stack must be cache line aligned, at
  ** least a cache line long, and not accessed by anyone else while on
- ** the stack.  They must also all belong to the same Shelf, which must
+ ** the stack.  They are linked through their header entries, which must
  ** be passed to pop and push.
  **/
 struct ZoneEntryStack {
     // we access the following two fields atomically via 128-bit CAS:
     uint64_t head __attribute__ ((aligned (16)));
     uint64_t aba_counter;  // incremented each time head is written
+    // Number of blocks on the stack, kept by the operations below right
+    // after their CAS; an estimate while others push and pop, after a crash,
+    // and for stacks whose head is also written directly
+    uint64_t count;
     //
     // The ZoneEntryStack head (Freelist head) is of 16 bytes. The head of next 
     // freelist level will be stacked at head + 16. Accessing of two freelist heads 
@@ -56,11 +61,34 @@ struct ZoneEntryStack {
     // contain four freelist heads in the same Cacheline. Add a padding to prevent 
     // the Cacheline contention.
     //  
-    char ZoneEntryStackPadding[kCacheLineSize-(sizeof(head)+sizeof(aba_counter))];
+    char ZoneEntryStackPadding[kCacheLineSize-(sizeof(head)+sizeof(aba_counter)+sizeof(count))];
 
     // returns 0 if stack is empty
-    uint64_t pop (void *addr);
-    void push(void *addr, uint64_t idx);
+    uint64_t pop (const ZoneEntryArray &entries);
+    void push(const ZoneEntryArray &entries, uint64_t idx);
+    // same as push(), for a block whose header entry the caller already
+    // knows (alloc bit and level); saves the read of the entry
+    void push(const ZoneEntryArray &entries, uint64_t idx, uint64_t entry);
+
+    // pops idx only if it is at the top of the stack; returns true if it did
+    bool pop_if_head(const ZoneEntryArray &entries, uint64_t idx);
+
+    // pops up to max chunks with a single CAS on the head and stores their
+    // idxes in idxes; returns the number of chunks popped (0 if stack is empty)
+    uint64_t pop_chain(const ZoneEntryArray &entries, uint64_t max,
+                       uint64_t *idxes);
+    // links cnt chunks together and pushes them with a single CAS on the head
+    void push_chain(const ZoneEntryArray &entries, const uint64_t *idxes,
+                    uint64_t cnt);
+    // pushes a chain of cnt blocks the caller has already linked from first
+    // to last with a single CAS on the head
+    void push_linked(const ZoneEntryArray &entries, uint64_t first_idx,
+                     uint64_t last_idx, uint64_t cnt);
+
+    // the count as a signed number (see count)
+    int64_t size();
+    // adds delta to the count, for callers that write the head directly
+    void adjust_count(int64_t delta);
 
 private:
     ZoneEntryStack(const ZoneEntryStack&);              // disable copying
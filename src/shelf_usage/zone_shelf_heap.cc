@@ -54,12 +54,19 @@ ShelfHeap::~ShelfHeap() {
     }
 }
 
-size_t ShelfHeap::get_header_size(size_t shelf_size, size_t min_obj_size) {
-    return Zone::get_header_size(shelf_size, min_obj_size);
+size_t ShelfHeap::get_header_size(size_t shelf_size, size_t min_obj_size,
+                                  uint64_t freelist_stripes,
+                                  bool compact_header) {
+    return Zone::get_header_size(shelf_size, min_obj_size, freelist_stripes,
+                                 compact_header);
 }
 
 ErrorCode ShelfHeap::Create(size_t zone_size, void *helper, size_t helper_size,
-                            size_t min_alloc_size, uint64_t fast_alloc) {
+                            size_t min_alloc_size, uint64_t fast_alloc,
+                            uint64_t freelist_stripes,
+                            const uint64_t *slab_classes,
+                            uint64_t slab_class_cnt, size_t initial_size,
+                            bool compact_header, int numa_node) {
     assert(IsOpen() == false);
     assert(shelf_.Exist() == true);
 
@@ -78,11 +85,17 @@ ErrorCode ShelfHeap::Create(size_t zone_size, void *helper, size_t helper_size,
         return ret;
     }
 
+    // place the pages before anything touches them
+    (void)numa_bind(addr_, zone_size, numa_node);
+
     // create zone layout
     // TODO: this will fail if the shelf file already exists; if the file exists
     // and it is already inited, it will fail
-    Zone *zone = new Zone(addr_, zone_size, min_alloc_size, fast_alloc,
-                          zone_size, helper, helper_size);
+    size_t initial_zone_size =
+        Zone::get_initial_size(zone_size, min_alloc_size, initial_size);
+    Zone *zone = new Zone(addr_, initial_zone_size, min_alloc_size, fast_alloc,
+                          zone_size, helper, helper_size, freelist_stripes,
+                          slab_classes, slab_class_cnt, compact_header);
     delete zone;
 
     ret = UnmapCloseShelf();
@@ -123,6 +136,11 @@ ErrorCode ShelfHeap::SetPermission(mode_t mode) {
     return shelf_.SetPermission(mode);
 }
 
+void ShelfHeap::Bind(int numa_node) {
+    assert(IsOpen() == true);
+    (void)numa_bind(addr_, Size(), numa_node);
+}
+
 ErrorCode ShelfHeap::Verify() {
     assert(IsOpen() == false);
     ErrorCode ret = NO_ERROR;
@@ -206,6 +224,122 @@ void ShelfHeap::Free(Offset offset) {
     LOG(trace) << "ShelfHeap::Free " << offset;
 }
 
+void ShelfHeap::Free(Offset offset, size_t size) {
+    assert(IsOpen() == true);
+    zone_->free(offset, size);
+    LOG(trace) << "ShelfHeap::Free " << offset << " size " << size;
+}
+
+size_t ShelfHeap::AllocBatch(size_t size, size_t count, Offset *offsets) {
+    assert(IsOpen() == true);
+    size_t cnt = (size_t)zone_->alloc_batch(size, count, offsets);
+    LOG(trace) << "ShelfHeap::AllocBatch " << cnt << " of " << count;
+    return cnt;
+}
+
+void ShelfHeap::FreeBatch(const Offset *offsets, size_t count) {
+    assert(IsOpen() == true);
+    zone_->free_batch(offsets, count);
+    LOG(trace) << "ShelfHeap::FreeBatch " << count;
+}
+
+uint64_t ShelfHeap::SizeToLevel(size_t size) {
+    assert(IsOpen() == true);
+    return zone_->size_to_level(size);
+}
+
+uint64_t ShelfHeap::TakeChunks(uint64_t level, uint64_t count,
+                               Offset *chunks) {
+    assert(IsOpen() == true);
+    return zone_->take_chunks(level, count, chunks);
+}
+
+void ShelfHeap::MarkAllocated(Offset offset, uint64_t level) {
+    assert(IsOpen() == true);
+    zone_->mark_allocated(offset, level);
+}
+
+uint64_t ShelfHeap::Release(Offset offset) {
+    assert(IsOpen() == true);
+    return zone_->release(offset);
+}
+
+void ShelfHeap::Release(Offset offset, uint64_t level) {
+    assert(IsOpen() == true);
+    zone_->release(offset, level);
+}
+
+void ShelfHeap::PutChunks(uint64_t level, const Offset *chunks,
+                          uint64_t count) {
+    assert(IsOpen() == true);
+    zone_->put_chunks(level, chunks, count);
+}
+
+void ShelfHeap::SetEagerMerge(bool enable) {
+    assert(IsOpen() == true);
+    zone_->set_eager_merge(enable);
+}
+
+size_t ShelfHeap::BlockSize(Offset offset) {
+    assert(IsOpen() == true);
+    return zone_->block_size(offset);
+}
+
+bool ShelfHeap::GrowInPlace(Offset offset, size_t size) {
+    assert(IsOpen() == true);
+    return zone_->grow_in_place(offset, size);
+}
+
+void ShelfHeap::SetLazyZero(bool enable) {
+    assert(IsOpen() == true);
+    zone_->set_lazy_zero(enable);
+}
+
+size_t ShelfHeap::ZeroStep(size_t max_bytes) {
+    assert(IsOpen() == true);
+    return zone_->zero_step(max_bytes);
+}
+
+bool ShelfHeap::GrowAhead(size_t watermark) {
+    assert(IsOpen() == true);
+    return zone_->grow_ahead(watermark);
+}
+
+bool ShelfHeap::MayAlloc(size_t size) {
+    assert(IsOpen() == true);
+    return zone_->may_alloc(size);
+}
+
+bool ShelfHeap::MustSplit(size_t size) {
+    assert(IsOpen() == true);
+    return zone_->must_split(size);
+}
+
+uint64_t ShelfHeap::TakeMissedLevels() {
+    assert(IsOpen() == true);
+    return zone_->take_missed_levels();
+}
+
+uint64_t ShelfHeap::FreeChunks(uint64_t level, uint64_t max) {
+    assert(IsOpen() == true);
+    return zone_->free_chunks(level, max);
+}
+
+uint64_t ShelfHeap::MergeSlice(uint64_t level, uint64_t max_chunks) {
+    assert(IsOpen() == true);
+    return zone_->merge_slice(level, max_chunks);
+}
+
+bool ShelfHeap::IsSlabSize(size_t size) {
+    assert(IsOpen() == true);
+    return zone_->is_slab_size(size);
+}
+
+bool ShelfHeap::IsSlabSlot(Offset offset) {
+    assert(IsOpen() == true);
+    return zone_->is_slab_slot(offset);
+}
+
 bool ShelfHeap::IsValidOffset(Offset offset) {
     assert(IsOpen() == true);
     return zone_->IsValidOffset(offset);
@@ -301,9 +435,9 @@ void ShelfHeap::Merge() {
     zone_->merge();
 }
 
-void ShelfHeap::OfflineRecover() {
+void ShelfHeap::OfflineRecover(uint64_t threads) {
     assert(IsOpen() == true);
-    zone_->offline_recover();
+    zone_->offline_recover(threads);
 }
 
 void ShelfHeap::OnlineRecover() {
@@ -316,11 +450,21 @@ void ShelfHeap::Stats() {
     zone_->stats();
 }
 
+void ShelfHeap::GetStats(ShelfStats *stats, bool exact) {
+    assert(IsOpen() == true);
+    zone_->get_stats(stats, exact);
+}
+
 size_t ShelfHeap::get_bitmap_offset() {
     assert(IsOpen() == true);
     return zone_->get_bitmap_offset();
 }
 
+bool ShelfHeap::HasCompactHeader() {
+    assert(IsOpen() == true);
+    return zone_->has_compact_header();
+}
+
 ErrorCode ShelfHeap::Map(Offset offset, size_t size, void *addr_hint, int prot,
                          void **mapped_addr) {
     ErrorCode ret = NO_ERROR;
@@ -32,11 +32,13 @@
 
 #include "nvmm/error_code.h"
 #include "nvmm/global_ptr.h"
+#include "common/numa.h"
 #include "shelf_mgmt/shelf_file.h"
 
 namespace nvmm {
 
 class Zone;
+struct ShelfStats;
 
 class ShelfHeap {
   public:
@@ -47,11 +49,18 @@ class ShelfHeap {
     ~ShelfHeap();
 
     ErrorCode Create(size_t size, void *helper, size_t helper_size,
-                     size_t min_alloc_size, uint64_t fast_alloc);
+                     size_t min_alloc_size, uint64_t fast_alloc,
+                     uint64_t freelist_stripes = 1,
+                     const uint64_t *slab_classes = NULL,
+                     uint64_t slab_class_cnt = 0,
+                     size_t initial_size = 0, bool compact_header = false,
+                     int numa_node = kNumaNone);
     ErrorCode Destroy();
     ErrorCode Verify();
     ErrorCode Recover();
     ErrorCode SetPermission(mode_t mode);
+    // applies the node placement of Create to this mapping (see numa_bind)
+    void Bind(int numa_node);
 
     bool IsOpen() const { return is_open_; }
 
@@ -62,6 +71,30 @@ class ShelfHeap {
 
     Offset Alloc(size_t size);
     void Free(Offset offset);
+    // see Zone::free(Offset, size_t)
+    void Free(Offset offset, size_t size);
+    // see Zone::set_eager_merge
+    void SetEagerMerge(bool enable);
+    // see Zone::block_size and Zone::grow_in_place
+    size_t BlockSize(Offset offset);
+    bool GrowInPlace(Offset offset, size_t size);
+    // see Zone::set_lazy_zero and Zone::zero_step
+    void SetLazyZero(bool enable);
+    size_t ZeroStep(size_t max_bytes);
+    size_t AllocBatch(size_t size, size_t count, Offset *offsets);
+    void FreeBatch(const Offset *offsets, size_t count);
+
+    // batched interface for the per-thread chunk caches (see Zone)
+    uint64_t SizeToLevel(size_t size);
+    uint64_t TakeChunks(uint64_t level, uint64_t count, Offset *chunks);
+    void MarkAllocated(Offset offset, uint64_t level);
+    uint64_t Release(Offset offset);
+    void Release(Offset offset, uint64_t level);
+    void PutChunks(uint64_t level, const Offset *chunks, uint64_t count);
+
+    // slab sizes and slots bypass the per-thread chunk caches (see Zone)
+    bool IsSlabSize(size_t size);
+    bool IsSlabSlot(Offset offset);
 
     bool IsValidOffset(Offset offset);
     bool IsValidPtr(void *addr);
@@ -69,17 +102,33 @@ class ShelfHeap {
     void *OffsetToPtr(Offset offset) const;
     Offset PtrToOffset(void *addr) const;
     size_t get_bitmap_offset();
-
+    // see Zone::get_header_size
+    bool HasCompactHeader();
+
+    // grows the zone ahead of demand (see Zone::grow_ahead)
+    bool GrowAhead(size_t watermark);
+    // see Zone::may_alloc
+    bool MayAlloc(size_t size);
+    // see Zone::must_split
+    bool MustSplit(size_t size);
+    // incremental merge (see Zone)
+    uint64_t TakeMissedLevels();
+    uint64_t FreeChunks(uint64_t level, uint64_t max);
+    uint64_t MergeSlice(uint64_t level, uint64_t max_chunks);
     void Merge();
-    void OfflineRecover();
+    void OfflineRecover(uint64_t threads = 1);
     void OnlineRecover();
 
     void Stats();
+    // see Zone::get_stats
+    void GetStats(ShelfStats *stats, bool exact);
     ErrorCode Map(Offset offset, size_t size, void *addr_hint, int prot,
                   void **mapped_addr);
     ErrorCode Unmap(Offset offset, void *mapped_addr, size_t size);
 
-    static size_t get_header_size(size_t shelf_size, size_t min_obj_size);
+    static size_t get_header_size(size_t shelf_size, size_t min_obj_size,
+                                  uint64_t freelist_stripes = 1,
+                                  bool compact_header = false);
 
     ErrorCode MarkInvalid();
 
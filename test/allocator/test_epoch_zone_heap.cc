@@ -24,7 +24,15 @@
  */
 
 #include <unistd.h> // sleep
+#include <linux/mempolicy.h> // MPOL_*
+#include <sys/syscall.h> // get_mempolicy
+#include <sys/wait.h> // waitpid
+#include <string.h> // memset
+#include <algorithm>
 #include <list>
+#include <map>
+#include <mutex>
+#include <set>
 #include <random>
 #include <limits>
 #include <vector>
@@ -33,6 +41,9 @@
 
 #include <gtest/gtest.h>
 #include "nvmm/memory_manager.h"
+#include "common/config.h"
+#include "common/numa.h"
+#include "shelf_usage/zone.h"
 #include "test_common/test.h"
 
 using namespace nvmm;
@@ -698,13 +709,14 @@ TEST(EpochZoneHeap, DelayedFreeResize) {
     {
         EpochOp op(em);
         std::cout << "final epoch " << op.reported_epoch() << std::endl;
-        // Alloc should from first shelf. Verify.
+        // Both chunks are free again. This thread starts at the shelf it
+        // allocated from last, so the next shelf comes first. Verify.
         GlobalPtr ptr2 = heap->Alloc(op, alloc_size);
-        EXPECT_EQ(ptr1, ptr2);
+        EXPECT_EQ(ptr3, ptr2);
 
-        // Alloc should from next shelf. Verify.
+        // Alloc should from first shelf. Verify.
         GlobalPtr ptr4 = heap->Alloc(op, alloc_size);
-        EXPECT_EQ(ptr3, ptr4);        
+        EXPECT_EQ(ptr1, ptr4);
         heap->Free(ptr2);
         heap->Free(ptr4);
     }
@@ -1294,6 +1306,1519 @@ TEST(EpochZoneHeap, NoDelayedFree) {
     EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
 }
 
+// batched allocation
+TEST(EpochZoneHeap, AllocBatch) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open());
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // small objects: carved out of larger chunks
+    size_t cnt = 10000;
+    std::vector<GlobalPtr> ptrs(cnt);
+    EXPECT_EQ(cnt, heap->AllocBatch(100, cnt, ptrs.data()));
+    std::set<GlobalPtr> distinct;
+    for (auto ptr : ptrs) {
+        EXPECT_TRUE(ptr.IsValid());
+        EXPECT_EQ(0UL, ptr.GetOffset() % 128);
+        EXPECT_TRUE(distinct.insert(ptr).second);
+        char *local = (char *)mm->GlobalToLocal(ptr);
+        for (size_t i = 0; i < 128; i++)
+            EXPECT_EQ(0, local[i]);
+        memset(local, 1, 128);
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+
+    // more 8MB objects than the heap can hold
+    std::vector<GlobalPtr> big(32);
+    size_t big_cnt = heap->AllocBatch(8 * 1024 * 1024, big.size(), big.data());
+    EXPECT_LT(0UL, big_cnt);
+    EXPECT_GT(16UL, big_cnt);
+    distinct.clear();
+    for (size_t i = 0; i < big_cnt; i++) {
+        EXPECT_TRUE(big[i].IsValid());
+        EXPECT_TRUE(distinct.insert(big[i]).second);
+    }
+    for (size_t i = 0; i < big_cnt; i++)
+        heap->Free(big[i]);
+
+    // everything was given back
+    heap->Merge();
+    GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+// batched free, immediate and delayed
+TEST(EpochZoneHeap, FreeBatch) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // mixed sizes, so that the chunks land on different levels
+    size_t cnt = 3000;
+    std::vector<GlobalPtr> ptrs;
+    for (size_t i = 0; i < cnt; i++) {
+        GlobalPtr ptr = heap->Alloc(rand_uint64(1, 16384));
+        EXPECT_TRUE(ptr.IsValid());
+        ptrs.push_back(ptr);
+    }
+    heap->FreeBatch(ptrs.data(), ptrs.size());
+
+    // the freed chunks are available again right away
+    std::set<GlobalPtr> freed(ptrs.begin(), ptrs.end());
+    GlobalPtr ptr = heap->Alloc(16384);
+    EXPECT_TRUE(freed.count(ptr) == 1);
+    heap->Free(ptr);
+
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // delayed: the chunks stay allocated until the delayed free lists are
+    // drained
+    EXPECT_EQ(cnt, heap->AllocBatch(1024, cnt, ptrs.data()));
+    {
+        EpochOp op(em);
+        heap->FreeBatch(op, ptrs.data(), ptrs.size());
+    }
+    freed = std::set<GlobalPtr>(ptrs.begin(), ptrs.end());
+    for (size_t i = 0; i < 100; i++) {
+        ptr = heap->Alloc(1024);
+        EXPECT_TRUE(freed.count(ptr) == 0);
+        heap->Free(ptr);
+    }
+    heap->OfflineFree();
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+// allocations only pop from the levels the occupancy summary marks non-empty
+TEST(EpochZoneHeap, LevelSummary) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // every allocation of a new size drains the levels below the one it
+    // splits, so the summary goes through many set/clear transitions
+    std::vector<GlobalPtr> ptrs;
+    for (size_t round = 0; round < 4; round++) {
+        for (size_t obj_size = min_obj_size; obj_size <= 1024 * 1024;
+             obj_size *= 2) {
+            GlobalPtr ptr = heap->Alloc(obj_size);
+            EXPECT_TRUE(ptr.IsValid());
+            ptrs.push_back(ptr);
+        }
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+    ptrs.clear();
+
+    // the summary is rebuilt from the freelists on open
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    for (size_t i = 0; i < 1000; i++) {
+        GlobalPtr ptr = heap->Alloc(rand_uint64(1, 65536));
+        EXPECT_TRUE(ptr.IsValid());
+        ptrs.push_back(ptr);
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+
+    heap->Merge();
+    GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+void StripedAllocFree(Heap *heap, int cnt) {
+    std::vector<GlobalPtr> ptrs;
+    for (int i = 0; i < cnt; i++) {
+        GlobalPtr ptr = heap->Alloc(rand_uint64(1, 4096));
+        EXPECT_TRUE(ptr.IsValid());
+        ptrs.push_back(ptr);
+        if (rand_uint64(0, 1)) {
+            heap->Free(ptrs.back());
+            ptrs.pop_back();
+        }
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+}
+
+// freelists with several heads per level
+TEST(EpochZoneHeap, StripedFreelists) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    int thread_cnt = 8;
+    int loop_cnt = 2000;
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap; the stripe count only matters at creation
+    uint64_t stripes = config.FreelistStripes;
+    config.FreelistStripes = 16;
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    config.FreelistStripes = stripes;
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < thread_cnt; i++) {
+        workers.push_back(std::thread(StripedAllocFree, heap, loop_cnt));
+    }
+    for (auto &worker : workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // merging walks every stripe, so the largest free chunk (64MB) comes back
+    heap->Merge();
+    GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // new shelves use the stripe count the heap was created with
+    EXPECT_EQ(NO_ERROR, heap->Resize(size * 2));
+    StripedAllocFree(heap, loop_cnt);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // recovery walks every stripe as well
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+void CachedAllocFree(Heap *heap, int cnt, std::set<GlobalPtr> *allocated,
+                     std::mutex *allocated_mutex) {
+    std::vector<GlobalPtr> ptrs;
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < cnt; i++) {
+            GlobalPtr ptr = heap->Alloc(rand_uint64(1, 4096));
+            EXPECT_TRUE(ptr.IsValid());
+            ptrs.push_back(ptr);
+        }
+        {
+            // no chunk may be handed out twice
+            std::lock_guard<std::mutex> lock(*allocated_mutex);
+            for (auto ptr : ptrs)
+                EXPECT_TRUE(allocated->insert(ptr).second);
+            for (auto ptr : ptrs)
+                allocated->erase(ptr);
+        }
+        for (auto ptr : ptrs)
+            heap->Free(ptr);
+        ptrs.clear();
+    }
+    // the chunks still cached by this thread are returned when it exits
+}
+
+// per-thread chunk caches
+TEST(EpochZoneHeap, ThreadCache) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    int thread_cnt = 8;
+    int loop_cnt = 1000;
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_THREAD_CACHE));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // immediate free still hands the same chunk back
+    GlobalPtr ptr = heap->Alloc(sizeof(int));
+    heap->Free(ptr);
+    GlobalPtr ptr1 = heap->Alloc(sizeof(int));
+    EXPECT_EQ(ptr, ptr1);
+    heap->Free(ptr1);
+
+    std::set<GlobalPtr> allocated;
+    std::mutex allocated_mutex;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < thread_cnt; i++) {
+        workers.push_back(std::thread(CachedAllocFree, heap, loop_cnt,
+                                      &allocated, &allocated_mutex));
+    }
+    for (auto &worker : workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // the exited threads gave back their chunks, so merging restores the
+    // largest free chunk (64MB)
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // the chunks cached by this thread are returned by Close
+    for (int i = 0; i < loop_cnt; i++) {
+        heap->Free(heap->Alloc(rand_uint64(1, 4096)));
+    }
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    EXPECT_EQ(NO_ERROR, heap->Open());
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, SlabAlloc) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    size_t cnt = 2000;
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap with the default slab size classes (80, 96, ..., 1792)
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size, 64, NVMM_SLAB_ALLOC));
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // 80-byte and 320-byte objects are packed into slots of their size
+    std::vector<GlobalPtr> ptrs;
+    std::map<Offset, size_t> extents;
+    for (size_t i = 0; i < cnt; i++) {
+        size_t obj_size = (i % 2) ? 320 : 80;
+        GlobalPtr ptr = heap->Alloc(obj_size);
+        EXPECT_TRUE(ptr.IsValid());
+        char *local = (char *)mm->GlobalToLocal(ptr);
+        for (size_t j = 0; j < obj_size; j++)
+            EXPECT_EQ(0, local[j]);
+        memset(local, 0xff, obj_size);
+        ptrs.push_back(ptr);
+        extents[ptr.GetOffset()] = obj_size;
+    }
+    EXPECT_EQ(cnt, extents.size());
+    size_t packed = 0;
+    for (auto it = extents.begin(); std::next(it) != extents.end(); it++) {
+        Offset next = std::next(it)->first;
+        EXPECT_LE(it->first + it->second, next);
+        if (it->second == 80 && next == it->first + 80)
+            packed++;
+    }
+    EXPECT_GT(packed, cnt / 4);
+
+    // free half of them through the delayed free lists, which round the
+    // offsets down to min_obj_size, and the other half directly
+    {
+        EpochOp op(em);
+        for (size_t i = 0; i < cnt; i += 2)
+            heap->Free(op, ptrs[i]);
+    }
+    for (size_t i = 1; i < cnt; i += 2)
+        heap->Free(ptrs[i]);
+    heap->OfflineFree();
+
+    // freed slots are reused and zeroed again
+    GlobalPtr ptr = heap->Alloc(80);
+    EXPECT_TRUE(extents.count(ptr.GetOffset()) == 1);
+    char *local = (char *)mm->GlobalToLocal(ptr);
+    for (size_t j = 0; j < 80; j++)
+        EXPECT_EQ(0, local[j]);
+
+    // the slab of a live slot survives recovery and merge
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    GlobalPtr ptr2 = heap->Alloc(80);
+    EXPECT_NE(ptr, ptr2);
+    heap->Free(ptr);
+    heap->Free(ptr2);
+
+    // empty slabs go back to the zone on merge
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, Grow) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap whose zone starts at 1MB and grows on demand
+    uint64_t initial_size = config.ZoneInitialSize;
+    config.ZoneInitialSize = 1024 * 1024;
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    config.ZoneInitialSize = initial_size;
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // allocations grow the zone level by level; the grown halves start
+    // right after the old zone
+    GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    std::set<GlobalPtr> ptrs;
+    for (size_t i = 0; i < 1000; i++) {
+        ptr = heap->Alloc(rand_uint64(1, 65536));
+        EXPECT_TRUE(ptr.IsValid());
+        EXPECT_TRUE(ptrs.insert(ptr).second);
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+    ptrs.clear();
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // the garbage collection only covers the grown part of the zone
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    EXPECT_FALSE(heap->Alloc(1048576 * min_obj_size).IsValid());
+    heap->Free(ptr);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // the background worker grows new shelves ahead of demand
+    uint64_t watermark = config.GrowWatermark;
+    config.ZoneInitialSize = 1024 * 1024;
+    config.GrowWatermark = 16 * 1024 * 1024;
+    EXPECT_EQ(NO_ERROR, heap->Open());
+    EXPECT_EQ(NO_ERROR, heap->Resize(size * 2));
+    config.ZoneInitialSize = initial_size;
+    usleep(500000);
+    for (size_t i = 0; i < 1000; i++) {
+        ptr = heap->Alloc(rand_uint64(1, 65536));
+        EXPECT_TRUE(ptr.IsValid());
+        EXPECT_TRUE(ptrs.insert(ptr).second);
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    config.GrowWatermark = watermark;
+
+    // destroy the heap
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, EagerMerge) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    int thread_cnt = 8;
+    int loop_cnt = 2000;
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap; with a single stripe every buddy freed last is claimable
+    uint64_t stripes = config.FreelistStripes;
+    config.FreelistStripes = 1;
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    config.FreelistStripes = stripes;
+
+    // get the heap
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD | NVMM_EAGER_MERGE));
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // freeing in the reverse order undoes every split without a merge
+    std::vector<GlobalPtr> ptrs;
+    for (size_t i = 0; i < 1000; i++) {
+        GlobalPtr ptr = heap->Alloc(rand_uint64(1, 65536));
+        EXPECT_TRUE(ptr.IsValid());
+        ptrs.push_back(ptr);
+    }
+    for (auto it = ptrs.rbegin(); it != ptrs.rend(); it++)
+        heap->Free(*it);
+    ptrs.clear();
+    GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+
+    // concurrent frees coalesce what they can; merge() picks up the rest
+    std::vector<std::thread> workers;
+    for (int i = 0; i < thread_cnt; i++) {
+        workers.push_back(std::thread(StripedAllocFree, heap, loop_cnt));
+    }
+    for (auto &worker : workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    heap->Free(ptr);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // recovery finds no leaks or duplicates
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    EXPECT_FALSE(heap->Alloc(1048576 * min_obj_size).IsValid());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, MergeScheduler) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+
+    // get the heap, with the background worker
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open());
+
+    uint64_t min_obj_size = heap->MinAllocSize();
+    size_t chunk_size = 1024 * min_obj_size;
+
+    // split the whole zone into small chunks and free them in random order
+    std::vector<GlobalPtr> ptrs;
+    for (;;) {
+        GlobalPtr ptr = heap->Alloc(chunk_size);
+        if (!ptr.IsValid())
+            break;
+        ptrs.push_back(ptr);
+    }
+    EXPECT_LE(size / chunk_size - 1, ptrs.size()); // offset 0 is reserved
+    std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(1));
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+
+    // once the delayed frees are done, the failed allocations get the
+    // background worker to merge the small chunks back together
+    GlobalPtr ptr;
+    for (int i = 0; i < 200 && !ptr.IsValid(); i++) {
+        ptr = heap->Alloc(1048576 * min_obj_size);
+        if (!ptr.IsValid())
+            usleep(100000);
+    }
+    EXPECT_TRUE(ptr.IsValid());
+    heap->Free(ptr);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // recovery finds no leaks or duplicates
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    EXPECT_FALSE(heap->Alloc(1048576 * min_obj_size).IsValid());
+    heap->Free(ptr);
+
+    // destroy the heap
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, LazyZero) {
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    size_t chunk_size = 1024 * 1024;    // 1 MB
+    size_t cnt = 32;
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+
+    // zero on alloc, and zero on free (fast alloc)
+    for (uint64_t create_flags : {0UL, (uint64_t)NVMM_FAST_ALLOC}) {
+        PoolId pool_id = 1;
+        Heap *heap = NULL;
+        EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size, 64, create_flags));
+        EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+        EXPECT_EQ(NO_ERROR, heap->Open(NVMM_LAZY_ZERO));
+
+        // dirty some chunks and free them
+        std::vector<GlobalPtr> ptrs;
+        for (size_t i = 0; i < cnt; i++) {
+            GlobalPtr ptr = heap->Alloc(chunk_size);
+            EXPECT_TRUE(ptr.IsValid());
+            memset(mm->GlobalToLocal(ptr), 0xAB, chunk_size);
+            ptrs.push_back(ptr);
+        }
+        for (auto ptr : ptrs)
+            heap->Free(ptr);
+        ptrs.clear();
+
+        // give the background worker a few rounds to free and zero them
+        usleep(1000000);
+
+        // whether they were zeroed ahead of time or not, chunks come back
+        // zeroed
+        for (size_t i = 0; i < 2 * cnt; i++) {
+            GlobalPtr ptr = heap->Alloc(chunk_size);
+            EXPECT_TRUE(ptr.IsValid());
+            char *local = (char *)mm->GlobalToLocal(ptr);
+            for (size_t j = 0; j < chunk_size; j++) {
+                if (local[j] != 0) {
+                    ADD_FAILURE() << "chunk " << ptr.GetOffset()
+                                  << " is dirty at byte " << j;
+                    break;
+                }
+            }
+            memset(local, 0xAB, chunk_size);
+            ptrs.push_back(ptr);
+        }
+        for (auto ptr : ptrs)
+            heap->Free(ptr);
+        EXPECT_EQ(NO_ERROR, heap->Close());
+
+        // recovery finds no leaks or duplicates, and the chunks that were
+        // still waiting to be zeroed come back zeroed as well
+        EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+        heap->OfflineRecover();
+        heap->Merge();
+        size_t min_obj_size = heap->MinAllocSize();
+        GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+        EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+        heap->Free(ptr);
+        ptrs.clear();
+        for (;;) {
+            ptr = heap->Alloc(chunk_size);
+            if (!ptr.IsValid())
+                break;
+            char *local = (char *)mm->GlobalToLocal(ptr);
+            EXPECT_EQ(0, local[0]);
+            EXPECT_EQ(0, local[chunk_size - 1]);
+            ptrs.push_back(ptr);
+        }
+        EXPECT_LE(size / chunk_size - 1, ptrs.size()); // offset 0 is reserved
+        for (auto ptr : ptrs)
+            heap->Free(ptr);
+
+        EXPECT_EQ(NO_ERROR, heap->Close());
+        delete heap;
+        EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    }
+}
+
+// allocates chunks of the size until the heap runs out, frees them, and
+// merges; returns how many it got
+size_t CountChunks(Heap *heap, size_t size) {
+    std::vector<GlobalPtr> ptrs;
+    heap->Merge();
+    for (;;) {
+        GlobalPtr ptr = heap->Alloc(size);
+        if (!ptr.IsValid())
+            break;
+        ptrs.push_back(ptr);
+    }
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+    heap->Merge();
+    return ptrs.size();
+}
+
+TEST(EpochZoneHeap, ParallelRecover) {
+    PoolId pool_id = 1;
+    // big enough for the garbage collection to split the zone into ranges
+    size_t size = 1024 * 1024 * 1024LLU; // 1 GB
+    int alloc_cnt = 1000;
+    EpochManager *em = EpochManager::GetInstance();
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    // create a heap
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+
+    // how many 1 MB chunks the heap has
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    size_t chunk_size = 16384 * heap->MinAllocSize();
+    size_t chunk_cnt = CountChunks(heap, chunk_size);
+    EXPECT_LT(0UL, chunk_cnt);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    delete heap;
+
+    // a process that dies with chunks in its thread cache leaks them; it
+    // sends what it did allocate back to us
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    em->Stop();
+    pid_t pid = fork();
+    ASSERT_LE(0, pid);
+    if (pid == 0) {
+        close(fds[0]);
+        em->Start();
+        EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+        EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD | NVMM_THREAD_CACHE));
+        for (int i = 0; i < alloc_cnt; i++) {
+            uint64_t ptr = heap->Alloc(rand_uint64(1, 16384)).ToUINT64();
+            EXPECT_EQ((ssize_t)sizeof(ptr), write(fds[1], &ptr, sizeof(ptr)));
+        }
+        _exit(0); // no cleanup, just like a crash
+    }
+    close(fds[1]);
+    std::vector<GlobalPtr> ptrs;
+    uint64_t ptr_value;
+    while (read(fds[0], &ptr_value, sizeof(ptr_value)) == sizeof(ptr_value))
+        ptrs.push_back(GlobalPtr(ptr_value));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    em->Start();
+    EXPECT_EQ((size_t)alloc_cnt, ptrs.size());
+
+    // recover on several threads
+    uint64_t threads = config.RecoveryThreads;
+    config.RecoveryThreads = 4;
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    config.RecoveryThreads = threads;
+
+    // once the allocated chunks are freed, the heap is back to where it
+    // started: nothing leaked and nothing was handed back twice
+    for (auto ptr : ptrs)
+        heap->Free(ptr);
+    EXPECT_EQ(chunk_cnt, CountChunks(heap, chunk_size));
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // destroy the heap
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, HugeAlloc) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU;          // 128 MB
+    size_t huge_size = 96 * 1024 * 1024LLU + 1;  // rounds up to 96 MB + 1 page
+    size_t page_size = (size_t)getpagesize();
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    uint64_t threshold = config.HugeAllocThreshold;
+    config.HugeAllocThreshold = 64 * 1024 * 1024LLU;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open());
+
+    // huge objects get shelves of their own, from the top down, and leave
+    // the zone alone
+    GlobalPtr huge1 = heap->Alloc(huge_size);
+    GlobalPtr huge2 = heap->Alloc(huge_size);
+    EXPECT_TRUE(huge1.IsValid());
+    EXPECT_TRUE(huge2.IsValid());
+    EXPECT_EQ(ShelfId::kMaxShelfCount - 1, huge1.GetShelfId().GetShelfIndex());
+    EXPECT_EQ(ShelfId::kMaxShelfCount - 2, huge2.GetShelfId().GetShelfIndex());
+    EXPECT_EQ(size, heap->Size());
+    GlobalPtr small = heap->Alloc(size / 2);
+    EXPECT_EQ(1, small.GetShelfId().GetShelfIndex());
+    heap->Free(small);
+
+    // the objects are zeroed and page-rounded
+    char *local = (char *)mm->GlobalToLocal(huge1);
+    EXPECT_EQ(0, local[0]);
+    EXPECT_EQ(0, local[huge_size - 1]);
+    memset(local, 0xAB, (huge_size + page_size - 1) / page_size * page_size);
+
+    // a freed huge object gives its shelf back, and the next object on that
+    // shelf does not see the old one
+    heap->Free(huge1);
+    huge1 = heap->Alloc(huge_size);
+    EXPECT_EQ(ShelfId::kMaxShelfCount - 1, huge1.GetShelfId().GetShelfIndex());
+    local = (char *)mm->GlobalToLocal(huge1);
+    EXPECT_EQ(0, local[0]);
+    memset(local, 0xCD, huge_size);
+
+    // the delayed free of a huge object waits for the epochs like any other
+    {
+        EpochOp op(em);
+        heap->Free(op, huge2);
+    }
+    GlobalPtr ptr;
+    for (int i = 0; i < 100; i++) {
+        {
+            EpochOp op(em);
+        }
+        ptr = heap->Alloc(huge_size);
+        if (ptr.GetShelfId().GetShelfIndex() == ShelfId::kMaxShelfCount - 2)
+            break;
+        heap->Free(ptr);
+        usleep(100000);
+    }
+    EXPECT_EQ(ShelfId::kMaxShelfCount - 2, ptr.GetShelfId().GetShelfIndex());
+    heap->Free(ptr);
+
+    // the zone still resizes from the bottom up
+    EXPECT_EQ(NO_ERROR, heap->Resize(2 * size));
+    EXPECT_EQ(2 * size, heap->Size());
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // the huge objects survive recovery
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    local = (char *)mm->GlobalToLocal(huge1);
+    EXPECT_EQ((char)0xCD, local[0]);
+    EXPECT_EQ((char)0xCD, local[huge_size - 1]);
+    heap->Free(huge1);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    config.HugeAllocThreshold = threshold;
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, Realloc) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    // take the free right halves the first split left on each level, so
+    // the next object comes from the left end of a fresh 4MB chunk
+    std::vector<GlobalPtr> fillers;
+    for (size_t s = min_obj_size; s <= 2 * 1024 * 1024; s *= 2)
+        fillers.push_back(heap->Alloc(s));
+
+    // the right halves of the split are free, so the object grows in place
+    GlobalPtr ptr = heap->Alloc(4096);
+    EXPECT_EQ(0U, ptr.GetOffset() % (1024 * 1024));
+    memset(mm->GlobalToLocal(ptr), 0xAB, 4096);
+    for (size_t new_size = 8192; new_size <= 1024 * 1024; new_size *= 2) {
+        GlobalPtr grown = heap->Realloc(ptr, new_size);
+        EXPECT_EQ(ptr, grown);
+        ptr = grown;
+        char *local = (char *)mm->GlobalToLocal(grown);
+        EXPECT_EQ((char)0xAB, local[0]);
+        EXPECT_EQ((char)0xAB, local[4095]);
+        EXPECT_EQ(0, local[4096]);
+        EXPECT_EQ(0, local[new_size - 1]);
+    }
+    // shrinking keeps the object where it is
+    EXPECT_EQ(ptr, heap->Realloc(ptr, 100));
+
+    // an allocated buddy makes it move
+    GlobalPtr buddy = heap->Alloc(1024 * 1024);
+    EXPECT_EQ(ptr.GetOffset() + 1024 * 1024, buddy.GetOffset());
+    GlobalPtr moved = heap->Realloc(ptr, 2 * 1024 * 1024);
+    EXPECT_TRUE(moved.IsValid());
+    EXPECT_NE(ptr, moved);
+    char *local = (char *)mm->GlobalToLocal(moved);
+    EXPECT_EQ((char)0xAB, local[0]);
+    EXPECT_EQ((char)0xAB, local[4095]);
+    EXPECT_EQ(0, local[4096]);
+
+    // no room: the object stays where it is
+    EXPECT_FALSE(heap->Realloc(moved, 2 * size).IsValid());
+    EXPECT_EQ((char)0xAB, local[0]);
+
+    // realloc of nothing is alloc
+    GlobalPtr fresh = heap->Realloc(GlobalPtr(), 4096);
+    EXPECT_TRUE(fresh.IsValid());
+
+    heap->Free(fresh);
+    heap->Free(moved);
+    heap->Free(buddy);
+    for (auto filler : fillers)
+        heap->Free(filler);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // recovery finds no leaks or duplicates
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    EXPECT_FALSE(heap->Alloc(1048576 * min_obj_size).IsValid());
+    heap->Free(ptr);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+TEST(EpochZoneHeap, SizedFree) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    size_t sizes[] = {1, 100, 4096, 5000, 1024 * 1024};
+    const int cnt = sizeof(sizes) / sizeof(sizes[0]);
+    GlobalPtr ptrs[cnt];
+
+    // a sized free puts the chunk back on the freelist of its level
+    for (int i = 0; i < cnt; i++)
+        ptrs[i] = heap->Alloc(sizes[i]);
+    for (int i = 0; i < cnt; i++)
+        heap->Free(ptrs[i], sizes[i]);
+    for (int i = 0; i < cnt; i++) {
+        GlobalPtr ptr = heap->Alloc(sizes[i]);
+        EXPECT_EQ(ptrs[i], ptr);
+    }
+
+    // and so does the delayed one, once its epoch has passed
+    {
+        EpochOp op(em);
+        for (int i = 0; i < cnt; i++)
+            heap->Free(op, ptrs[i], sizes[i]);
+    }
+    heap->OfflineFree();
+    for (int i = 0; i < cnt; i++) {
+        GlobalPtr ptr = heap->Alloc(sizes[i]);
+        EXPECT_EQ(ptrs[i], ptr);
+        heap->Free(ptr, sizes[i]);
+    }
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    // recovery finds no leaks or duplicates
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    heap->Merge();
+    GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+    EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+    EXPECT_FALSE(heap->Alloc(1048576 * min_obj_size).IsValid());
+    heap->Free(ptr);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+// compact (32-bit) and regular zone header entries
+TEST(EpochZoneHeap, CompactHeader) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    uint64_t min_obj_size = 64;
+
+    // a compact header is smaller, unless the zone has too many units for it
+    EXPECT_LT(Zone::get_header_size(size, min_obj_size, 1, true),
+              Zone::get_header_size(size, min_obj_size, 1, false));
+    EXPECT_EQ(Zone::get_header_size(1LLU << 40, min_obj_size, 1, true),
+              Zone::get_header_size(1LLU << 40, min_obj_size, 1, false));
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    bool compact_header = config.CompactZoneHeader;
+    for (bool compact : {true, false}) {
+        Heap *heap = NULL;
+
+        // the format is picked at creation; Open ignores the setting
+        config.CompactZoneHeader = compact;
+        EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+        config.CompactZoneHeader = !compact;
+        EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+        EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+        min_obj_size = heap->MinAllocSize();
+
+        std::vector<GlobalPtr> ptrs;
+        for (int i = 0; i < 1000; i++) {
+            GlobalPtr ptr = heap->Alloc(rand_uint64(1, 64 * 1024));
+            EXPECT_TRUE(ptr.IsValid());
+            ptrs.push_back(ptr);
+        }
+        {
+            EpochOp op(em);
+            for (size_t i = 0; i < ptrs.size(); i += 2)
+                heap->Free(op, ptrs[i]);
+        }
+        for (size_t i = 1; i < ptrs.size(); i += 2)
+            heap->Free(ptrs[i]);
+        heap->OfflineFree();
+        heap->Merge();
+        GlobalPtr ptr = heap->Alloc(1048576 * min_obj_size);
+        EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+        EXPECT_FALSE(heap->Alloc(1048576 * min_obj_size).IsValid());
+        heap->Free(ptr);
+
+        // leak a few chunks for the garbage collection to find
+        for (int i = 0; i < 100; i++)
+            EXPECT_TRUE(heap->Alloc(rand_uint64(1, 4096)).IsValid());
+        EXPECT_EQ(NO_ERROR, heap->Resize(size * 2));
+        EXPECT_TRUE(heap->Alloc(size / 2).IsValid());
+        EXPECT_EQ(NO_ERROR, heap->Close());
+
+        EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+        heap->OfflineRecover();
+        heap->Merge();
+        ptr = heap->Alloc(1048576 * min_obj_size);
+        EXPECT_EQ(1048576 * min_obj_size, ptr.GetOffset());
+        heap->Free(ptr);
+        EXPECT_EQ(NO_ERROR, heap->Close());
+
+        delete heap;
+        EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    }
+    config.CompactZoneHeader = compact_header;
+}
+
+// the free chunk counters agree with a walk of the freelists
+void ExpectSameFreeChunks(Heap *heap) {
+    HeapStats cheap, exact;
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&cheap));
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&exact, true));
+    EXPECT_FALSE(cheap.exact);
+    EXPECT_TRUE(exact.exact);
+    ASSERT_EQ(exact.shelves.size(), cheap.shelves.size());
+    for (size_t i = 0; i < exact.shelves.size(); i++) {
+        ASSERT_EQ(exact.shelves[i].levels.size(), cheap.shelves[i].levels.size());
+        for (size_t level = 0; level < exact.shelves[i].levels.size(); level++)
+            EXPECT_EQ(exact.shelves[i].levels[level].free_chunks,
+                      cheap.shelves[i].levels[level].free_chunks);
+    }
+    EXPECT_EQ(exact.free_bytes, cheap.free_bytes);
+    EXPECT_EQ(exact.used_bytes, cheap.used_bytes);
+    EXPECT_EQ(exact.delayed_free_chunks, cheap.delayed_free_chunks);
+}
+
+// heap statistics
+TEST(EpochZoneHeap, GetStats) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+    size_t huge_size = 96 * 1024 * 1024LLU;
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    uint64_t threshold = config.HugeAllocThreshold;
+    config.HugeAllocThreshold = 64 * 1024 * 1024LLU;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    uint64_t min_obj_size = heap->MinAllocSize();
+
+    HeapStats stats;
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats, true));
+    ASSERT_EQ(1U, stats.shelves.size());
+    EXPECT_EQ(1, stats.shelves[0].shelf_idx);
+    EXPECT_FALSE(stats.shelves[0].huge);
+    EXPECT_EQ(stats.grown_size, stats.free_bytes + stats.used_bytes);
+    EXPECT_EQ(stats.shelves[0].grow_level + 1, stats.shelves[0].levels.size());
+    EXPECT_EQ(0U, stats.delayed_free_chunks);
+    size_t base_used = stats.used_bytes;
+    double base_fragmentation = stats.fragmentation;
+    ExpectSameFreeChunks(heap);
+
+    // bytes in use go up by the chunk sizes
+    std::vector<GlobalPtr> ptrs;
+    size_t used = 0;
+    for (int i = 0; i < 1000; i++) {
+        size_t sz = rand_uint64(1, 64 * 1024);
+        size_t chunk_size = min_obj_size;
+        while (chunk_size < sz)
+            chunk_size *= 2;
+        GlobalPtr ptr = heap->Alloc(sz);
+        EXPECT_TRUE(ptr.IsValid());
+        ptrs.push_back(ptr);
+        used += chunk_size;
+    }
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats, true));
+    EXPECT_EQ(base_used + used, stats.used_bytes);
+    EXPECT_EQ(stats.grown_size, stats.free_bytes + stats.used_bytes);
+    ExpectSameFreeChunks(heap);
+
+    // delayed frees stay in use until they are done
+    {
+        EpochOp op(em);
+        heap->FreeBatch(op, ptrs.data(), ptrs.size() / 2);
+    }
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats, true));
+    EXPECT_EQ(ptrs.size() / 2, stats.delayed_free_chunks);
+    EXPECT_GT(stats.delayed_free_bytes, 0U);
+    EXPECT_EQ(base_used + used, stats.used_bytes);
+    ExpectSameFreeChunks(heap);
+    heap->OfflineFree();
+    heap->FreeBatch(ptrs.data() + ptrs.size() / 2, ptrs.size() - ptrs.size() / 2);
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats, true));
+    EXPECT_EQ(0U, stats.delayed_free_chunks);
+    EXPECT_EQ(base_used, stats.used_bytes);
+    ExpectSameFreeChunks(heap);
+
+    // merging brings back the fragmentation of the fresh heap
+    heap->Merge();
+    ExpectSameFreeChunks(heap);
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats));
+    EXPECT_EQ(base_used, stats.used_bytes);
+    EXPECT_DOUBLE_EQ(base_fragmentation, stats.fragmentation);
+
+    // a huge object has a shelf of its own
+    GlobalPtr huge = heap->Alloc(huge_size);
+    EXPECT_TRUE(huge.IsValid());
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats));
+    ASSERT_EQ(2U, stats.shelves.size());
+    EXPECT_TRUE(stats.shelves[1].huge);
+    EXPECT_EQ(huge.GetShelfId().GetShelfIndex(), stats.shelves[1].shelf_idx);
+    EXPECT_EQ(huge_size, stats.shelves[1].used_bytes);
+    EXPECT_EQ(base_used + huge_size, stats.used_bytes);
+    {
+        EpochOp op(em);
+        heap->Free(op, huge);
+    }
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats));
+    EXPECT_EQ(1U, stats.delayed_free_chunks);
+    heap->OfflineFree();
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats));
+    EXPECT_EQ(1U, stats.shelves.size());
+
+    // recovery leaves the counters right
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    heap->OfflineRecover();
+    ExpectSameFreeChunks(heap);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    config.HugeAllocThreshold = threshold;
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+// fills up the heap as it is, down to the smallest chunks
+void FillHeap(Heap *heap, std::vector<GlobalPtr> &ptrs) {
+    for (size_t sz = 1024 * 1024; sz >= heap->MinAllocSize(); sz /= 2) {
+        for (;;) {
+            GlobalPtr ptr = heap->Alloc(sz);
+            if (!ptr.IsValid())
+                break;
+            ptrs.push_back(ptr);
+        }
+    }
+}
+
+// allocations go to the shelf with space, not the first one
+TEST(EpochZoneHeap, ShelfHint) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    // three full shelves and an empty one
+    std::vector<GlobalPtr> ptrs;
+    FillHeap(heap, ptrs);
+    for (int i = 2; i <= 3; i++) {
+        EXPECT_EQ(NO_ERROR, heap->Resize(size * i));
+        FillHeap(heap, ptrs);
+    }
+    EXPECT_EQ(NO_ERROR, heap->Resize(size * 4));
+    GlobalPtr ptr = heap->Alloc(4096);
+    EXPECT_EQ(4, ptr.GetShelfId().GetShelfIndex());
+
+    // this thread sticks to the shelf it allocated from last; a thread
+    // without a hint starts at the first shelf with space
+    heap->Free(ptrs[0]);
+    ptr = heap->Alloc(4096);
+    EXPECT_EQ(4, ptr.GetShelfId().GetShelfIndex());
+    std::thread other([&]() {
+        GlobalPtr ptr = heap->Alloc(4096);
+        EXPECT_EQ(1, ptr.GetShelfId().GetShelfIndex());
+        heap->Free(ptr);
+    });
+    other.join();
+
+    // a hint from an earlier Open is ignored
+    EXPECT_EQ(NO_ERROR, heap->Close());
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    ptr = heap->Alloc(4096);
+    EXPECT_EQ(1, ptr.GetShelfId().GetShelfIndex());
+
+    // a full heap still fails
+    FillHeap(heap, ptrs);
+    EXPECT_FALSE(heap->Alloc(heap->MinAllocSize()).IsValid());
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    EXPECT_EQ(ID_NOT_FOUND, mm->DestroyHeap(pool_id));
+}
+
+// delayed frees are buffered per thread and published by the end of the op
+TEST(EpochZoneHeap, DelayedFreeBuffer) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+    HeapStats stats;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+    EXPECT_EQ(NO_ERROR, heap->Resize(size * 2));
+
+    // more chunks than a buffer holds, over both shelves and both kinds of
+    // free
+    const int cnt = 300;
+    std::vector<GlobalPtr> ptrs;
+    for (int i = 0; i < cnt; i++)
+        ptrs.push_back(heap->Alloc(1024));
+    for (int i = 0; i < 3; i++)
+        ptrs.push_back(heap->Alloc(64 * 1024 * 1024LLU));
+    std::set<ShelfIndex> shelves;
+    for (auto ptr : ptrs) {
+        EXPECT_TRUE(ptr.IsValid());
+        shelves.insert(ptr.GetShelfId().GetShelfIndex());
+    }
+    EXPECT_EQ(2U, shelves.size());
+    {
+        EpochOp op(em);
+        for (size_t i = 0; i < ptrs.size(); i++) {
+            if (i % 2 && i < cnt)
+                heap->Free(op, ptrs[i], 1024);
+            else
+                heap->Free(op, ptrs[i]);
+            if (i == 10) {
+                // an inner op publishes what is buffered so far
+                EpochOp inner(em);
+            }
+        }
+    }
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats, true));
+    EXPECT_EQ(ptrs.size(), stats.delayed_free_chunks);
+
+    // all of them come back
+    heap->OfflineFree();
+    EXPECT_EQ(NO_ERROR, heap->GetStats(&stats, true));
+    EXPECT_EQ(0U, stats.delayed_free_chunks);
+    EXPECT_TRUE(heap->Alloc(64 * 1024 * 1024LLU).IsValid());
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+}
+
+// the worker drains the delayed free lists as their epochs pass
+TEST(EpochZoneHeap, DelayedFreeBacklog) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open());
+    EXPECT_EQ(0U, heap->DelayedFreeBacklog());
+
+    // more than a round of the worker frees at first
+    const int cnt = 10000;
+    std::vector<GlobalPtr> ptrs;
+    for (int i = 0; i < cnt; i++) {
+        ptrs.push_back(heap->Alloc(1024));
+        EXPECT_TRUE(ptrs.back().IsValid());
+    }
+    {
+        EpochOp op(em);
+        for (auto ptr : ptrs)
+            heap->Free(op, ptr);
+    }
+    EXPECT_LT(0U, heap->DelayedFreeBacklog());
+    EXPECT_GE((uint64_t)cnt, heap->DelayedFreeBacklog());
+
+    for (int i = 0; i < 100 && heap->DelayedFreeBacklog() != 0; i++)
+        usleep(100000);
+    EXPECT_EQ(0U, heap->DelayedFreeBacklog());
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+}
+
+// an alloc that would split takes a due chunk of its level instead
+TEST(EpochZoneHeap, AllocRecycled) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    EpochManager *em = EpochManager::GetInstance();
+    Heap *heap = NULL;
+
+    EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+    EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+
+    // take both halves, so the level has nothing free
+    GlobalPtr ptr1 = heap->Alloc(4096);
+    GlobalPtr ptr2 = heap->Alloc(4096);
+    EXPECT_TRUE(ptr1.IsValid());
+    EXPECT_TRUE(ptr2.IsValid());
+    memset(mm->GlobalToLocal(ptr1), 1, 4096);
+
+    EpochCounter e;
+    {
+        EpochOp op(em);
+        e = op.reported_epoch();
+        heap->Free(op, ptr1);
+    }
+
+    // the reported epoch stays put inside an op, wait for one where the
+    // free is due
+    GlobalPtr ptr;
+    while (1) {
+        {
+            EpochOp op(em);
+            EpochCounter now = op.reported_epoch();
+            if (now >= e + 3 && (now - e - 3) % 5 == 0) {
+                ptr = heap->Alloc(op, 4096);
+                break;
+            }
+        }
+        usleep(100);
+    }
+    EXPECT_EQ(ptr1, ptr);
+    char zero[4096] = {0};
+    EXPECT_EQ(0, memcmp(zero, mm->GlobalToLocal(ptr), 4096));
+    EXPECT_EQ(0U, heap->DelayedFreeBacklog());
+
+    heap->Free(ptr);
+    heap->Free(ptr2);
+    EXPECT_EQ(NO_ERROR, heap->Close());
+
+    delete heap;
+    EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+}
+
+// the memory policy of the page at addr, and its nodes
+int GetMemPolicy(void *addr, unsigned long *nodes) {
+    int mode = -1;
+    *nodes = 0;
+    EXPECT_EQ(0, syscall(SYS_get_mempolicy, &mode, nodes, 64 + 1, addr,
+                         MPOL_F_ADDR));
+    return mode;
+}
+
+// data shelves go on the nodes the policy says, for Resize too
+TEST(EpochZoneHeap, NumaPlacement) {
+    PoolId pool_id = 1;
+    size_t size = 128 * 1024 * 1024LLU; // 128 MB
+
+    MemoryManager *mm = MemoryManager::GetInstance();
+    Heap *heap = NULL;
+    std::string policy = config.NumaPolicy;
+    std::vector<uint64_t> nodes = config.NumaNodes;
+
+    // bad policies are refused before anything is created
+    config.NumaPolicy = "nearby";
+    EXPECT_NE(NO_ERROR, mm->CreateHeap(pool_id, size));
+    config.NumaPolicy = "explicit";
+    config.NumaNodes = {};
+    EXPECT_NE(NO_ERROR, mm->CreateHeap(pool_id, size));
+    config.NumaNodes = {kMaxNumaNodes};
+    EXPECT_NE(NO_ERROR, mm->CreateHeap(pool_id, size));
+    EXPECT_EQ(ID_NOT_FOUND, mm->FindHeap(pool_id, &heap));
+
+    for (std::string p : {"none", "interleave", "per_node", "explicit"}) {
+        config.NumaPolicy = p;
+        config.NumaNodes = {0};
+        EXPECT_EQ(NO_ERROR, mm->CreateHeap(pool_id, size));
+        // Open goes by what was picked at creation
+        config.NumaPolicy = "none";
+        EXPECT_EQ(NO_ERROR, mm->FindHeap(pool_id, &heap));
+        EXPECT_EQ(NO_ERROR, heap->Open(NVMM_NO_BG_THREAD));
+        EXPECT_EQ(NO_ERROR, heap->Resize(size * 2));
+
+        for (int i = 0; i < 2; i++) {
+            GlobalPtr ptr = heap->Alloc(size / 2);
+            EXPECT_TRUE(ptr.IsValid());
+            char *addr = (char *)mm->GlobalToLocal(ptr);
+            memset(addr, 1, 4096);
+            unsigned long mask;
+            int mode = GetMemPolicy(addr, &mask);
+            if (p == "none") {
+                EXPECT_EQ(MPOL_DEFAULT, mode);
+            } else if (p == "interleave") {
+                EXPECT_EQ(MPOL_INTERLEAVE, mode);
+                EXPECT_EQ(numa_online_nodes(), mask);
+            } else {
+                // a single node here, so both land on node 0
+                EXPECT_EQ(MPOL_BIND, mode);
+                EXPECT_EQ(1UL, mask);
+            }
+        }
+        EXPECT_EQ(NO_ERROR, heap->Close());
+
+        delete heap;
+        EXPECT_EQ(NO_ERROR, mm->DestroyHeap(pool_id));
+    }
+    config.NumaPolicy = policy;
+    config.NumaNodes = nodes;
+}
+
+// critical regions keep their epoch and hold back the reported epoch
+TEST(EpochZoneHeap, ThreadEpochs) {
+    EpochManager *em = EpochManager::GetInstance();
+    EpochCounter e;
+    {
+        EpochOp op(em);
+        e = op.reported_epoch();
+        EXPECT_TRUE(em->exists_active_critical());
+        {
+            EpochOp inner(em);
+            EXPECT_EQ(e, inner.reported_epoch());
+        }
+        // other threads come and go meanwhile
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 8; i++) {
+            threads.push_back(std::thread([em] {
+                for (int j = 0; j < 10000; j++) {
+                    EpochOp op(em);
+                    (void)op.reported_epoch();
+                }
+            }));
+        }
+        for (auto &t : threads)
+            t.join();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_EQ(e, op.reported_epoch());
+        EXPECT_LE(em->frontier_epoch(), e + 1);
+    }
+
+    // once the region is over the epoch moves on
+    for (int i = 0; i < 1000 && em->reported_epoch() <= e + 1; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_LT(e + 1, em->reported_epoch());
+}
+
 int main(int argc, char **argv) {
     InitTest(nvmm::trace, false);
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,129 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "test_common/test.h"
+
+#include "common/scheduler.h"
+
+using namespace nvmm;
+
+static void WaitFor(std::atomic<int> &cnt, int want) {
+    for (int i = 0; i < 2000 && cnt.load() < want; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+TEST(Scheduler, Periodic) {
+    Scheduler *scheduler = Scheduler::GetInstance();
+    std::atomic<int> runs(0);
+    int handle = scheduler->AddTask([&runs] {
+        runs++;
+        return (uint64_t)2000;
+    }, 0);
+    EXPECT_LE(0, handle);
+    WaitFor(runs, 5);
+    EXPECT_LE(5, runs.load());
+    EXPECT_LE(1U, scheduler->ThreadCount());
+
+    scheduler->RemoveTask(handle);
+    int cnt = runs.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(cnt, runs.load());
+}
+
+TEST(Scheduler, Wake) {
+    Scheduler *scheduler = Scheduler::GetInstance();
+    std::atomic<int> runs(0);
+    int handle = scheduler->AddTask([&runs] {
+        runs++;
+        return Scheduler::kIdle;
+    }, Scheduler::kIdle);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(0, runs.load());
+
+    for (int i = 1; i <= 3; i++) {
+        scheduler->Wake(handle);
+        WaitFor(runs, i);
+        EXPECT_EQ(i, runs.load());
+    }
+    scheduler->RemoveTask(handle);
+    // a removed handle is ignored
+    scheduler->Wake(handle);
+    scheduler->RemoveTask(handle);
+}
+
+TEST(Scheduler, RemoveItself) {
+    Scheduler *scheduler = Scheduler::GetInstance();
+    std::atomic<int> runs(0);
+    std::atomic<int> handle(-1);
+    handle = scheduler->AddTask([&] {
+        runs++;
+        scheduler->RemoveTask(handle.load());
+        return (uint64_t)0;
+    }, Scheduler::kIdle);
+    scheduler->Wake(handle.load());
+    WaitFor(runs, 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(1, runs.load());
+}
+
+// many more tasks than threads, none of them runs twice at once
+TEST(Scheduler, ManyTasks) {
+    Scheduler *scheduler = Scheduler::GetInstance();
+    int const kTasks = 64;
+    std::atomic<int> runs(0);
+    std::atomic<int> inside[kTasks];
+    std::atomic<bool> overlap(false);
+    int handles[kTasks];
+    for (int i = 0; i < kTasks; i++) {
+        inside[i] = 0;
+        handles[i] = scheduler->AddTask([&, i] {
+            if (inside[i]++ != 0)
+                overlap = true;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            inside[i]--;
+            runs++;
+            return (uint64_t)(i % 7) * 1000;
+        }, i * 100);
+    }
+    for (int i = 0; i < kTasks; i++)
+        scheduler->Wake(handles[i]);
+    WaitFor(runs, kTasks * 4);
+    for (int i = 0; i < kTasks; i++)
+        scheduler->RemoveTask(handles[i]);
+    EXPECT_LE(kTasks * 4, runs.load());
+    EXPECT_FALSE(overlap.load());
+}
+
+int main(int argc, char **argv) {
+    InitTest();
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
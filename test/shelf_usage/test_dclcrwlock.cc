@@ -0,0 +1,144 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <stdint.h>
+#include <unistd.h> // sysconf
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "test_common/test.h"
+
+#include "shelf_usage/dclcrwlock.h"
+#include "shelf_usage/hrtime.h"
+
+using namespace nvmm;
+using namespace nvmm::internal;
+
+static int OnlineCpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// readers never see a half done write, even when they move between CPUs
+static void CheckExclusion(DCLCRWLock &lock) {
+    int const kReaders = 8;
+    int const kWrites = 2000;
+    volatile uint64_t a = 0, b = 0;
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> torn(0);
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < kReaders; i++) {
+        readers.push_back(std::thread([&] {
+            uint64_t cnt = 0;
+            while (!done.load()) {
+                lock.sharedLock();
+                uint64_t x = a;
+                if (++cnt % 16 == 0)
+                    std::this_thread::yield();
+                if (b != x)
+                    torn++;
+                EXPECT_TRUE(lock.sharedUnlock());
+                if (lock.trySharedLock()) {
+                    EXPECT_TRUE(lock.sharedUnlock());
+                }
+            }
+        }));
+    }
+    for (int i = 0; i < kWrites; i++) {
+        lock.exclusiveLock();
+        a = a + 1;
+        std::this_thread::yield();
+        b = b + 1;
+        EXPECT_TRUE(lock.exclusiveUnlock());
+    }
+    done = true;
+    for (auto &t : readers)
+        t.join();
+    EXPECT_EQ(0U, torn.load());
+    EXPECT_EQ((uint64_t)kWrites, (uint64_t)b);
+}
+
+TEST(DCLCRWLock, CpuSlots) {
+    DCLCRWLock lock;
+    CheckExclusion(lock);
+}
+
+TEST(DCLCRWLock, HashSlots) {
+    DCLCRWLock lock(OnlineCpus(), false);
+    CheckExclusion(lock);
+}
+
+// shared lock/unlock pairs per second of all readers together
+static double ReaderThroughput(DCLCRWLock &lock, int threads) {
+    uint64_t const kRunUs = 200000;
+    std::atomic<bool> start(false), stop(false);
+    std::atomic<uint64_t> total(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < threads; i++) {
+        readers.push_back(std::thread([&] {
+            while (!start.load())
+                ;
+            uint64_t cnt = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                lock.sharedLock();
+                lock.sharedUnlock();
+                cnt++;
+            }
+            total += cnt;
+        }));
+    }
+    HRTime begin = get_hrtime();
+    start = true;
+    std::this_thread::sleep_for(std::chrono::microseconds(kRunUs));
+    stop = true;
+    for (auto &t : readers)
+        t.join();
+    HRTime end = get_hrtime();
+    return (double)total.load() * 1000000 / diff_hrtime_us(begin, end);
+}
+
+TEST(DCLCRWLock, ReaderThroughput) {
+    int cpus = OnlineCpus();
+    for (int threads = 1; threads <= cpus * 2; threads *= 2) {
+        DCLCRWLock cpu_lock(cpus, true);
+        DCLCRWLock hash_lock(cpus, false);
+        double cpu_ops = ReaderThroughput(cpu_lock, threads);
+        double hash_ops = ReaderThroughput(hash_lock, threads);
+        std::cout << threads << " readers (Mops/s): cpu slots "
+                  << cpu_ops / 1000000 << ", hash slots "
+                  << hash_ops / 1000000 << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    InitTest();
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
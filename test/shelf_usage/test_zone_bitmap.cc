@@ -0,0 +1,189 @@
+/*
+ *  (c) Copyright 2016-2021 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This software is available to you under a choice of one of two
+ *  licenses. You may choose to be licensed under the terms of the 
+ *  GNU Lesser General Public License Version 3, or (at your option)  
+ *  later with exceptions included below, or under the terms of the  
+ *  MIT license (Expat) available in COPYING file in the source tree.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h> // memset
+#include <iostream>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "test_common/test.h"
+
+#include "shelf_usage/hrtime.h"
+#include "shelf_usage/zone_bitmap.h"
+
+using namespace nvmm;
+using namespace nvmm::internal;
+
+static BitmapKernel const kKernels[] = {
+    BITMAP_KERNEL_SCALAR, BITMAP_KERNEL_AVX2, BITMAP_KERNEL_AVX512};
+
+// runs of zero, full and random words
+static std::vector<uint64_t> RandomBitmap(std::mt19937_64 &rng, size_t cnt) {
+    std::vector<uint64_t> words(cnt);
+    for (size_t i = 0; i < cnt;) {
+        size_t run = rng() % 40 + 1;
+        uint64_t kind = rng() % 3;
+        for (; run > 0 && i < cnt; run--, i++)
+            words[i] = kind == 0 ? 0 : kind == 1 ? ~0UL : rng();
+    }
+    return words;
+}
+
+TEST(ZoneBitmap, Helpers) {
+    EXPECT_EQ(0x5555555555555555UL, bitmap_group_starts(2));
+    EXPECT_EQ(0x0000000100000001UL, bitmap_group_starts(32));
+    EXPECT_EQ(0x0000000000000011UL,
+              bitmap_full_groups(0x00000000000000FFUL, 4));
+    EXPECT_EQ(0x0000000000000010UL,
+              bitmap_full_groups(0x00000000000000F7UL, 4));
+    EXPECT_EQ(0x0000000000000001UL, bitmap_buddy_pairs(0x000000000000000BUL));
+    EXPECT_EQ(0x0000000000000004UL,
+              bitmap_buddy_singles(0x000000000000000BUL));
+}
+
+TEST(ZoneBitmap, Kernels) {
+    BitmapKernel orig = bitmap_kernel();
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> words = RandomBitmap(rng, 1000);
+    std::vector<uint64_t> entries(1000 * 64 + 13);
+    for (auto &entry : entries)
+        entry = rng() & 0xC1000000000000FFUL;
+    uint64_t mask = 0xC100000000000000UL, value = 0x8000000000000000UL;
+    std::vector<uint32_t> entries32(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+        entries32[i] = (uint32_t)(entries[i] >> 32) | (uint32_t)(entries[i] & 0xFF);
+    uint32_t mask32 = (uint32_t)(mask >> 32), value32 = (uint32_t)(value >> 32);
+
+    std::vector<uint64_t> expected(words.size() + 1);
+    ASSERT_TRUE(bitmap_set_kernel(BITMAP_KERNEL_SCALAR));
+    bitmap_match_entries(entries.data(), entries.size(), mask, value,
+                         expected.data());
+    std::vector<uint64_t> expected32(words.size() + 1);
+    bitmap_match_entries32(entries32.data(), entries32.size(), mask32,
+                           value32, expected32.data());
+    EXPECT_EQ(expected, expected32);
+    uint64_t popcount = bitmap_popcount(words.data(), words.size());
+
+    for (auto kernel : kKernels) {
+        if (!bitmap_set_kernel(kernel)) {
+            std::cout << bitmap_kernel_name(kernel) << ": not supported"
+                      << std::endl;
+            continue;
+        }
+        for (uint64_t from = 0; from < words.size(); from += 7) {
+            for (uint64_t to = from; to <= words.size(); to += 61) {
+                uint64_t i;
+                for (i = from; i < to && words[i] == 0; i++)
+                    ;
+                EXPECT_EQ(i, bitmap_find_nonzero(words.data(), from, to));
+                for (i = from; i < to && words[i] == ~0UL; i++)
+                    ;
+                EXPECT_EQ(i, bitmap_find_not_full(words.data(), from, to));
+                for (i = from; i < to && (words[i] == 0 || words[i] == ~0UL);
+                     i++)
+                    ;
+                EXPECT_EQ(i, bitmap_find_mixed(words.data(), from, to));
+            }
+        }
+        for (uint64_t cnt = 0; cnt < 9; cnt++)
+            EXPECT_EQ(bitmap_popcount(words.data() + 3, cnt),
+                      [&]() {
+                          uint64_t total = 0;
+                          for (uint64_t i = 0; i < cnt; i++)
+                              total += (uint64_t)__builtin_popcountl(words[3 + i]);
+                          return total;
+                      }());
+        EXPECT_EQ(popcount, bitmap_popcount(words.data(), words.size()));
+
+        std::vector<uint64_t> matched(words.size() + 1);
+        bitmap_match_entries(entries.data(), entries.size(), mask, value,
+                             matched.data());
+        EXPECT_EQ(expected, matched);
+
+        std::vector<uint64_t> matched32(words.size() + 1);
+        bitmap_match_entries32(entries32.data(), entries32.size(), mask32,
+                               value32, matched32.data());
+        EXPECT_EQ(expected, matched32);
+    }
+    bitmap_set_kernel(orig);
+}
+
+// Not part of the regular run (needs 2 GB of memory); use
+// --gtest_also_run_disabled_tests to see what each kernel does on a header
+// of a 64 GB zone with 64-byte minimum objects.
+TEST(ZoneBitmap, DISABLED_Benchmark) {
+    BitmapKernel orig = bitmap_kernel();
+    size_t entry_cnt = 1024 * 1024 * 1024LLU / sizeof(uint64_t); // 1 GB
+    // the merge bitmap of a zone with as many chunks, padded to 1 GB
+    size_t word_cnt = 1024 * 1024 * 1024LLU / sizeof(uint64_t);
+
+    std::vector<uint64_t> entries(entry_cnt, 0x8100000000000000UL);
+    std::vector<uint64_t> words(word_cnt);
+    for (auto kernel : kKernels) {
+        if (!bitmap_set_kernel(kernel))
+            continue;
+        HRTime start, end;
+
+        // empty bitmap: a merge with no free chunk left
+        memset(words.data(), 0, word_cnt * sizeof(uint64_t));
+        start = get_hrtime();
+        EXPECT_EQ(word_cnt, bitmap_find_nonzero(words.data(), 0, word_cnt));
+        end = get_hrtime();
+        size_t nonzero_us = diff_hrtime_us(start, end);
+
+        // full bitmap: garbage collection of a consistent zone
+        memset(words.data(), 0xff, word_cnt * sizeof(uint64_t));
+        start = get_hrtime();
+        EXPECT_EQ(word_cnt, bitmap_find_mixed(words.data(), 0, word_cnt));
+        end = get_hrtime();
+        size_t mixed_us = diff_hrtime_us(start, end);
+
+        start = get_hrtime();
+        EXPECT_EQ(word_cnt * 64, bitmap_popcount(words.data(), word_cnt));
+        end = get_hrtime();
+        size_t popcount_us = diff_hrtime_us(start, end);
+
+        memset(words.data(), 0, word_cnt * sizeof(uint64_t));
+        start = get_hrtime();
+        bitmap_match_entries(entries.data(), entry_cnt, 0xBF00000000000000UL,
+                             0x8000000000000000UL, words.data());
+        end = get_hrtime();
+        size_t match_us = diff_hrtime_us(start, end);
+
+        std::cout << bitmap_kernel_name(kernel) << " (us per GB):"
+                  << " find_nonzero " << nonzero_us << ", find_mixed "
+                  << mixed_us << ", popcount " << popcount_us
+                  << ", match_entries " << match_us << std::endl;
+    }
+    bitmap_set_kernel(orig);
+}
+
+int main(int argc, char **argv) {
+    InitTest();
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}